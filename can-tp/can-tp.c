@@ -0,0 +1,520 @@
+/*
+	Molole - Mobots Low Level library
+	An open source toolkit for robot programming using DsPICs
+
+	Copyright (C) 2007--2011 Stephane Magnenat <stephane at magnenat dot net>,
+	Philippe Retornaz <philippe dot retornaz at epfl dot ch>
+	Mobots group (http://mobots.epfl.ch), Robotics system laboratory (http://lsro.epfl.ch)
+	EPFL Ecole polytechnique federale de Lausanne (http://www.epfl.ch)
+
+	See authors.txt for more details about other contributors.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//--------------------
+// Usage documentation
+//--------------------
+
+/**
+	\defgroup can-tp CAN segmented transfers
+	
+	Segmentation and reassembly of messages of up to 4095 bytes over CAN, in the style of ISO-TP (ISO 15765-2).
+
+	A message of up to 7 bytes is sent in a single frame. Longer messages start with a first frame,
+	then the receiver answers with a flow control frame giving the amount of consecutive frames it
+	accepts before the next flow control (the block size) and the minimum time between them (STmin),
+	and the sender sends the rest in consecutive frames.
+	
+	The application calls can_tp_init() once, then allocates a \ref can_tp_session per peer and initializes
+	it with can_tp_init_session(). Each session uses one identifier to send and one to receive, several
+	sessions can transfer concurrently. Received frames must be given to can_tp_frame_received(),
+	typically from the CAN receive callback, and can_tp_tick() must be called every ms, it paces the
+	consecutive frames and handles timeouts. Calling can_tp_tick(0) from the CAN sent callback refills
+	the transmit queue as soon as there is room, which keeps the bus busy when STmin is 0.
+	
+	Messages are sent from the buffer of the application, which must stay valid until the sent callback,
+	and received directly in the receive buffer of the session, without intermediate copy.
+	
+	Frames are sent through a function given to can_tp_init(), can_send_frame() by default. A loopback
+	function giving the frames back to can_tp_frame_received() allows to test two sessions without bus.
+*/
+/*@{*/
+
+/** \file
+	Implementation of the segmented transfers over CAN.
+*/
+
+
+//------------
+// Definitions
+//------------
+
+#include <string.h>
+
+#include "can-tp.h"
+#include "../error/error.h"
+
+/** Protocol control information of the frames, in the high nibble of the first byte */
+enum can_tp_frame_types
+{
+	CAN_TP_SINGLE_FRAME = 0x00,
+	CAN_TP_FIRST_FRAME = 0x10,
+	CAN_TP_CONSECUTIVE_FRAME = 0x20,
+	CAN_TP_FLOW_CONTROL = 0x30,
+};
+
+/** Flow status of the flow control frames */
+enum can_tp_flow_status
+{
+	CAN_TP_FLOW_CONTINUE = 0,
+	CAN_TP_FLOW_WAIT = 1,
+	CAN_TP_FLOW_OVERFLOW = 2,
+	CAN_TP_FLOW_NONE = 0xFF,			/**< no flow control to send */
+};
+
+/** States of a transmission */
+enum can_tp_tx_states
+{
+	CAN_TP_TX_IDLE = 0,
+	CAN_TP_TX_FIRST,					/**< the single or first frame is waiting for room */
+	CAN_TP_TX_WAIT_FLOW,				/**< waiting for a flow control */
+	CAN_TP_TX_CONSECUTIVE,				/**< sending consecutive frames */
+};
+
+//-----------------------
+// Structures definitions
+//-----------------------
+
+/** Segmented transfers data */
+static struct
+{
+	can_tp_session* sessions;			/**< list of the sessions */
+	can_tp_send_frame_function send_frame;
+} CAN_TP_Data;
+
+
+//------------------
+// Private functions
+//------------------
+
+/** Convert a STmin of the protocol into ms; 100 to 900 us are rounded up to the 1 ms resolution of can_tp_tick() */
+static unsigned int can_tp_st_min_to_ms(unsigned char st_min)
+{
+	if(st_min <= 0x7F)
+		return st_min;
+	if(st_min >= 0xF1 && st_min <= 0xF9)
+		return 1;
+	// reserved values must be handled as the maximum
+	return 0x7F;
+}
+
+/** Send the flow control a reception is waiting for, return false if there was no room */
+static bool can_tp_send_flow_control(can_tp_session* session)
+{
+	can_frame frame;
+
+	frame.id = session->tx_id;
+	frame.len = 3;
+	frame.data[0] = CAN_TP_FLOW_CONTROL | session->rx_fc_pending;
+	frame.data[1] = session->block_size;
+	frame.data[2] = session->st_min;
+	if(!CAN_TP_Data.send_frame(&frame))
+		return false;
+	session->rx_fc_pending = CAN_TP_FLOW_NONE;
+	return true;
+}
+
+/** End a transmission and notify the application */
+static void can_tp_tx_done(can_tp_session* session, int status)
+{
+	session->tx_state = CAN_TP_TX_IDLE;
+	if(session->sent_callback)
+		session->sent_callback(session, status);
+}
+
+/** Send the frames of a transmission that are due, as long as there is room.
+	The state is updated before sending, as a loopback send function answers immediately. */
+static void can_tp_tx_pump(can_tp_session* session)
+{
+	can_frame frame;
+	unsigned int len;
+	unsigned char block_left;
+	bool last;
+
+	if(session->tx_state == CAN_TP_TX_FIRST)
+	{
+		frame.id = session->tx_id;
+		if(session->tx_length <= 7)
+		{
+			frame.data[0] = CAN_TP_SINGLE_FRAME | session->tx_length;
+			memcpy(&frame.data[1], session->tx_data, session->tx_length);
+			frame.len = session->tx_length + 1;
+			session->tx_state = CAN_TP_TX_IDLE;
+			if(!CAN_TP_Data.send_frame(&frame))
+				session->tx_state = CAN_TP_TX_FIRST;
+			else if(session->sent_callback)
+				session->sent_callback(session, CAN_TP_STATUS_OK);
+			return;
+		}
+		frame.data[0] = CAN_TP_FIRST_FRAME | (session->tx_length >> 8);
+		frame.data[1] = session->tx_length;
+		memcpy(&frame.data[2], session->tx_data, 6);
+		frame.len = 8;
+		session->tx_sent = 6;
+		session->tx_sequence = 1;
+		session->tx_state = CAN_TP_TX_WAIT_FLOW;
+		session->tx_timer = CAN_TP_TIMEOUT;
+		if(!CAN_TP_Data.send_frame(&frame))
+			session->tx_state = CAN_TP_TX_FIRST;
+		return;
+	}
+
+	while(session->tx_state == CAN_TP_TX_CONSECUTIVE && !session->tx_timer)
+	{
+		len = session->tx_length - session->tx_sent;
+		if(len > 7)
+			len = 7;
+		frame.id = session->tx_id;
+		frame.data[0] = CAN_TP_CONSECUTIVE_FRAME | session->tx_sequence;
+		memcpy(&frame.data[1], session->tx_data + session->tx_sent, len);
+		frame.len = len + 1;
+
+		block_left = session->tx_block_left;
+		session->tx_sent += len;
+		session->tx_sequence = (session->tx_sequence + 1) & 0xF;
+		last = session->tx_sent == session->tx_length;
+		if(last)
+		{
+			session->tx_state = CAN_TP_TX_IDLE;
+		}
+		else if(session->tx_block_size && !--session->tx_block_left)
+		{
+			session->tx_state = CAN_TP_TX_WAIT_FLOW;
+			session->tx_timer = CAN_TP_TIMEOUT;
+		}
+		else
+		{
+			session->tx_timer = session->tx_st_min;
+		}
+
+		if(!CAN_TP_Data.send_frame(&frame))
+		{
+			// no room, try again later
+			session->tx_sent -= len;
+			session->tx_sequence = (session->tx_sequence - 1) & 0xF;
+			session->tx_block_left = block_left;
+			session->tx_state = CAN_TP_TX_CONSECUTIVE;
+			session->tx_timer = 0;
+			return;
+		}
+		if(last)
+		{
+			// the session may already be sending a new message
+			if(session->sent_callback)
+				session->sent_callback(session, CAN_TP_STATUS_OK);
+			return;
+		}
+	}
+}
+
+/** Handle a flow control frame for a transmission */
+static void can_tp_flow_control_received(can_tp_session* session, const can_frame* frame)
+{
+	if(session->tx_state != CAN_TP_TX_WAIT_FLOW || frame->len < 3)
+		return;
+
+	switch(frame->data[0] & 0x0F)
+	{
+		case CAN_TP_FLOW_CONTINUE:
+			session->tx_block_size = frame->data[1];
+			session->tx_block_left = frame->data[1];
+			session->tx_st_min = can_tp_st_min_to_ms(frame->data[2]);
+			session->tx_state = CAN_TP_TX_CONSECUTIVE;
+			session->tx_timer = 0;
+			can_tp_tx_pump(session);
+			break;
+		case CAN_TP_FLOW_WAIT:
+			session->tx_timer = CAN_TP_TIMEOUT;
+			break;
+		default:
+			can_tp_tx_done(session, CAN_TP_STATUS_OVERFLOW);
+			break;
+	}
+}
+
+/** Handle a data frame for a reception */
+static void can_tp_data_received(can_tp_session* session, const can_frame* frame)
+{
+	unsigned int len;
+
+	switch(frame->data[0] & 0xF0)
+	{
+		case CAN_TP_SINGLE_FRAME:
+			len = frame->data[0] & 0x0F;
+			if(!len || len > 7 || len + 1 > frame->len || len > session->rx_size)
+				return;
+			// a new message aborts the one being received
+			session->rx_length = 0;
+			memcpy(session->rx_buffer, &frame->data[1], len);
+			if(session->received_callback)
+				session->received_callback(session, session->rx_buffer, len);
+			break;
+
+		case CAN_TP_FIRST_FRAME:
+			if(frame->len < 8)
+				return;
+			len = ((frame->data[0] & 0x0F) << 8) | frame->data[1];
+			if(len < 8)
+				return;
+			if(len > session->rx_size)
+			{
+				session->rx_length = 0;
+				session->rx_fc_pending = CAN_TP_FLOW_OVERFLOW;
+				can_tp_send_flow_control(session);
+				return;
+			}
+			session->rx_length = len;
+			memcpy(session->rx_buffer, &frame->data[2], 6);
+			session->rx_received = 6;
+			session->rx_sequence = 1;
+			session->rx_block_left = session->block_size;
+			session->rx_timer = CAN_TP_TIMEOUT;
+			session->rx_fc_pending = CAN_TP_FLOW_CONTINUE;
+			can_tp_send_flow_control(session);
+			break;
+
+		case CAN_TP_CONSECUTIVE_FRAME:
+			if(!session->rx_length)
+				return;
+			if((frame->data[0] & 0x0F) != session->rx_sequence)
+			{
+				// a frame is missing, drop the message
+				session->rx_length = 0;
+				return;
+			}
+			len = session->rx_length - session->rx_received;
+			if(len > 7)
+				len = 7;
+			if(len + 1 > frame->len)
+			{
+				session->rx_length = 0;
+				return;
+			}
+			memcpy(session->rx_buffer + session->rx_received, &frame->data[1], len);
+			session->rx_received += len;
+			session->rx_sequence = (session->rx_sequence + 1) & 0xF;
+			session->rx_timer = CAN_TP_TIMEOUT;
+
+			if(session->rx_received == session->rx_length)
+			{
+				len = session->rx_length;
+				session->rx_length = 0;
+				if(session->received_callback)
+					session->received_callback(session, session->rx_buffer, len);
+			}
+			else if(session->block_size && !--session->rx_block_left)
+			{
+				session->rx_block_left = session->block_size;
+				session->rx_fc_pending = CAN_TP_FLOW_CONTINUE;
+				can_tp_send_flow_control(session);
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+
+//-------------------
+// Exported functions
+//-------------------
+
+/**
+	Init the segmented transfer layer, forgetting all sessions.
+	
+	\param	send_frame
+			function to send a frame, can_send_frame() if NULL
+*/
+void can_tp_init(can_tp_send_frame_function send_frame)
+{
+	CAN_TP_Data.sessions = NULL;
+	CAN_TP_Data.send_frame = send_frame ? send_frame : can_send_frame;
+}
+
+/**
+	Init a session and add it to the active ones.
+	
+	\param	session
+			session to initialize, must stay allocated while the layer runs
+	\param	tx_id
+			identifier of the frames sent by this node
+	\param	rx_id
+			identifier of the frames sent by the peer
+	\param	rx_buffer
+			buffer in which the messages are received
+	\param	rx_size
+			size of rx_buffer, longer messages are refused
+	\param	block_size
+			amount of consecutive frames the peer can send before waiting for a flow control, 0 for no limit
+	\param	st_min
+			minimum time between the consecutive frames of the peer: from 0 to 127 ms, or 0xF1 to 0xF9 for 100 to 900 us
+	\param	received_callback
+			function called when a message has been received, from the context of can_tp_frame_received(). Can be NULL.
+	\param	sent_callback
+			function called when a transmission is over. Can be NULL.
+*/
+void can_tp_init_session(can_tp_session* session, unsigned long tx_id, unsigned long rx_id, unsigned char* rx_buffer, unsigned int rx_size, unsigned char block_size, unsigned char st_min, can_tp_received_callback received_callback, can_tp_sent_callback sent_callback)
+{
+	int flags;
+
+	if(!session || !rx_buffer || !rx_size)
+		ERROR(CAN_TP_ERROR_INVALID_SESSION, session);
+
+	session->tx_id = tx_id;
+	session->rx_id = rx_id;
+	session->block_size = block_size;
+	session->st_min = st_min;
+	session->rx_buffer = rx_buffer;
+	session->rx_size = rx_size;
+	session->rx_length = 0;
+	session->rx_fc_pending = CAN_TP_FLOW_NONE;
+	session->received_callback = received_callback;
+	session->tx_state = CAN_TP_TX_IDLE;
+	session->sent_callback = sent_callback;
+
+	IRQ_DISABLE(flags);
+	session->next = CAN_TP_Data.sessions;
+	CAN_TP_Data.sessions = session;
+	IRQ_ENABLE(flags);
+}
+
+/**
+	Start sending a message.
+	
+	\param	session
+			session to send the message on
+	\param	data
+			message to send, must stay valid until the sent callback is called
+	\param	length
+			length of the message, from 1 to \ref CAN_TP_MAX_LENGTH
+	
+	\return	true if the transmission started, false if the session is already sending a message
+*/
+bool can_tp_send(can_tp_session* session, const unsigned char* data, unsigned int length)
+{
+	int flags;
+
+	ERROR_CHECK_RANGE(length, 1, CAN_TP_MAX_LENGTH, CAN_TP_ERROR_INVALID_LENGTH);
+
+	IRQ_DISABLE(flags);
+	if(session->tx_state != CAN_TP_TX_IDLE)
+	{
+		IRQ_ENABLE(flags);
+		return false;
+	}
+	session->tx_data = data;
+	session->tx_length = length;
+	session->tx_sent = 0;
+	session->tx_state = CAN_TP_TX_FIRST;
+	can_tp_tx_pump(session);
+	IRQ_ENABLE(flags);
+	return true;
+}
+
+/**
+	Return whether a session is sending a message.
+	
+	\param	session
+			session to check
+	
+	\return	true if a message is being sent, false otherwise
+*/
+bool can_tp_is_busy(const can_tp_session* session)
+{
+	return session->tx_state != CAN_TP_TX_IDLE;
+}
+
+/**
+	Give a received frame to the segmented transfer layer.
+	
+	\param	frame
+			received frame
+	
+	\return	true if the frame belongs to a session, false if the application must handle it
+*/
+bool can_tp_frame_received(const can_frame* frame)
+{
+	can_tp_session* session;
+
+	for(session = CAN_TP_Data.sessions; session; session = session->next)
+		if(session->rx_id == frame->id)
+			break;
+	if(!session)
+		return false;
+	if(!frame->len)
+		return true;
+
+	if((frame->data[0] & 0xF0) == CAN_TP_FLOW_CONTROL)
+		can_tp_flow_control_received(session, frame);
+	else
+		can_tp_data_received(session, frame);
+	return true;
+}
+
+/**
+	Advance the timers of the sessions and send the frames that are due, must be called every ms.
+	
+	\param	elapsed
+			time elapsed since the previous call in ms, 0 to only send the frames that are due
+*/
+void can_tp_tick(unsigned int elapsed)
+{
+	can_tp_session* session;
+	int flags;
+
+	for(session = CAN_TP_Data.sessions; session; session = session->next)
+	{
+		IRQ_DISABLE(flags);
+
+		if(session->rx_length)
+		{
+			if(session->rx_timer > elapsed)
+				session->rx_timer -= elapsed;
+			else
+				session->rx_length = 0;
+		}
+		if(session->rx_fc_pending != CAN_TP_FLOW_NONE)
+			can_tp_send_flow_control(session);
+
+		if(session->tx_state != CAN_TP_TX_IDLE)
+		{
+			if(session->tx_timer > elapsed)
+			{
+				session->tx_timer -= elapsed;
+			}
+			else
+			{
+				session->tx_timer = 0;
+				if(session->tx_state == CAN_TP_TX_WAIT_FLOW)
+					can_tp_tx_done(session, CAN_TP_STATUS_TIMEOUT);
+			}
+			can_tp_tx_pump(session);
+		}
+
+		IRQ_ENABLE(flags);
+	}
+}
+
+/*@}*/
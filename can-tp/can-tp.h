@@ -0,0 +1,122 @@
+/*
+	Molole - Mobots Low Level library
+	An open source toolkit for robot programming using DsPICs
+
+	Copyright (C) 2007--2011 Stephane Magnenat <stephane at magnenat dot net>,
+	Philippe Retornaz <philippe dot retornaz at epfl dot ch>
+	Mobots group (http://mobots.epfl.ch), Robotics system laboratory (http://lsro.epfl.ch)
+	EPFL Ecole polytechnique federale de Lausanne (http://www.epfl.ch)
+
+	See authors.txt for more details about other contributors.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _MOLOLE_CAN_TP_H
+#define _MOLOLE_CAN_TP_H
+
+#include "../types/types.h"
+#include "../can/can.h"
+
+/** \addtogroup can-tp */
+/*@{*/
+
+/** \file
+	Segmented transfers over CAN definitions
+*/
+
+// Defines
+
+/** Errors the segmented transfer layer can throw */
+enum can_tp_errors
+{
+	CAN_TP_ERROR_BASE = 0x1400,
+	CAN_TP_ERROR_INVALID_LENGTH,		/**< The length of a message is not between 1 and \ref CAN_TP_MAX_LENGTH */
+	CAN_TP_ERROR_INVALID_SESSION,		/**< The session is NULL or has no receive buffer */
+};
+
+/** Maximum length of a message */
+#define CAN_TP_MAX_LENGTH 4095
+
+/** Time without progress after which a transfer is aborted, in ms */
+#define CAN_TP_TIMEOUT 1000
+
+/** Outcome of a transmission, given to \ref can_tp_sent_callback */
+enum can_tp_status
+{
+	CAN_TP_STATUS_OK = 0,				/**< The whole message has been sent */
+	CAN_TP_STATUS_TIMEOUT,				/**< The receiver did not send a flow control in time */
+	CAN_TP_STATUS_OVERFLOW,				/**< The receiver has no room for the message */
+};
+
+struct can_tp_session_s;
+
+/** Function called when a message has been received, data points in the receive buffer of the session */
+typedef void (*can_tp_received_callback)(struct can_tp_session_s* session, unsigned char* data, unsigned int length);
+
+/** Function called when the transmission of a message is over, status is one of \ref can_tp_status */
+typedef void (*can_tp_sent_callback)(struct can_tp_session_s* session, int status);
+
+/** Function sending a frame, can_send_frame() or a stand-in for tests */
+typedef bool (*can_tp_send_frame_function)(const can_frame* frame);
+
+/** A session, exchanging messages with one peer.
+	Allocated by the application and initialized with can_tp_init_session(), the fields are private. */
+typedef struct can_tp_session_s
+{
+	struct can_tp_session_s* next;	/**< next session in the list */
+	unsigned long tx_id;			/**< identifier of the frames we send */
+	unsigned long rx_id;			/**< identifier of the frames the peer sends */
+	unsigned char block_size;		/**< amount of consecutive frames the peer can send between flow controls, 0 for no limit */
+	unsigned char st_min;			/**< minimum time between consecutive frames of the peer, in the CAN_TP format */
+
+	unsigned char* rx_buffer;		/**< where messages are reassembled */
+	unsigned int rx_size;			/**< size of rx_buffer */
+	unsigned int rx_length;			/**< length of the message being received, 0 if none */
+	unsigned int rx_received;		/**< amount of bytes of the message already received */
+	unsigned char rx_sequence;		/**< sequence number of the next consecutive frame */
+	unsigned char rx_block_left;	/**< consecutive frames before the next flow control */
+	unsigned char rx_fc_pending;	/**< flow control status to send, 0xFF if none */
+	unsigned int rx_timer;			/**< ms left before the reception is aborted */
+	can_tp_received_callback received_callback;
+
+	const unsigned char* tx_data;	/**< message being sent, owned by the application */
+	unsigned int tx_length;			/**< length of the message being sent */
+	unsigned int tx_sent;			/**< amount of bytes already sent */
+	unsigned char tx_state;			/**< state of the transmission */
+	unsigned char tx_sequence;		/**< sequence number of the next consecutive frame */
+	unsigned char tx_block_size;	/**< block size asked by the receiver */
+	unsigned char tx_block_left;	/**< consecutive frames before waiting for a flow control */
+	unsigned int tx_st_min;			/**< time between consecutive frames asked by the receiver, in ms */
+	unsigned int tx_timer;			/**< ms before the next consecutive frame, or before the timeout when waiting a flow control */
+	can_tp_sent_callback sent_callback;
+} can_tp_session;
+
+// Functions, doc in the .c
+
+void can_tp_init(can_tp_send_frame_function send_frame);
+
+void can_tp_init_session(can_tp_session* session, unsigned long tx_id, unsigned long rx_id, unsigned char* rx_buffer, unsigned int rx_size, unsigned char block_size, unsigned char st_min, can_tp_received_callback received_callback, can_tp_sent_callback sent_callback);
+
+bool can_tp_send(can_tp_session* session, const unsigned char* data, unsigned int length);
+
+bool can_tp_is_busy(const can_tp_session* session);
+
+bool can_tp_frame_received(const can_frame* frame);
+
+void can_tp_tick(unsigned int elapsed);
+
+/*@}*/
+
+#endif
@@ -0,0 +1,122 @@
+/*
+	Molole - Mobots Low Level library
+	An open source toolkit for robot programming using DsPICs
+
+	Copyright (C) 2007--2011 Stephane Magnenat <stephane at magnenat dot net>,
+	Philippe Retornaz <philippe dot retornaz at epfl dot ch>
+	Mobots group (http://mobots.epfl.ch), Robotics system laboratory (http://lsro.epfl.ch)
+	EPFL Ecole polytechnique federale de Lausanne (http://www.epfl.ch)
+
+	See authors.txt for more details about other contributors.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/** \addtogroup can */
+/*@{*/
+
+/** \file
+	CAN bit timing computation, independent of the hardware.
+*/
+
+#include "bit_timing.h"
+
+/*! Maximum bitrate error accepted, in per mille of the requested bitrate */
+#define CAN_MAX_BITRATE_ERROR 5
+
+/*! Absolute difference of two unsigned values */
+#define CAN_ABS_DIFF(a, b) ((a) > (b) ? (a) - (b) : (b) - (a))
+
+/**
+	Compute the bit timing of the CAN module for a bitrate.
+	
+	Among the bit times from 25 to 8 Tq, the solver takes the one of smallest bitrate error, then
+	of closest sample point, then of largest amount of Tq. The phase segment 2 sets the sample point,
+	the remaining time is split between the propagation and phase 1 segments, and the
+	synchronisation jump width is the largest allowed, which maximises the oscillator tolerance.
+	This function does not touch the hardware.
+	
+	\param	fcan
+			clock of the CAN module in Hz
+	\param	bitrate
+			requested bitrate in bit/s
+	\param	sample_point
+			requested sample point in per mille of the bit time, typically 875
+	\param	timing
+			the computed timing, valid if 1 is returned
+	
+	\return	1 if a timing within 0.5% of the requested bitrate was found, 0 otherwise
+*/
+int can_compute_bit_timing(unsigned long fcan, unsigned long bitrate, unsigned int sample_point, can_bit_timing* timing)
+{
+	unsigned int ntq;
+	unsigned long brp;
+	unsigned long actual;
+	unsigned long error;
+	unsigned long best_error = 0xFFFFFFFFUL;
+	unsigned int best_sp_error = 0xFFFF;
+	unsigned int seg2, rest, sp, sp_error;
+	int found = 0;
+
+	if(!bitrate || sample_point >= 1000)
+		return 0;
+
+	for(ntq = 25; ntq >= 8; ntq--)
+	{
+		/* The bit time is 2 * brp * ntq FCAN periods */
+		brp = (fcan + bitrate * ntq) / (2 * bitrate * ntq);
+		if(brp < 1 || brp > 64)
+			continue;
+		actual = fcan / (2 * brp * ntq);
+		error = CAN_ABS_DIFF(actual, bitrate);
+
+		seg2 = (ntq * (1000 - sample_point) + 500) / 1000;
+		if(seg2 < 2)
+			seg2 = 2;
+		if(seg2 > 8)
+			seg2 = 8;
+		rest = ntq - 1 - seg2;
+		if(rest < 2 || rest > 16)
+			continue;
+		sp = 1000 - (seg2 * 1000) / ntq;
+		sp_error = CAN_ABS_DIFF(sp, sample_point);
+
+		/* Larger bit times are tried first, so they win on equality */
+		if(error < best_error || (error == best_error && sp_error < best_sp_error))
+		{
+			best_error = error;
+			best_sp_error = sp_error;
+			timing->brp = brp;
+			timing->seg2 = seg2;
+			timing->seg1 = (rest + 1) / 2;
+			timing->prseg = rest - timing->seg1;
+			timing->sjw = timing->seg2 < 4 ? timing->seg2 : 4;
+			if(timing->sjw > timing->seg1)
+				timing->sjw = timing->seg1;
+			timing->bitrate = actual;
+			timing->sample_point = sp;
+			found = 1;
+		}
+	}
+
+	if(!found || best_error * 1000 > bitrate * CAN_MAX_BITRATE_ERROR)
+		return 0;
+
+	/* SJW<7:6>, BRP<5:0> */
+	timing->cfg1 = ((timing->sjw - 1) << 6) | (timing->brp - 1);
+	/* SEG2PH<10:8>, SEG2PHTS, SAM below 1 Mbit/s, SEG1PH<5:3>, PRSEG<2:0> */
+	timing->cfg2 = ((timing->seg2 - 1) << 8) | 0x80 | (bitrate < 1000000UL ? 0x40 : 0) | ((timing->seg1 - 1) << 3) | (timing->prseg - 1);
+	return 1;
+}
+
+/*@}*/
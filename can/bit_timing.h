@@ -0,0 +1,54 @@
+/*
+	Molole - Mobots Low Level library
+	An open source toolkit for robot programming using DsPICs
+
+	Copyright (C) 2007--2011 Stephane Magnenat <stephane at magnenat dot net>,
+	Philippe Retornaz <philippe dot retornaz at epfl dot ch>
+	Mobots group (http://mobots.epfl.ch), Robotics system laboratory (http://lsro.epfl.ch)
+	EPFL Ecole polytechnique federale de Lausanne (http://www.epfl.ch)
+
+	See authors.txt for more details about other contributors.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _MOLOLE_CAN_BIT_TIMING_H
+#define _MOLOLE_CAN_BIT_TIMING_H
+
+/** \addtogroup can */
+/*@{*/
+
+/** \file
+	CAN bit timing computation definitions, without dependency on the hardware so that it can be used on a host
+*/
+
+/*! Bit timing of the CAN module, see can_compute_bit_timing() */
+typedef struct
+{
+	unsigned int brp; /**< baud rate prescaler, Tq is 2 * brp / FCAN */
+	unsigned int prseg; /**< propagation segment in Tq */
+	unsigned int seg1; /**< phase segment 1 in Tq */
+	unsigned int seg2; /**< phase segment 2 in Tq */
+	unsigned int sjw; /**< synchronisation jump width in Tq */
+	unsigned long bitrate; /**< obtained bitrate in bit/s */
+	unsigned int sample_point; /**< obtained sample point in per mille of the bit time */
+	unsigned int cfg1; /**< value of CxCFG1 */
+	unsigned int cfg2; /**< value of CxCFG2 */
+} can_bit_timing;
+
+// Functions, doc in the .c
+int can_compute_bit_timing(unsigned long fcan, unsigned long bitrate, unsigned int sample_point, can_bit_timing* timing);
+
+/*@}*/
+
+#endif
@@ -41,76 +41,103 @@
 #define CAN_LOOPBACK_MODE 0x2
 
 
-/*! CAN frame structure as seen by the can module
+#define CANDRV_NUMBUF 32
+static can_hw_frame can_buf[CANDRV_NUMBUF] __attribute__((space(dma),aligned(CANDRV_NUMBUF * sizeof(can_hw_frame))));
+
+/*! Amount of hardware transmit buffers, from 1 to 8.
+ * \warning Only use more than one on silicon revisions without the ECAN transmit errata
  */
-struct s_can_buf
-{
-	unsigned int sid  __attribute__((packed));
-	unsigned int eid  __attribute__((packed));
-	unsigned int dlc  __attribute__((packed));
-	unsigned int data[4]  __attribute__((packed));
-	unsigned int stat  __attribute__((packed));
-};
+#ifndef CAN_TX_BUFFERS
+#define CAN_TX_BUFFERS 1
+#endif
 
-#define CANDRV_NUMBUF 32
-static struct s_can_buf can_buf[CANDRV_NUMBUF] __attribute__((space(dma),aligned(CANDRV_NUMBUF * sizeof(struct s_can_buf))));
+#if CAN_TX_BUFFERS < 1 || CAN_TX_BUFFERS > 8
+#error CAN_TX_BUFFERS must be between 1 and 8
+#endif
 
-static can_frame_received_callback rx_cb;
-static can_frame_sent_callback tx_done_cb;
+/*! Amount of receive buffers dedicated to acceptance filters, following the transmit buffers
+ * \sa can_set_filters
+ */
+#ifndef CAN_RX_DEDICATED_BUFFERS
+#define CAN_RX_DEDICATED_BUFFERS 0
+#endif
 
-struct speed_s
-{
-	unsigned int kbps;
-	unsigned int CxCFG1;
-	unsigned int CxCFG2;
-};
-
-//! Table to lookup CAN timing constants for 40 MHz operation, NULL terminated
-const static struct speed_s __attribute__((space(auto_psv))) speed_tab_40[] = {
-	{ .kbps = 1000,
-// 10 Tq. 1 prop, 4 phase 1, 4 phase 2, 4 synchro
-	  .CxCFG1 = 0x00C1, //0x0,
-	  .CxCFG2 = 0x0398, //0x07FA,
-	},
-	{ .kbps = 500,
-	  .CxCFG1 = 0x1,
-	  .CxCFG2 = 0x07F4,
-	},
-	{ .kbps = 250,
-	  .CxCFG1 = 0x3,
-	  .CxCFG2 = 0x07FA,
-	}, 
-	{ .kbps = 100,
-	  .CxCFG1 = 0x9,
-	  .CxCFG2 = 0x07FA,
-	},
-	{ .kbps = 0,
-	}
-};
-
-//! Table to lookup CAN timing constants for 30 MHz operation, NULL terminated
-const static struct __attribute__((space(auto_psv))) speed_s speed_tab_30[] = {
-	{ .kbps = 1000,
-// 15 Tq, 1 prop, 7 phase 1, 6 phase 2, 4 synchro
-	  .CxCFG1 = 0x00C0, // 0x0,
-	  .CxCFG2 = 0x05B0, //0x04F8,
-	},
-	{ .kbps = 500,
-	  .CxCFG1 = 0x1,
-	  .CxCFG2 = 0x04F8,
-	},
-	{ .kbps = 250,
-	  .CxCFG1 = 0x2,
-	  .CxCFG2 = 0x07FA,
-	}, 
-	{ .kbps = 100,
-	  .CxCFG1 = 0x9,
-	  .CxCFG2 = 0x04F8,
-	},
-	{ .kbps = 0,
-	}
-};
+#if CAN_TX_BUFFERS + CAN_RX_DEDICATED_BUFFERS > 15
+#error Filters can only point to the first 15 buffers
+#endif
+
+/*! First buffer of the receive FIFO */
+#define CAN_FIFO_START (CAN_TX_BUFFERS + CAN_RX_DEDICATED_BUFFERS)
+
+/*! Amount of frames in the deferred receive ring, must be a power of 2
+ * \sa can_set_receive_mode
+ */
+#ifndef CAN_RX_RING_SIZE
+#define CAN_RX_RING_SIZE 32
+#endif
+
+#if CAN_RX_RING_SIZE & (CAN_RX_RING_SIZE - 1)
+#error CAN_RX_RING_SIZE must be a power of 2
+#endif
+
+/*! Amount of frames waiting for a hardware transmit buffer */
+#ifndef CAN_TX_QUEUE_SIZE
+#define CAN_TX_QUEUE_SIZE 16
+#endif
+
+/*! CxTRmnCON bits of one buffer: transmit buffer */
+#define CAN_TXEN 0x80
+/*! CxTRmnCON bits of one buffer: transmission requested */
+#define CAN_TXREQ 0x08
+
+/*! Frames waiting for a hardware transmit buffer, sorted by increasing identifier */
+static can_frame tx_queue[CAN_TX_QUEUE_SIZE];
+/*! Amount of frames in tx_queue */
+static unsigned int tx_queue_count;
+
+/*! Estimated amount of bits on the bus for a frame of len bytes, with average stuffing;
+ * an extended frame adds SRR, the 18 bits of the extended identifier and r1, all subject to stuffing
+ */
+#define CAN_FRAME_BITS(extended, len) ((extended) ? \
+	(67 + 8 * (len) + (54 + 8 * (len)) / 5) : \
+	(47 + 8 * (len) + (34 + 8 * (len)) / 5))
+
+/*! Standard part of an identifier */
+#define CAN_SID(id) (((id) & CAN_ID_EXTENDED) ? (unsigned int) ((id) >> 18) & 0x7FF : (unsigned int) (id) & 0x7FF)
+
+/*! Transmit priority of a frame in its hardware buffer, from the two most significant bits of the identifier */
+#define CAN_TXPRI(id) (3 - (CAN_SID(id) >> 9))
+
+/*! Key ordering identifiers as the bus arbitration does: standard part, then standard frames before extended ones, then extended part */
+#define CAN_ARBITRATION_KEY(id) (((id) & CAN_ID_EXTENDED) ? \
+	(((unsigned long) CAN_SID(id) << 19) | (1UL << 18) | ((id) & 0x3FFFFUL)) : \
+	((unsigned long) CAN_SID(id) << 19))
+
+/*! Hardware transmit buffers loaded with a frame not yet accounted as sent */
+static unsigned int tx_pending;
+/*! Estimated amount of bits on the bus of the frame in each hardware transmit buffer */
+static unsigned char tx_bits[CAN_TX_BUFFERS];
+
+/*! Bus speed, to estimate the bus load */
+static unsigned int can_kbaud;
+/*! Bits sent or received since the last can_statistics_tick() */
+static unsigned long bus_bits;
+static can_statistics stats;
+static int error_state;
+static can_error_state_callback error_cb;
 
+static can_frame_received_callback rx_cb;
+/*! How received frames are delivered, one of \ref can_receive_modes */
+static int rx_mode;
+static can_frames_received_callback rx_batch_cb;
+/*! Next buffer of the receive FIFO to read */
+static unsigned int rx_next;
+
+/*! Frames received in CAN_RECEIVE_DEFERRED mode, written by the interrupt and read by can_receive_frame() */
+static can_frame rx_ring[CAN_RX_RING_SIZE];
+static volatile unsigned int rx_ring_head;
+static volatile unsigned int rx_ring_tail;
+static can_frame_sent_callback tx_done_cb;
 
 /*! Reference count for the C1CTRL1bits.WIN bits */
 static int confw_count;
@@ -208,24 +235,37 @@ static void setup_can_filters(void)
 	can_release_confw();
 }
 
-//! Setup the CAN buffers for our specific configuration: 1 as sending (because of CPU bug) and the rest as reception
+/*! Return the control byte of a transmit buffer, the CxTRmnCON registers hold one byte per buffer */
+static volatile unsigned char* can_tx_con(int bufn)
+{
+	return ((volatile unsigned char *) &C1TR01CON) + bufn;
+}
+
+//! Setup the CAN buffers for our specific configuration: CAN_TX_BUFFERS as sending (only 1 by default because of CPU bug) and the rest as reception
 static void setup_can_buffers(void)
 {
+	int i;
+
 	/* 32 buffers in DMA ram */
 	C1FCTRLbits.DMABS = 0x6;
 
-	/* Configure 31 buffer as FIFO for incoming packet
-	* and 1 other as transmit buffers */
+	/* Configure the first CAN_TX_BUFFERS buffers as transmit buffers,
+	* the CAN_RX_DEDICATED_BUFFERS next ones as receive buffers for filters
+	* and the others as FIFO for incoming packet */
 
-	C1FCTRLbits.FSA = 1; /* FIFO start at buffer 1 */
+	C1FCTRLbits.FSA = CAN_FIFO_START; /* FIFO start after the dedicated buffers */
 
-	/* Buffer 0, Transmit. */
-	/* 0x80 == Transmit buffer, clear all error
+	/* CAN_TXEN == Transmit buffer, clear all error
 	* no auto remote-transmit, low priority */
-	C1TR01CON = 0x0080;
+	C1TR01CON = 0x0000;
 	C1TR23CON = 0x0000;
 	C1TR45CON = 0x0000;
 	C1TR67CON = 0x0000;
+	for(i = 0; i < CAN_TX_BUFFERS; i++)
+		*can_tx_con(i) = CAN_TXEN;
+
+	tx_queue_count = 0;
+	rx_next = CAN_FIFO_START;
 
 	/* Empty every buffers */
 	C1RXFUL1 = 0;
@@ -234,40 +274,32 @@ static void setup_can_buffers(void)
 	C1RXOVF2 = 0;
 }
 
+/*! Resynchronise rx_next with the FIFO read pointer of the module, which is reset in configuration mode.
+ * Must be called in configuration mode, with the CAN interrupt masked. The frames left in the FIFO
+ * are dropped, as the module writes the next frames from its reset pointer, over them.
+ */
+static void can_rx_resync(void)
+{
+	unsigned long fifo = ~((1UL << CAN_FIFO_START) - 1);
+
+	C1RXFUL1 = ~((unsigned int) fifo);
+	C1RXOVF1 = ~((unsigned int) fifo);
+	C1RXFUL2 = ~((unsigned int) (fifo >> 16));
+	C1RXOVF2 = ~((unsigned int) (fifo >> 16));
+	rx_next = C1FIFObits.FNRB;
+}
+
 //! Configure CAN timing registers from current processor speed and requested CAN baud rate
 static void can_set_speed(unsigned int speed)
 {
-	int i;
-	unsigned int cpuclk = clock_get_target_bogomips();
-	switch(cpuclk)
-	{
-		case 40:
-			for(i = 0; speed_tab_40[i].kbps; i++)
-			{
-				if(speed_tab_40[i].kbps == speed)
-				{
-					C1CFG1 = speed_tab_40[i].CxCFG1;
-					C1CFG2 = speed_tab_40[i].CxCFG2;
-					return;
-				}
-			}
-			ERROR(CAN_UNKNOWN_SPEED, &speed);
-			break;
-		case 30:
-			for(i = 0; speed_tab_30[i].kbps; i++)
-			{
-				if(speed_tab_30[i].kbps == speed)
-				{
-					C1CFG1 = speed_tab_30[i].CxCFG1;
-					C1CFG2 = speed_tab_30[i].CxCFG2;
-					return;
-				}
-			}
-			ERROR(CAN_UNKNOWN_SPEED, &speed);
-			break;
-		default:
-			ERROR(CAN_UNKNOWN_CPU_CLOCK, &cpuclk);
-	}
+	can_bit_timing timing;
+
+	/* FCAN is FCY */
+	if(!can_compute_bit_timing(clock_get_cycle_frequency(), (unsigned long) speed * 1000, CAN_DEFAULT_SAMPLE_POINT, &timing))
+		ERROR(CAN_UNKNOWN_SPEED, &speed);
+
+	C1CFG1 = timing.cfg1;
+	C1CFG2 = timing.cfg2;
 }
 
 
@@ -293,6 +325,13 @@ void can_init(can_frame_received_callback frame_received_callback, can_frame_sen
 {
 	ERROR_CHECK_RANGE(priority, 1, 7, GENERIC_ERROR_INVALID_INTERRUPT_PRIORITY);
 	
+	can_kbaud = kbaud_rate;
+	tx_pending = 0;
+	bus_bits = 0;
+	error_state = CAN_ERROR_ACTIVE;
+	error_cb = 0;
+	can_reset_statistics();
+
 	C1CTRL1bits.WIN = 0;
 	can_ask_runlevel(CAN_CONFIG_MODE);
 	setup_can_buffers();
@@ -304,6 +343,8 @@ void can_init(can_frame_received_callback frame_received_callback, can_frame_sen
     C1INTEbits.RBIE=1;
     C1INTEbits.TBIE=1;
     C1INTEbits.ERRIE=1;
+    C1INTEbits.IVRIE=1;
+    C1INTEbits.RBOVIE=1;
     _C1IP = priority;
     _C1IF = 0;
     _C1IE = 1;
@@ -314,14 +355,14 @@ void can_init(can_frame_received_callback frame_received_callback, can_frame_sen
 					DMA_DIR_FROM_PERIPHERAL_TO_RAM, DMA_INTERRUPT_AT_FULL, 
 					DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL, DMA_ADDRESSING_PERIPHERAL_INDIRECT,
 					DMA_OPERATING_CONTINUOUS, can_buf, 0, (void *) &C1RXD, 
-					sizeof(struct s_can_buf) / sizeof(unsigned int) - 1, 0);
+					sizeof(can_hw_frame) / sizeof(unsigned int) - 1, 0);
 	dma_enable_channel(dma_rx_channel);
 
 	dma_init_channel(dma_tx_channel, DMA_INTERRUPT_SOURCE_ECAN_1_TX, DMA_SIZE_WORD,
 					DMA_DIR_FROM_RAM_TO_PERIPHERAL, DMA_INTERRUPT_AT_FULL, 
 					DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL, DMA_ADDRESSING_PERIPHERAL_INDIRECT,
 					DMA_OPERATING_CONTINUOUS, can_buf, 0, (void *) &C1TXD, 
-					sizeof(struct s_can_buf) / sizeof(unsigned int) - 1, 0);
+					sizeof(can_hw_frame) / sizeof(unsigned int) - 1, 0);
 	dma_enable_channel(dma_tx_channel);		
 
 	/* Enable the trans. at high speed */
@@ -329,39 +370,110 @@ void can_init(can_frame_received_callback frame_received_callback, can_frame_sen
 	gpio_set_dir(trans_pin,GPIO_OUTPUT);
 	
 	rx_cb = frame_received_callback;
+	rx_mode = CAN_RECEIVE_PER_FRAME;
 	tx_done_cb = frame_sent_callback;
 
 	can_set_speed(kbaud_rate);
 
+	can_rx_resync();
 	can_ask_runlevel(CAN_NORMAL_MODE);
 }
 
+/*! Return a free hardware transmit buffer for a frame of identifier id, or -1 if they are all busy.
+ * The hardware sends the pending buffers of equal priority highest buffer number first, so -1 is also
+ * returned while a pending buffer has the same priority, to keep the frames in the order of the queue.
+ */
+static int can_get_free_tx(unsigned long id)
+{
+	int i;
+	int bufn = -1;
+	unsigned char pri = CAN_TXPRI(id);
+
+	for(i = 0; i < CAN_TX_BUFFERS; i++)
+	{
+		if(*can_tx_con(i) & CAN_TXREQ)
+		{
+			if((*can_tx_con(i) & 0x3) == pri)
+				return -1;
+		}
+		else if(bufn == -1)
+			bufn = i;
+	}
+	return bufn;
+}
+
+/*! Copy a frame in a hardware transmit buffer and ask the transfert.
+ * When several buffers are pending, the hardware sends the one of highest priority first,
+ * so the priority is taken from the two most significant bits of the identifier.
+ */
+static void can_load_tx(int bufn, const can_frame *frame)
+{
+	if(frame->id & CAN_ID_EXTENDED)
+	{
+		/* SRR and IDE set */
+		can_buf[bufn].sid = (CAN_SID(frame->id) << 2) | 0x3;
+		can_buf[bufn].eid = (unsigned int) (frame->id >> 6) & 0xFFF;
+		can_buf[bufn].dlc = (((unsigned int) frame->id & 0x3F) << 10) | frame->len;
+	}
+	else
+	{
+		can_buf[bufn].sid = CAN_SID(frame->id) << 2;
+		can_buf[bufn].eid = 0;
+		can_buf[bufn].dlc = (int) frame->len;
+	}
+	can_buf[bufn].data[0] = ((int *) frame->data)[0];
+	can_buf[bufn].data[1] = ((int *) frame->data)[1];
+	can_buf[bufn].data[2] = ((int *) frame->data)[2];
+	can_buf[bufn].data[3] = ((int *) frame->data)[3];
+
+	tx_pending |= 1 << bufn;
+	tx_bits[bufn] = CAN_FRAME_BITS(frame->id & CAN_ID_EXTENDED, frame->len);
+
+	/* Ask the transfert */
+	*can_tx_con(bufn) = CAN_TXEN | CAN_TXREQ | CAN_TXPRI(frame->id);
+}
+
 /**
 	Send a frame on CAN 1.
 	
+	If no hardware transmit buffer is free, the frame waits in a queue sorted by identifier, so that
+	the frames leave in the order of the bus arbitration. Frames of same identifier keep their order.
+	The queue is emptied from the CAN interrupt as soon as a transmit buffer is free.
+	
 	\param	frame
 			frame to send
 	
-	\return	return true if there was enough space to send the frame, false if the send buffer is full.
+	\return	return true if there was enough space to send the frame, false if the send queue is full.
 */
 bool can_send_frame(const can_frame *frame)
 {
-	if(!C1TR01CONbits.TXREQ0)
+	int flags;
+	int bufn;
+	unsigned int i;
+	unsigned long key;
+
+	IRQ_DISABLE(flags);
+	if(!tx_queue_count && (bufn = can_get_free_tx(frame->id)) != -1)
 	{
-		/* Copy the frame in buffer 0 */
-		can_buf[0].sid = ((int) frame->id) << 2;
-		can_buf[0].eid = 0;
-		can_buf[0].dlc = (int) frame->len;
-		can_buf[0].data[0] = ((int *) frame->data)[0];
-		can_buf[0].data[1] = ((int *) frame->data)[1];
-		can_buf[0].data[2] = ((int *) frame->data)[2];
-		can_buf[0].data[3] = ((int *) frame->data)[3];
-
-		/* Ask the transfert */
-        C1TR01CONbits.TXREQ0 = 1;
+		can_load_tx(bufn, frame);
+		IRQ_ENABLE(flags);
 		return true;
 	}
-	return false;
+	if(tx_queue_count == CAN_TX_QUEUE_SIZE)
+	{
+		stats.tx_queue_full++;
+		IRQ_ENABLE(flags);
+		return false;
+	}
+
+	/* Insert after every frame of lower or same identifier */
+	key = CAN_ARBITRATION_KEY(frame->id);
+	for(i = tx_queue_count; i && CAN_ARBITRATION_KEY(tx_queue[i - 1].id) > key; i--)
+		tx_queue[i] = tx_queue[i - 1];
+	tx_queue[i] = *frame;
+	tx_queue_count++;
+	IRQ_ENABLE(flags);
+	return true;
 }
 
 /**
@@ -383,66 +495,427 @@ void can_enable(void)
 /**
 	Check if there is room to send a frame.
 	
-	\return	return true if there is enough space to send the frame, false if the send buffer is full.
+	\return	return true if there is enough space to send the frame, false if the send queue is full.
 */
 bool can_is_frame_room(void)
 {
-	return (C1TR01CONbits.TXREQ0 != 1);
+	return tx_queue_count < CAN_TX_QUEUE_SIZE;
 }
 
 
-/** Check if the FIFO has someting in.
-	\return return -1 if empty, the next buffer to read otherwise
+/*! Write an identifier in a filter or mask SID and EID register pair */
+static void can_write_filter_id(volatile unsigned int* reg, unsigned long id)
+{
+	if(id & CAN_ID_EXTENDED)
+	{
+		/* EXIDE set, EID<17:16> in the SID register */
+		reg[0] = (CAN_SID(id) << 5) | 0x8 | ((unsigned int) (id >> 16) & 0x3);
+		reg[1] = (unsigned int) id;
+	}
+	else
+	{
+		reg[0] = CAN_SID(id) << 5;
+		reg[1] = 0;
+	}
+}
+
+/**
+	Program the hardware acceptance filters of CAN 1.
+	
+	A frame is accepted if, for one of the rules, the frame and rule identifiers are of the
+	same type, standard or extended, and the bits set in the mask are equal in both identifiers.
+	Rules of different identifier types use different masks. Frames matched by no rule are discarded
+	by the hardware, without any interrupt. By default, a single rule accepts every frame.
+	The module goes through configuration mode, so the frames still waiting in the receive FIFO are dropped.
+	
+	\param	filters
+			rules to program, they replace the previous ones. At most 3 different masks can be used.
+	\param	count
+			amount of rules, at most 16. If 0, every frame is discarded.
 */
-static int can_get_next_rx(void) {
-	int bufn = C1FIFObits.FNRB;
-	if(bufn > 15) {
-		if((C1RXFUL2 >> (bufn - 16)) & 0x1)
-			return bufn;
-		else 
-			return -1;
-	} else {
-		if((C1RXFUL1 >> bufn) & 0x1)
-			return bufn;
-		else
-			return -1;
+void can_set_filters(const can_filter* filters, unsigned int count)
+{
+	unsigned long masks[3];
+	unsigned int mask_count = 0;
+	unsigned long mask_sel = 0;
+	unsigned int pnt[4] = { 0, 0, 0, 0 };
+	unsigned int fen = 0;
+	unsigned int i, m;
+	int level;
+	int ie;
+	volatile unsigned int* rxf = &C1RXF0SID;
+	volatile unsigned int* rxm = &C1RXM0SID;
+
+	if(count > 16)
+		ERROR(CAN_TOO_MANY_FILTERS, &count);
+
+	for(i = 0; i < count; i++)
+	{
+		if(filters[i].buffer != CAN_FILTER_FIFO && (filters[i].buffer < 0 || filters[i].buffer >= CAN_RX_DEDICATED_BUFFERS))
+			ERROR(CAN_INVALID_FILTER_BUFFER, (void *) &filters[i]);
+
+		for(m = 0; m < mask_count; m++)
+			if(masks[m] == (filters[i].mask | (filters[i].id & CAN_ID_EXTENDED)))
+				break;
+		if(m == mask_count)
+		{
+			if(mask_count == 3)
+				ERROR(CAN_TOO_MANY_MASKS, (void *) &filters[i]);
+			masks[mask_count++] = filters[i].mask | (filters[i].id & CAN_ID_EXTENDED);
+		}
+
+		mask_sel |= ((unsigned long) m) << (2 * i);
+		pnt[i / 4] |= (filters[i].buffer == CAN_FILTER_FIFO ? 0xF : CAN_TX_BUFFERS + filters[i].buffer) << (4 * (i % 4));
+		fen |= 1 << i;
 	}
-}	
 
-/*! The CAN RX interrupt handler
+	/* Masks can only be changed in configuration mode, which resets the FIFO read pointer,
+	* so the interrupt is masked until rx_next is resynchronised */
+	ie = _C1IE;
+	_C1IE = 0;
+	level = C1CTRL1bits.OPMODE;
+	can_ask_runlevel(CAN_CONFIG_MODE);
+	can_grab_confw();
+	C1FEN1 = 0;
+
+	/* Registers of a filter or mask are SID, EID, so they are 2 words apart.
+	* The masks are written in the format of the identifiers of their filters, and
+	* MIDE is set, so filters only match frames of their own identifier type */
+	for(m = 0; m < mask_count; m++)
+	{
+		can_write_filter_id(&rxm[2 * m], masks[m]);
+		rxm[2 * m] |= 0x8;
+	}
+	for(i = 0; i < count; i++)
+		can_write_filter_id(&rxf[2 * i], filters[i].id);
+
+	C1BUFPNT1 = pnt[0];
+	C1BUFPNT2 = pnt[1];
+	C1BUFPNT3 = pnt[2];
+	C1BUFPNT4 = pnt[3];
+	C1FMSKSEL1 = mask_sel;
+	C1FMSKSEL2 = mask_sel >> 16;
+	C1FEN1 = fen;
+	can_release_confw();
+	can_rx_resync();
+	can_ask_runlevel(level);
+	_C1IE = ie;
+}
+
+/**
+	Select how received frames are delivered.
+	
+	In \ref CAN_RECEIVE_PER_FRAME mode, the default one, each frame is copied and given to the
+	callback of can_init(). In \ref CAN_RECEIVE_BATCH mode, batch_callback is given the ready
+	buffers directly in DMA ram, several at a time, and they are all released when it returns.
+	In \ref CAN_RECEIVE_DEFERRED mode, the interrupt only copies the frames in a ring that the
+	main loop empties with can_receive_frame().
+	
+	\param	mode
+			one of \ref can_receive_modes
+	\param	batch_callback
+			function to call in \ref CAN_RECEIVE_BATCH mode, ignored otherwise
+*/
+void can_set_receive_mode(int mode, can_frames_received_callback batch_callback)
+{
+	int flags;
+
+	ERROR_CHECK_RANGE(mode, CAN_RECEIVE_PER_FRAME, CAN_RECEIVE_DEFERRED, CAN_INVALID_RECEIVE_MODE);
+	if(mode == CAN_RECEIVE_BATCH && !batch_callback)
+		ERROR(CAN_INVALID_RECEIVE_MODE, &mode);
+
+	IRQ_DISABLE(flags);
+	rx_batch_cb = batch_callback;
+	rx_ring_head = rx_ring_tail = 0;
+	rx_mode = mode;
+	IRQ_ENABLE(flags);
+}
+
+/**
+	Take a frame from the receive ring, in \ref CAN_RECEIVE_DEFERRED mode.
+	
+	\param	frame
+			where to copy the frame
+	
+	\return	return true if a frame was copied, false if the ring is empty.
+*/
+bool can_receive_frame(can_frame* frame)
+{
+	unsigned int tail = rx_ring_tail;
+
+	if(tail == rx_ring_head)
+		return false;
+
+	*frame = rx_ring[tail];
+	/* Release the slot only once the frame is copied */
+	barrier();
+	rx_ring_tail = (tail + 1) & (CAN_RX_RING_SIZE - 1);
+	return true;
+}
+
+/*! Copy a frame out of its hardware buffer */
+static void can_frame_from_buf(can_frame* frame, const can_hw_frame* buf)
+{
+	frame->id = CAN_HW_FRAME_ID(buf);
+	frame->len = CAN_HW_FRAME_LEN(buf);
+	((int *) frame->data)[0] = buf->data[0];
+	((int *) frame->data)[1] = buf->data[1];
+	((int *) frame->data)[2] = buf->data[2];
+	((int *) frame->data)[3] = buf->data[3];
+}
+
+/*! Deliver consecutive received buffers according to the receive mode */
+static void can_deliver(const can_hw_frame* bufs, unsigned int count)
+{
+	can_frame frame;
+	unsigned int head;
+	unsigned int i;
+
+	stats.frames_received += count;
+	for(i = 0; i < count; i++)
+		bus_bits += CAN_FRAME_BITS(bufs[i].sid & 0x1, CAN_HW_FRAME_LEN(&bufs[i]));
+
+	switch(rx_mode)
+	{
+		case CAN_RECEIVE_BATCH:
+			rx_batch_cb(bufs, count);
+			break;
+		case CAN_RECEIVE_DEFERRED:
+			for(head = rx_ring_head; count; count--, bufs++)
+			{
+				/* Drop the frame if the ring is full */
+				if(((head + 1) & (CAN_RX_RING_SIZE - 1)) == rx_ring_tail)
+				{
+					stats.ring_overflows += count;
+					break;
+				}
+				can_frame_from_buf(&rx_ring[head], bufs);
+				head = (head + 1) & (CAN_RX_RING_SIZE - 1);
+			}
+			/* Publish the frames only once they are copied */
+			barrier();
+			rx_ring_head = head;
+			break;
+		default:
+			for(; count; count--, bufs++)
+			{
+				can_frame_from_buf(&frame, bufs);
+				rx_cb(&frame);
+			}
+	}
+}
+
+/*! Check if a receive buffer is full */
+static bool can_rx_full(unsigned int bufn)
+{
+	if(bufn > 15)
+		return (C1RXFUL2 >> (bufn - 16)) & 0x1;
+	else
+		return (C1RXFUL1 >> bufn) & 0x1;
+}
+
+/*! Release received buffers, given as a bit mask of buffer numbers.
+ * The RXFUL and RXOVF bits can only be cleared by software, so writing the complement of the mask
+ * releases all the buffers in a single write without touching the others, even if they were just filled.
+ */
+static void can_rx_release(unsigned long mask)
+{
+	if(mask & 0xFFFF)
+	{
+		C1RXFUL1 = ~((unsigned int) mask);
+		C1RXOVF1 = ~((unsigned int) mask);
+	}
+	if(mask >> 16)
+	{
+		C1RXFUL2 = ~((unsigned int) (mask >> 16));
+		C1RXOVF2 = ~((unsigned int) (mask >> 16));
+	}
+}
+
+/*! The CAN RX interrupt handler, deliver the ready buffers by runs of consecutive buffers
  * \sa _C1Interrupt
  */
 static void can_rx(void)
 {
-	int bufn = 0;
-	can_frame frame;
+	unsigned int bufn;
+	unsigned int start;
+	unsigned int count;
 
-	while((bufn = can_get_next_rx()) != -1)
+	/* The dedicated buffers are all below 16 */
+	for(bufn = CAN_TX_BUFFERS; bufn < CAN_FIFO_START; bufn++)
 	{
-		frame.id = (can_buf[bufn].sid >> 2) & 0x7FF;
-		frame.len = can_buf[bufn].dlc & 0xF;
-		((int *) frame.data)[0] = can_buf[bufn].data[0];
-		((int *) frame.data)[1] = can_buf[bufn].data[1];
-		((int *) frame.data)[2] = can_buf[bufn].data[2];
-		((int *) frame.data)[3] = can_buf[bufn].data[3];
-	
-		if(bufn > 15) {
-			C1RXFUL2 &= ~(1<<(bufn-16));
-			C1RXOVF2 &= ~(1<<(bufn-16));
-		} else {
-			C1RXFUL1 &= ~(1<<bufn);
-			C1RXOVF1 &= ~(1<<bufn);
+		if(can_rx_full(bufn))
+		{
+			can_deliver(&can_buf[bufn], 1);
+			can_rx_release(1UL << bufn);
 		}
-	
-		rx_cb(&frame);
 	}
+
+	/* The FIFO is filled in order, from CAN_FIFO_START to the last buffer, then wraps */
+	while(1)
+	{
+		start = rx_next;
+		for(count = 0; can_rx_full(rx_next); )
+		{
+			count++;
+			if(++rx_next == CANDRV_NUMBUF)
+			{
+				rx_next = CAN_FIFO_START;
+				break;
+			}
+		}
+		if(!count)
+			break;
+
+		can_deliver(&can_buf[start], count);
+		can_rx_release(((1UL << count) - 1) << start);
+	}
+}
+
+/*! Read the error state from the module, count the transitions and notify them */
+static void can_update_error_state(void)
+{
+	int state;
+
+	if(C1INTFbits.TXBO)
+		state = CAN_BUS_OFF;
+	else if(C1INTFbits.TXBP || C1INTFbits.RXBP)
+		state = CAN_ERROR_PASSIVE;
+	else if(C1INTFbits.EWARN)
+		state = CAN_ERROR_WARNING;
+	else
+		state = CAN_ERROR_ACTIVE;
+
+	if(state == error_state)
+		return;
+
+	if(state == CAN_BUS_OFF)
+		stats.bus_off++;
+	else if(state == CAN_ERROR_PASSIVE && error_state < CAN_ERROR_PASSIVE)
+		stats.error_passive++;
+	error_state = state;
+
+	if(error_cb)
+		error_cb(state);
+}
+
+/**
+	Set the function to call when the error state of CAN 1 changes.
+	
+	After a bus off, the module rejoins the bus by itself once it has seen 128 times 11 recessive bits,
+	as required by the CAN specification, and pending frames are then sent again.
+	
+	\param	callback
+			function to call with the new state, one of \ref can_error_states. Can be 0.
+*/
+void can_set_error_callback(can_error_state_callback callback)
+{
+	error_cb = callback;
+}
+
+/**
+	Return the current error state of CAN 1.
+	
+	\return	one of \ref can_error_states
+*/
+int can_get_error_state(void)
+{
+	return error_state;
+}
+
+/**
+	Copy the statistics of CAN 1.
+	
+	\param	s
+			where to copy the statistics
+*/
+void can_get_statistics(can_statistics* s)
+{
+	int flags;
+
+	IRQ_DISABLE(flags);
+	*s = stats;
+	IRQ_ENABLE(flags);
+	s->tx_errors = C1EC >> 8;
+	s->rx_errors = C1EC & 0xFF;
 }
 
+/**
+	Reset the counters of the statistics of CAN 1.
+*/
+void can_reset_statistics(void)
+{
+	int flags;
+
+	IRQ_DISABLE(flags);
+	stats.frames_received = 0;
+	stats.frames_sent = 0;
+	stats.rx_overflows = 0;
+	stats.ring_overflows = 0;
+	stats.tx_queue_full = 0;
+	stats.invalid_messages = 0;
+	stats.error_passive = 0;
+	stats.bus_off = 0;
+	IRQ_ENABLE(flags);
+}
+
+/**
+	Update the bus load estimation and the error state of CAN 1, must be called periodically.
+	
+	The bus load is estimated from the length of the frames sent and received since the
+	previous call, so frames discarded by the acceptance filters are not accounted.
+	
+	\param	period_ms
+			time elapsed since the previous call, in ms
+*/
+void can_statistics_tick(unsigned int period_ms)
+{
+	unsigned long bits;
+	unsigned long load;
+	int flags;
+
+	IRQ_DISABLE(flags);
+	bits = bus_bits;
+	bus_bits = 0;
+	/* The error interrupt is not raised when going back to error active */
+	can_update_error_state();
+	IRQ_ENABLE(flags);
+
+	if(!period_ms)
+		return;
+	load = (bits * 100) / ((unsigned long) can_kbaud * period_ms);
+	stats.bus_load = load > 100 ? 100 : load;
+}
+
+/*! The CAN TX interrupt handler, refill the free transmit buffers from the queue
+ * \sa _C1Interrupt
+ */
 static void can_tx(void)
 {
-	if(!C1TR01CONbits.TXREQ0) 
-		if(tx_done_cb)
-			tx_done_cb();
+	int bufn;
+	unsigned int i;
+
+	/* Account the frames sent since the last interrupt */
+	for(bufn = 0; bufn < CAN_TX_BUFFERS; bufn++)
+	{
+		if((tx_pending & (1 << bufn)) && !(*can_tx_con(bufn) & CAN_TXREQ))
+		{
+			tx_pending &= ~(1 << bufn);
+			stats.frames_sent++;
+			bus_bits += tx_bits[bufn];
+		}
+	}
+
+	while(tx_queue_count && (bufn = can_get_free_tx(tx_queue[0].id)) != -1)
+	{
+		can_load_tx(bufn, &tx_queue[0]);
+		tx_queue_count--;
+		for(i = 0; i < tx_queue_count; i++)
+			tx_queue[i] = tx_queue[i + 1];
+	}
+
+	if(tx_done_cb)
+		tx_done_cb();
 }
 
 
@@ -461,12 +934,17 @@ void _ISR _C1Interrupt(void)
 	}
 	if(C1INTFbits.ERRIF)
 	{
-		/* FIXME */
 		C1INTFbits.ERRIF = 0;
+		can_update_error_state();
 	}
 	if(C1INTFbits.IVRIF)
 	{
-		/* FIXME */
 		C1INTFbits.IVRIF = 0;
+		stats.invalid_messages++;
+	}
+	if(C1INTFbits.RBOVIF)
+	{
+		C1INTFbits.RBOVIF = 0;
+		stats.rx_overflows++;
 	}
 }
@@ -27,6 +27,7 @@
 
 #include "../types/types.h"
 #include "../gpio/gpio.h"
+#include "bit_timing.h"
 
 /** \addtogroup can */
 /*@{*/
@@ -40,24 +41,108 @@
 enum can_errors
 {
 	CAN_ERROR_BASE = 0x0A00,
-	CAN_UNKNOWN_SPEED,
-	CAN_UNKNOWN_CPU_CLOCK,
+	CAN_UNKNOWN_SPEED,			/**< No bit timing reaches the requested speed at the current clock */
+	CAN_UNKNOWN_CPU_CLOCK,		/**< Not raised anymore, the bit timing is computed for any clock */
+	CAN_TOO_MANY_FILTERS,		/**< More than 16 acceptance filters were requested */
+	CAN_TOO_MANY_MASKS,			/**< Acceptance filters use more than 3 different masks */
+	CAN_INVALID_FILTER_BUFFER,	/**< An acceptance filter points to a buffer which is not a dedicated receive buffer */
+	CAN_INVALID_RECEIVE_MODE,	/**< The specified receive mode is invalid */
+};
+
+/** How received frames are delivered, see can_set_receive_mode() */
+enum can_receive_modes
+{
+	CAN_RECEIVE_PER_FRAME = 0,	/**< Each frame is copied and given to the can_frame_received_callback, from the interrupt */
+	CAN_RECEIVE_BATCH,			/**< Ready buffers are given in place to the can_frames_received_callback, from the interrupt */
+	CAN_RECEIVE_DEFERRED,		/**< Frames are copied in a ring, read by can_receive_frame() */
 };
 // Defines
 
+/*! Flag of extended (29 bits) identifiers in the id of can_frame and can_filter */
+#define CAN_ID_EXTENDED 0x80000000UL
+
+/*! Make an extended identifier from a 29 bits value */
+#define CAN_EID(id) ((id) | CAN_ID_EXTENDED)
+
+/*! Sample point used by can_init(), in per mille of the bit time */
+#define CAN_DEFAULT_SAMPLE_POINT 875
+
 /*! the data that physically go on the CAN bus; used to communicate with the CAN data layer */
 typedef struct
 {
 	unsigned char data[8] __attribute__((aligned(sizeof(int)))); /**< data payload */
-	unsigned id:11; /**< CAN identifier */
+	unsigned long id; /**< CAN identifier, 11 bits, or 29 bits with CAN_ID_EXTENDED set */
 	unsigned len:4; /**< amount of bytes used in data */
 } can_frame;
 
 
+
+/** Error states of the CAN module, see can_set_error_callback() */
+enum can_error_states
+{
+	CAN_ERROR_ACTIVE = 0,		/**< Normal operation */
+	CAN_ERROR_WARNING,			/**< An error counter reached 96 */
+	CAN_ERROR_PASSIVE,			/**< An error counter reached 128, the node only sends passive error frames */
+	CAN_BUS_OFF,				/**< The transmit error counter reached 256, the node is off the bus */
+};
+
+/*! Statistics of the CAN module, see can_get_statistics() */
+typedef struct
+{
+	unsigned long frames_received; /**< frames accepted by the filters */
+	unsigned long frames_sent; /**< frames sent successfully */
+	unsigned int rx_overflows; /**< frames lost because the receive buffers were full */
+	unsigned int ring_overflows; /**< frames lost because the ring of CAN_RECEIVE_DEFERRED mode was full */
+	unsigned int tx_queue_full; /**< frames refused by can_send_frame() */
+	unsigned int invalid_messages; /**< invalid messages seen on the bus */
+	unsigned int error_passive; /**< transitions to error passive */
+	unsigned int bus_off; /**< transitions to bus off */
+	unsigned int bus_load; /**< estimated bus load in percent, see can_statistics_tick() */
+	unsigned char tx_errors; /**< current transmit error counter */
+	unsigned char rx_errors; /**< current receive error counter */
+} can_statistics;
+
+/*! User-specified function to call when the error state changes, state is one of \ref can_error_states */
+typedef void (*can_error_state_callback)(int state);
+
+/*! Buffer of an acceptance filter storing its frames in the receive FIFO */
+#define CAN_FILTER_FIFO -1
+
+/*! A hardware acceptance rule, see can_set_filters() */
+typedef struct
+{
+	unsigned long id; /**< CAN identifier to match, with CAN_ID_EXTENDED set for extended frames */
+	unsigned long mask; /**< bits of the identifier that must match, 0 for don't care */
+	int buffer; /**< index of the dedicated receive buffer, from 0 to CAN_RX_DEDICATED_BUFFERS - 1, or CAN_FILTER_FIFO */
+} can_filter;
+
+/*! A frame as stored by the CAN module in DMA ram, read it with the CAN_HW_FRAME_ macros */
+typedef struct
+{
+	unsigned int sid  __attribute__((packed));
+	unsigned int eid  __attribute__((packed));
+	unsigned int dlc  __attribute__((packed));
+	unsigned int data[4]  __attribute__((packed));
+	unsigned int stat  __attribute__((packed));
+} can_hw_frame;
+
+/*! Identifier of a can_hw_frame, with CAN_ID_EXTENDED set for extended frames */
+#define CAN_HW_FRAME_ID(f) (((f)->sid & 0x1) ? \
+	(CAN_ID_EXTENDED | ((unsigned long) (((f)->sid >> 2) & 0x7FF) << 18) | ((unsigned long) ((f)->eid & 0xFFF) << 6) | (((f)->dlc >> 10) & 0x3F)) : \
+	(unsigned long) (((f)->sid >> 2) & 0x7FF))
+/*! Amount of bytes used in the data of a can_hw_frame */
+#define CAN_HW_FRAME_LEN(f) ((f)->dlc & 0xF)
+/*! Data payload of a can_hw_frame */
+#define CAN_HW_FRAME_DATA(f) ((const unsigned char *) (f)->data)
+
 /*! User-specified function to call when a new CAN frame is available. */
 typedef void (*can_frame_received_callback)(const can_frame* frame);
 
-/*! User-specified function to call when the CAN frame was sent successfully. */
+/*! User-specified function to call with consecutive received frames, in CAN_RECEIVE_BATCH mode.
+	The frames are in DMA ram and are released when the function returns. */
+typedef void (*can_frames_received_callback)(const can_hw_frame* frames, unsigned int count);
+
+/*! User-specified function to call when a CAN frame was sent successfully, there is room for a new one. */
 typedef void (*can_frame_sent_callback)(void);
 
 // Functions, doc in the .c
@@ -67,6 +152,18 @@ bool can_send_frame(const can_frame *frame);
 
 bool can_is_frame_room(void);
 
+void can_set_filters(const can_filter* filters, unsigned int count);
+
+void can_set_receive_mode(int mode, can_frames_received_callback batch_callback);
+
+bool can_receive_frame(can_frame* frame);
+
+void can_set_error_callback(can_error_state_callback callback);
+int can_get_error_state(void);
+void can_get_statistics(can_statistics* s);
+void can_reset_statistics(void);
+void can_statistics_tick(unsigned int period_ms);
+
 void can_enable(void);
 void can_disable(void);
 
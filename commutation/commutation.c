@@ -0,0 +1,337 @@
+/*
+	Molole - Mobots Low Level library
+	An open source toolkit for robot programming using DsPICs
+
+	Copyright (C) 2007--2011 Stephane Magnenat <stephane at magnenat dot net>,
+	Philippe Retornaz <philippe dot retornaz at epfl dot ch>
+	Mobots group (http://mobots.epfl.ch), Robotics system laboratory (http://lsro.epfl.ch)
+	EPFL Ecole polytechnique federale de Lausanne (http://www.epfl.ch)
+
+	See authors.txt for more details about other contributors.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//--------------------
+// Usage documentation
+//--------------------
+
+/**
+	\defgroup commutation Commutation
+	
+	Commutation of three-phase brushless motors (BLDC, PMSM) on top of the \ref pwm library.
+	
+	PWM_1, PWM_2 and PWM_3 drive the phases A, B and C. At each PWM interrupt, the electrical angle
+	advances by the speed, and the duties of the three phases are computed from it and written at once
+	with pwm_set_duties(). The angle is 16 bits, 65536 is a full electrical turn; the application can
+	also set it directly from a position sensor.
+	
+	Six-step commutation uses \ref PWM_ONE_DEFAULT_LOW : the active high phase switches its high side,
+	the low phase has its low side always on and the third one is floating. The sinusoidal and space
+	vector modes use the complementary outputs, \ref PWM_BOTH_INVERTED_DEFAULT_LOW ; the dead time
+	(DTCON1) must then be set by the application for its power stage.
+	
+	The sine comes from a 256 entries table with linear interpolation, so the cost per PWM period is
+	bounded and small: three table lookups, a few multiplications and no division.
+	
+	pwm_init() must be called before commutation_init(), with a period such that the duty range
+	is at most 32767.
+*/
+/*@{*/
+
+/** \file
+	Implementation of the commutation of three-phase motors.
+*/
+
+
+//------------
+// Definitions
+//------------
+
+#include "commutation.h"
+#include "../error/error.h"
+#include "../pwm/pwm.h"
+
+/** A twelfth of an electrical turn */
+#define COMMUTATION_ANGLE_30 5461U
+/** A third of an electrical turn */
+#define COMMUTATION_ANGLE_120 21845U
+/** Two thirds of an electrical turn */
+#define COMMUTATION_ANGLE_240 43691U
+
+//-----------------------
+// Structures definitions
+//-----------------------
+
+/** Sine of a full turn in 256 steps, in Q15, with the first value repeated at the end for interpolation */
+static const int commutation_sine[257] =
+{
+	     0,    804,   1608,   2410,   3212,   4011,   4808,   5602,
+	  6393,   7179,   7962,   8739,   9512,  10278,  11039,  11793,
+	 12539,  13279,  14010,  14732,  15446,  16151,  16846,  17530,
+	 18204,  18868,  19519,  20159,  20787,  21403,  22005,  22594,
+	 23170,  23731,  24279,  24811,  25329,  25832,  26319,  26790,
+	 27245,  27683,  28105,  28510,  28898,  29268,  29621,  29956,
+	 30273,  30571,  30852,  31113,  31356,  31580,  31785,  31971,
+	 32137,  32285,  32412,  32521,  32609,  32678,  32728,  32757,
+	 32767,  32757,  32728,  32678,  32609,  32521,  32412,  32285,
+	 32137,  31971,  31785,  31580,  31356,  31113,  30852,  30571,
+	 30273,  29956,  29621,  29268,  28898,  28510,  28105,  27683,
+	 27245,  26790,  26319,  25832,  25329,  24811,  24279,  23731,
+	 23170,  22594,  22005,  21403,  20787,  20159,  19519,  18868,
+	 18204,  17530,  16846,  16151,  15446,  14732,  14010,  13279,
+	 12539,  11793,  11039,  10278,   9512,   8739,   7962,   7179,
+	  6393,   5602,   4808,   4011,   3212,   2410,   1608,    804,
+	     0,   -804,  -1608,  -2410,  -3212,  -4011,  -4808,  -5602,
+	 -6393,  -7179,  -7962,  -8739,  -9512, -10278, -11039, -11793,
+	-12539, -13279, -14010, -14732, -15446, -16151, -16846, -17530,
+	-18204, -18868, -19519, -20159, -20787, -21403, -22005, -22594,
+	-23170, -23731, -24279, -24811, -25329, -25832, -26319, -26790,
+	-27245, -27683, -28105, -28510, -28898, -29268, -29621, -29956,
+	-30273, -30571, -30852, -31113, -31356, -31580, -31785, -31971,
+	-32137, -32285, -32412, -32521, -32609, -32678, -32728, -32757,
+	-32767, -32757, -32728, -32678, -32609, -32521, -32412, -32285,
+	-32137, -31971, -31785, -31580, -31356, -31113, -30852, -30571,
+	-30273, -29956, -29621, -29268, -28898, -28510, -28105, -27683,
+	-27245, -26790, -26319, -25832, -25329, -24811, -24279, -23731,
+	-23170, -22594, -22005, -21403, -20787, -20159, -19519, -18868,
+	-18204, -17530, -16846, -16151, -15446, -14732, -14010, -13279,
+	-12539, -11793, -11039, -10278,  -9512,  -8739,  -7962,  -7179,
+	 -6393,  -5602,  -4808,  -4011,  -3212,  -2410,  -1608,   -804,
+	     0
+
+};
+
+/** State of each phase in the six sectors: 1 high, -1 low, 0 floating */
+static const signed char commutation_sectors[6][3] =
+{
+	{ 1, -1, 0 },
+	{ 1, 0, -1 },
+	{ 0, 1, -1 },
+	{ -1, 1, 0 },
+	{ -1, 0, 1 },
+	{ 0, -1, 1 },
+};
+
+/** Commutation data */
+static struct
+{
+	int mode;						/**< one of \ref commutation_modes */
+	volatile unsigned int angle;	/**< electrical angle, 65536 is a full turn */
+	volatile int step;				/**< angle increment at each PWM interrupt */
+	volatile unsigned int amplitude;	/**< voltage amplitude, in Q15 of the full scale */
+	unsigned int period;			/**< duty of an output always active */
+} Commutation_Data;
+
+//------------------
+// Private functions
+//------------------
+
+/** PWM interrupt callback, advance the angle and update the duties */
+static void commutation_pwm_cb(void)
+{
+	int duties[3];
+	
+	Commutation_Data.angle += Commutation_Data.step;
+	commutation_compute_duties(Commutation_Data.mode, Commutation_Data.angle, Commutation_Data.amplitude, Commutation_Data.period, duties);
+	pwm_set_duties(duties, 3);
+}
+
+//-------------------
+// Exported functions
+//-------------------
+
+/**
+	Return the sine of an angle, in Q15.
+	
+	\param	angle
+			Angle, 65536 is a full turn.
+*/
+int commutation_sin(unsigned int angle)
+{
+	unsigned int index = (angle >> 8) & 0xFF;
+	int frac = angle & 0xFF;
+	int s0 = commutation_sine[index];
+	
+	return s0 + (int) (((long) (commutation_sine[index + 1] - s0) * frac + 128) >> 8);
+}
+
+/**
+	Compute the duties of the three phases for an electrical angle.
+	
+	This is the computation done at each PWM interrupt, it does not touch the hardware.
+	
+	\param	mode
+			Commutation mode, one of \ref commutation_modes.
+	\param	angle
+			Electrical angle, 65536 is a full turn.
+	\param	amplitude
+			Voltage amplitude, in Q15 of the full scale; \ref COMMUTATION_AMPLITUDE_MAX for the full scale of the six-step and
+			sinusoidal modes, up to \ref COMMUTATION_AMPLITUDE_SVPWM_MAX for the space vector modulation. Larger values are clipped.
+	\param	period
+			Duty of an output always active, as returned by pwm_get_period().
+	\param	duties
+			Where to store the duties of PWM_1, PWM_2 and PWM_3, for pwm_set_duties().
+*/
+void commutation_compute_duties(int mode, unsigned int angle, unsigned int amplitude, unsigned int period, int duties[3])
+{
+	unsigned int half = period >> 1;
+	const signed char * sector;
+	long v[3];
+	long offset;
+	long duty;
+	int i;
+	
+	if (mode == COMMUTATION_SIX_STEP)
+	{
+		duty = ((long) amplitude * period) >> 15;
+		if (duty > (long) period)
+			duty = period;
+		
+		// Each sector is centered on the angle where its floating phase crosses zero in the sinusoidal modes
+		sector = commutation_sectors[((unsigned long) ((angle - COMMUTATION_ANGLE_30) & 0xFFFF) * 6) >> 16];
+		for (i = 0; i < 3; i++)
+		{
+			if (sector[i] > 0)
+				duties[i] = duty;
+			else if (sector[i] < 0)
+				duties[i] = -(int) period;
+			else
+				duties[i] = 0;
+		}
+		return;
+	}
+	
+	// Phase voltages, in Q15 of half the bus; the shifts are rounded, so that the errors do not add up
+	v[0] = ((long) commutation_sin(angle) * amplitude + 16384) >> 15;
+	v[1] = ((long) commutation_sin(angle - COMMUTATION_ANGLE_120) * amplitude + 16384) >> 15;
+	v[2] = ((long) commutation_sin(angle - COMMUTATION_ANGLE_240) * amplitude + 16384) >> 15;
+	
+	if (mode == COMMUTATION_SVPWM)
+	{
+		// Min-max injection, centers the three voltages in the bus like space vector modulation
+		long min = v[0];
+		long max = v[0];
+		for (i = 1; i < 3; i++)
+		{
+			if (v[i] < min)
+				min = v[i];
+			if (v[i] > max)
+				max = v[i];
+		}
+		offset = (min + max) >> 1;
+		for (i = 0; i < 3; i++)
+			v[i] -= offset;
+	}
+	
+	for (i = 0; i < 3; i++)
+	{
+		duty = half + ((v[i] * half + 16384) >> 15);
+		// A null duty would let the phase float
+		if (duty < 1)
+			duty = 1;
+		else if (duty > (long) period)
+			duty = period;
+		duties[i] = duty;
+	}
+}
+
+/**
+	Init the commutation and start it, with a null amplitude and speed.
+	
+	\param	mode
+			Commutation mode, one of \ref commutation_modes.
+	\param	postscaler
+			The duties are updated each (postscale+1) PWM periods (parameter is 0..15)
+	\param 	priority
+			Interrupt priority, from 1 (lowest priority) to 6 (highest normal priority)
+*/
+void commutation_init(int mode, int postscaler, int priority)
+{
+	Commutation_Data.period = pwm_get_period();
+	if (Commutation_Data.period > 32767)
+		ERROR(COMMUTATION_ERROR_PERIOD_TOO_LONG, &Commutation_Data.period);
+	
+	Commutation_Data.angle = 0;
+	Commutation_Data.step = 0;
+	Commutation_Data.amplitude = 0;
+	commutation_set_mode(mode);
+	
+	pwm_enable_interrupt(postscaler, commutation_pwm_cb, priority);
+}
+
+/**
+	Change the commutation mode.
+	
+	\param	mode
+			Commutation mode, one of \ref commutation_modes.
+*/
+void commutation_set_mode(int mode)
+{
+	int brake;
+	int i;
+	
+	ERROR_CHECK_RANGE(mode, COMMUTATION_SIX_STEP, COMMUTATION_SVPWM, COMMUTATION_ERROR_INVALID_MODE);
+	
+	if (mode == COMMUTATION_SIX_STEP)
+		brake = PWM_ONE_DEFAULT_LOW;
+	else
+		brake = PWM_BOTH_INVERTED_DEFAULT_LOW;
+	
+	for (i = PWM_1; i <= PWM_3; i++)
+		pwm_set_brake(i, brake);
+	Commutation_Data.mode = mode;
+}
+
+/**
+	Set the voltage amplitude.
+	
+	\param	amplitude
+			Voltage amplitude, in Q15 of the full scale, see commutation_compute_duties().
+*/
+void commutation_set_amplitude(unsigned int amplitude)
+{
+	Commutation_Data.amplitude = amplitude;
+}
+
+/**
+	Set the speed of the electrical angle.
+	
+	\param	step
+			Angle increment at each PWM interrupt, 65536 is a full turn; negative to turn backward.
+*/
+void commutation_set_speed(int step)
+{
+	Commutation_Data.step = step;
+}
+
+/**
+	Set the electrical angle, for instance from a position sensor.
+	
+	\param	angle
+			Electrical angle, 65536 is a full turn.
+*/
+void commutation_set_angle(unsigned int angle)
+{
+	Commutation_Data.angle = angle;
+}
+
+/**
+	Return the electrical angle, 65536 is a full turn.
+*/
+unsigned int commutation_get_angle(void)
+{
+	return Commutation_Data.angle;
+}
+
+/*@}*/
@@ -0,0 +1,81 @@
+/*
+	Molole - Mobots Low Level library
+	An open source toolkit for robot programming using DsPICs
+
+	Copyright (C) 2007--2011 Stephane Magnenat <stephane at magnenat dot net>,
+	Philippe Retornaz <philippe dot retornaz at epfl dot ch>
+	Mobots group (http://mobots.epfl.ch), Robotics system laboratory (http://lsro.epfl.ch)
+	EPFL Ecole polytechnique federale de Lausanne (http://www.epfl.ch)
+
+	See authors.txt for more details about other contributors.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _MOLOLE_COMMUTATION_H
+#define _MOLOLE_COMMUTATION_H
+
+#include "../types/types.h"
+
+/** \addtogroup commutation */
+/*@{*/
+
+/** \file
+	Commutation of three-phase motors definitions
+*/
+
+// Defines
+
+/** Errors the commutation can throw */
+enum commutation_errors
+{
+	COMMUTATION_ERROR_BASE = 0x1500,
+	COMMUTATION_ERROR_INVALID_MODE,		/**< The specified mode is not one of \ref commutation_modes */
+	COMMUTATION_ERROR_PERIOD_TOO_LONG,	/**< The PWM period does not fit the duty range of pwm_set_duty(), 32767 */
+};
+
+/** Commutation modes */
+enum commutation_modes
+{
+	COMMUTATION_SIX_STEP = 0,			/**< Trapezoidal commutation, one phase high, one low and one floating in each of the six sectors */
+	COMMUTATION_SINUSOIDAL,				/**< Sinusoidal phase voltages */
+	COMMUTATION_SVPWM,					/**< Space vector modulation, sinusoidal with min-max injection, up to 2/sqrt(3) more voltage */
+};
+
+/** Amplitude of a full scale sinusoid, 1.0 in Q15 */
+#define COMMUTATION_AMPLITUDE_MAX 32768U
+/** Amplitude of a full scale space vector modulation, 2/sqrt(3) in Q15 */
+#define COMMUTATION_AMPLITUDE_SVPWM_MAX 37837U
+
+// Functions, doc in the .c
+
+void commutation_init(int mode, int postscaler, int priority);
+
+void commutation_set_mode(int mode);
+
+void commutation_set_amplitude(unsigned int amplitude);
+
+void commutation_set_speed(int step);
+
+void commutation_set_angle(unsigned int angle);
+
+unsigned int commutation_get_angle(void);
+
+int commutation_sin(unsigned int angle);
+
+void commutation_compute_duties(int mode, unsigned int angle, unsigned int amplitude, unsigned int period, int duties[3]);
+
+/*@}*/
+
+#endif
@@ -0,0 +1,4 @@
+/*
+	Stand-in for the device header when building the commutation on the host,
+	see reference.c; the computation of the duties does not access any register.
+*/
@@ -0,0 +1,204 @@
+/*
+	Molole - Mobots Low Level library
+	An open source toolkit for robot programming using DsPICs
+
+	Copyright (C) 2007--2011 Stephane Magnenat <stephane at magnenat dot net>,
+	Philippe Retornaz <philippe dot retornaz at epfl dot ch>
+	Mobots group (http://mobots.epfl.ch), Robotics system laboratory (http://lsro.epfl.ch)
+	EPFL Ecole polytechnique federale de Lausanne (http://www.epfl.ch)
+
+	See authors.txt for more details about other contributors.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/** \addtogroup commutation */
+/*@{*/
+
+/** \file
+	Host-side reference of the commutation.
+
+	Built and run on the host with "make reference". It compares commutation_sin() and
+	commutation_compute_duties() with a floating-point model over all the angles, and
+	fails if the sine is off by COMMUTATION_SIN_TOLERANCE LSB or more, or a duty by
+	more than the sine tolerance scaled to the duty, plus one tick of rounding.
+	int is wider on the host, but commutation.c does in long all that could overflow 16 bits.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "commutation.h"
+
+/** Maximum error of commutation_sin(), in Q15 LSB, excluded */
+#define COMMUTATION_SIN_TOLERANCE 4.0
+/** Maximum error of a sinusoidal or space vector duty, in PWM ticks: the sine tolerance through amplitude and half period, and the rounding */
+#define COMMUTATION_DUTY_TOLERANCE(amplitude, period) (1 + COMMUTATION_SIN_TOLERANCE * (amplitude) / 32768. * ((period) / 2) / 32768.)
+
+// The hardware side of the library, not used by the computation
+
+void error_report(const char * file, int line, int id, void* arg)
+{
+	fprintf(stderr, "%s:%d: error 0x%04x\n", file, line, id);
+	exit(2);
+}
+
+unsigned int pwm_get_period(void) { return 0; }
+void pwm_set_duties(const int* duties, int count) { }
+void pwm_enable_interrupt(int postscaler, void (*callback)(void), int priority) { }
+void pwm_set_brake(int pwm_id, int mode) { }
+
+/** Floating-point model of the duties, see commutation_compute_duties() */
+static void reference_duties(int mode, unsigned int angle, unsigned int amplitude, unsigned int period, double duties[3])
+{
+	double v[3];
+	double offset = 0;
+	double min, max;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		v[i] = amplitude / 32768. * sin(2 * M_PI * angle / 65536. - i * 2 * M_PI / 3);
+
+	if (mode == COMMUTATION_SVPWM)
+	{
+		min = fmin(v[0], fmin(v[1], v[2]));
+		max = fmax(v[0], fmax(v[1], v[2]));
+		offset = (min + max) / 2;
+	}
+
+	for (i = 0; i < 3; i++)
+	{
+		duties[i] = period / 2 + (v[i] - offset) * (period / 2);
+		if (duties[i] < 1)
+			duties[i] = 1;
+		else if (duties[i] > period)
+			duties[i] = period;
+	}
+}
+
+/**
+	Check the six-step duties against the phase ordering of the sinusoidal model, return the amount of failures.
+	
+	The high phase must have the highest voltage of the model, the low phase the lowest, and the third one float.
+	At the sector boundaries, two voltages are within a tick of angle and either one is accepted.
+*/
+static int check_six_step(unsigned int period)
+{
+	unsigned int amplitude = COMMUTATION_AMPLITUDE_MAX / 2;
+	double tolerance = 2 * M_PI / 65536.;
+	unsigned int angle;
+	int duties[3];
+	double v[3];
+	double min, max;
+	int high, low;
+	int failures = 0;
+	int i;
+
+	for (angle = 0; angle < 65536; angle++)
+	{
+		commutation_compute_duties(COMMUTATION_SIX_STEP, angle, amplitude, period, duties);
+		for (i = 0; i < 3; i++)
+			v[i] = sin(2 * M_PI * angle / 65536. - i * 2 * M_PI / 3);
+		min = fmin(v[0], fmin(v[1], v[2]));
+		max = fmax(v[0], fmax(v[1], v[2]));
+
+		high = low = 0;
+		for (i = 0; i < 3; i++)
+		{
+			if (duties[i] == (int) (period / 2))
+			{
+				high++;
+				if (v[i] < max - tolerance)
+					failures++;
+			}
+			else if (duties[i] == -(int) period)
+			{
+				low++;
+				if (v[i] > min + tolerance)
+					failures++;
+			}
+			else if (duties[i] != 0)
+				failures++;
+		}
+		if (high != 1 || low != 1)
+			failures++;
+	}
+	printf("six-step, period %5u: %s\n", period, failures ? "FAILED" : "ok");
+	return failures;
+}
+
+/** Compare the duties of a mode with the model, return the amount of failures */
+static int check_duties(int mode, unsigned int amplitude, unsigned int period)
+{
+	unsigned int angle;
+	int duties[3];
+	double expected[3];
+	double error;
+	double max_error = 0;
+	double tolerance = COMMUTATION_DUTY_TOLERANCE(amplitude, period);
+	int failures = 0;
+	int i;
+
+	for (angle = 0; angle < 65536; angle++)
+	{
+		commutation_compute_duties(mode, angle, amplitude, period, duties);
+		reference_duties(mode, angle, amplitude, period, expected);
+		for (i = 0; i < 3; i++)
+		{
+			if (duties[i] < 1 || duties[i] > (int) period)
+				failures++;
+			error = fabs(duties[i] - expected[i]);
+			if (error > max_error)
+				max_error = error;
+		}
+	}
+	if (max_error >= tolerance)
+		failures++;
+	printf("%s, amplitude %5u, period %5u: max duty error %.2f ticks (tolerance %.2f), %s\n",
+		mode == COMMUTATION_SVPWM ? "svpwm     " : "sinusoidal", amplitude, period, max_error, tolerance, failures ? "FAILED" : "ok");
+	return failures;
+}
+
+int main(void)
+{
+	static const unsigned int periods[] = { 1000, 20000, 32767 };
+	unsigned int angle;
+	unsigned int i;
+	double error;
+	double max_error = 0;
+	int failures = 0;
+
+	for (angle = 0; angle < 65536; angle++)
+	{
+		error = fabs(commutation_sin(angle) - 32767. * sin(2 * M_PI * angle / 65536.));
+		if (error > max_error)
+			max_error = error;
+	}
+	if (max_error >= COMMUTATION_SIN_TOLERANCE)
+		failures++;
+	printf("sine: max error %.2f LSB, %s\n", max_error, max_error < COMMUTATION_SIN_TOLERANCE ? "ok" : "FAILED");
+
+	for (i = 0; i < sizeof(periods) / sizeof(periods[0]); i++)
+	{
+		failures += check_six_step(periods[i]);
+		failures += check_duties(COMMUTATION_SINUSOIDAL, COMMUTATION_AMPLITUDE_MAX, periods[i]);
+		failures += check_duties(COMMUTATION_SINUSOIDAL, COMMUTATION_AMPLITUDE_MAX / 3, periods[i]);
+		failures += check_duties(COMMUTATION_SVPWM, COMMUTATION_AMPLITUDE_SVPWM_MAX, periods[i]);
+		failures += check_duties(COMMUTATION_SVPWM, COMMUTATION_AMPLITUDE_MAX / 3, periods[i]);
+	}
+
+	return failures ? 1 : 0;
+}
+
+/*@}*/
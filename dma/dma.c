@@ -344,7 +344,7 @@ void dma_init_channel(int channel, int request_source, int data_size, int transf
 			_DMA5IF = 0;
 			if (callback)
 			{
-				DMA_Data[0] = callback;
+				DMA_Data[5] = callback;
 				_DMA5IE = 1;
 			}
 			else
@@ -556,6 +556,108 @@ void dma_disable_channel(int channel)
 	}
 }
 
+/**
+	Change the buffer A and the transfer count of a configured DMA channel.
+	
+	This is the fast path to reuse a channel configured once with dma_init_channel(),
+	only DMAxSTA and DMAxCNT are written.
+	The channel must be disabled, which is the case after a one-shot transfer completed.
+	
+	\param	channel
+			DMA channel, from \ref DMA_CHANNEL_0 to \ref DMA_CHANNEL_7.
+	\param	a
+			Buffer A inside the DMA memory.
+	\param	transfer_count
+			Amount of data (in unit of 1 or 2 bytes depending on data_size) per transfer
+*/
+void dma_set_buffer(int channel, void * a, unsigned transfer_count)
+{
+	switch (channel)
+	{
+		case DMA_CHANNEL_0:
+			DMA0STA = get_offset(a, transfer_count * (2-DMA0CONbits.SIZE));
+			DMA0CNT = transfer_count - 1;
+			break;
+		case DMA_CHANNEL_1:
+			DMA1STA = get_offset(a, transfer_count * (2-DMA1CONbits.SIZE));
+			DMA1CNT = transfer_count - 1;
+			break;
+		case DMA_CHANNEL_2:
+			DMA2STA = get_offset(a, transfer_count * (2-DMA2CONbits.SIZE));
+			DMA2CNT = transfer_count - 1;
+			break;
+		case DMA_CHANNEL_3:
+			DMA3STA = get_offset(a, transfer_count * (2-DMA3CONbits.SIZE));
+			DMA3CNT = transfer_count - 1;
+			break;
+		case DMA_CHANNEL_4:
+			DMA4STA = get_offset(a, transfer_count * (2-DMA4CONbits.SIZE));
+			DMA4CNT = transfer_count - 1;
+			break;
+		case DMA_CHANNEL_5:
+			DMA5STA = get_offset(a, transfer_count * (2-DMA5CONbits.SIZE));
+			DMA5CNT = transfer_count - 1;
+			break;
+		case DMA_CHANNEL_6:
+			DMA6STA = get_offset(a, transfer_count * (2-DMA6CONbits.SIZE));
+			DMA6CNT = transfer_count - 1;
+			break;
+		case DMA_CHANNEL_7:
+			DMA7STA = get_offset(a, transfer_count * (2-DMA7CONbits.SIZE));
+			DMA7CNT = transfer_count - 1;
+			break;
+		default: ERROR(DMA_ERROR_INVALID_CHANNEL, &channel);
+	}
+}
+
+/**
+	Change the null data write mode of a configured DMA channel.
+	
+	\param	channel
+			DMA channel, from \ref DMA_CHANNEL_0 to \ref DMA_CHANNEL_7.
+	\param	null_write
+			Should DMA write null to peripheral when writing doto to DPSRAM?, one of \ref dma_null_data_peripheral_write_mode_select
+*/
+void dma_set_null_write(int channel, int null_write)
+{
+	switch (channel)
+	{
+		case DMA_CHANNEL_0: DMA0CONbits.NULLW = null_write; break;
+		case DMA_CHANNEL_1: DMA1CONbits.NULLW = null_write; break;
+		case DMA_CHANNEL_2: DMA2CONbits.NULLW = null_write; break;
+		case DMA_CHANNEL_3: DMA3CONbits.NULLW = null_write; break;
+		case DMA_CHANNEL_4: DMA4CONbits.NULLW = null_write; break;
+		case DMA_CHANNEL_5: DMA5CONbits.NULLW = null_write; break;
+		case DMA_CHANNEL_6: DMA6CONbits.NULLW = null_write; break;
+		case DMA_CHANNEL_7: DMA7CONbits.NULLW = null_write; break;
+		default: ERROR(DMA_ERROR_INVALID_CHANNEL, &channel);
+	}
+}
+
+/**
+	Change the addressing mode of a configured DMA channel.
+	
+	\param	channel
+			DMA channel, from \ref DMA_CHANNEL_0 to \ref DMA_CHANNEL_7.
+	\param	addressing_mode
+			DMA Channel Addressing Mode, one of \ref dma_addressing_mode
+*/
+void dma_set_addressing_mode(int channel, int addressing_mode)
+{
+	switch (channel)
+	{
+		case DMA_CHANNEL_0: DMA0CONbits.AMODE = addressing_mode; break;
+		case DMA_CHANNEL_1: DMA1CONbits.AMODE = addressing_mode; break;
+		case DMA_CHANNEL_2: DMA2CONbits.AMODE = addressing_mode; break;
+		case DMA_CHANNEL_3: DMA3CONbits.AMODE = addressing_mode; break;
+		case DMA_CHANNEL_4: DMA4CONbits.AMODE = addressing_mode; break;
+		case DMA_CHANNEL_5: DMA5CONbits.AMODE = addressing_mode; break;
+		case DMA_CHANNEL_6: DMA6CONbits.AMODE = addressing_mode; break;
+		case DMA_CHANNEL_7: DMA7CONbits.AMODE = addressing_mode; break;
+		default: ERROR(DMA_ERROR_INVALID_CHANNEL, &channel);
+	}
+}
+
 /**
 	Manually start transfer on a DMA channel
 	
@@ -580,6 +682,25 @@ void dma_start_transfer(int channel)
 	}
 }
 
+/**
+	Get the address of the most recent DMA memory access of a DMA channel.
+	
+	The DMA controller only records the last access of all channels together,
+	so the address is only known if no other channel transferred data since.
+	
+	\param	channel
+			DMA channel, from \ref DMA_CHANNEL_0 to \ref DMA_CHANNEL_7.
+	\return	The address read or written by the channel, or 0 if another channel ran after it.
+*/
+void * dma_get_last_address(int channel)
+{
+	ERROR_CHECK_RANGE(channel, DMA_CHANNEL_0, DMA_CHANNEL_7, DMA_ERROR_INVALID_CHANNEL);
+	
+	if(DMACS1bits.LSTCH != channel)
+		return 0;
+	return (void *) (((unsigned int) &_DMA_BASE) + DSADR);
+}
+
 /**
 	Set the interrupt priority on a DMA channel
 
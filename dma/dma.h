@@ -153,6 +153,14 @@ void dma_disable_channel(int channel);
 
 void dma_start_transfer(int channel);
 
+void dma_set_buffer(int channel, void * a, unsigned transfer_count);
+
+void dma_set_null_write(int channel, int null_write);
+
+void dma_set_addressing_mode(int channel, int addressing_mode);
+
+void * dma_get_last_address(int channel);
+
 /*@}*/
 
 #endif
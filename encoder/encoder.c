@@ -49,6 +49,7 @@
 #include "../timer/timer.h"
 #include "../ic/ic.h"
 #include "../gpio/gpio.h"
+#include "../ei/ei.h"
 
 //-----------------------
 // Structures definitions
@@ -63,14 +64,21 @@ static struct
 	unsigned int ipl;	/**< IPL of qei interrupt */
 	unsigned int poscnt_b15; /**< errata 31 "QEI Interrupt Generation" */
 	unsigned int got_irq; /**< Set to 1 by each interrupt */
+	long offset;		/**< counter value taken as position 0, set at the index pulse when resetting on index */
+	long step_offset;	/**< offset at the last call to encoder_step() */
+	bool index_reset;	/**< true if the index pulse resets the position */
+	encoder_index_callback index_callback;	/**< function called at the index pulse, may be NULL */
 } QEI_Encoder_Data;
 
 /** Data for the Software (emulated) Encoder Interface */
 static struct
 {
 	long tpos;			/**< 32bits temporary position */
-	int sens;			/**< Upward/backward counting */
-	int up; 			/**< State of the pin when counting upward */
+	unsigned int sens;	/**< Upward/backward counting, masked state of the direction pin */
+	unsigned int up; 	/**< Masked state of the direction pin when counting upward */
+	volatile unsigned int* tmr;	/**< Counter register of the timer */
+	gpio_group dir;		/**< Direction pin */
+	bool capture;		/**< true if the Input Capture timestamps the direction change with the counter */
 	long* pos;			/**< absolute position */
 	int* speed;			/**< difference of last two absolutes positions (i.e. speed) */
 	int ic;				/**< Input Capture to use, must be one of \ref ic_identifiers */
@@ -80,21 +88,75 @@ static struct
 	unsigned int got_irq; /**< Set to 1 by each interrupt */
 } Software_Encoder_Data[9];
 
+/** Fixed-point shift of the fine speed, which is in 1/256 count per step */
+#define ENCODER_SPEED_SHIFT 8
+/** Below this amount of counts per step, the fine speed comes from the edge timestamps only */
+#define ENCODER_SPEED_LOW 4
+/** Above this amount of counts per step, the fine speed comes from the count difference only */
+#define ENCODER_SPEED_HIGH 16
+
+/** Data for the speed estimation from edge timestamps, indexed by \ref encoder_type */
+static struct
+{
+	long* speed;			/**< fine speed, in 1/256 count per step, NULL if the estimation is disabled */
+	unsigned int period;	/**< time between two calls to encoder_step(), in ticks of the IC time base */
+	unsigned int max_idle;	/**< amount of steps after which two timestamps cannot be compared anymore */
+	unsigned int ipl;		/**< IPL of the IC interrupt */
+	unsigned int stamp;		/**< time of the latest captured edge */
+	long count;				/**< position at the latest captured edge */
+	bool captured;			/**< true if an edge was captured since the last step */
+	unsigned int ref_stamp;	/**< time of the reference edge for the next measure */
+	long ref_count;			/**< position at the reference edge */
+	unsigned int idle;		/**< amount of steps since the reference edge, max_idle if there is no reference */
+	unsigned int edge_counts;	/**< counts between the two last captured edges */
+	long period_speed;		/**< speed measured from the timestamps, in 1/256 count per step */
+} Speed_Estimator_Data[ENCODER_TYPE_HARD + 1];
+
 
 
 //------------------
 // Private functions
 //------------------
 
-static void ic_tmr2_cb(int __attribute__((unused)) foo, unsigned int value, void * __attribute__((unused)) bar);
+static void tmr_cb(int tmr);
 
-static void ic_tmr3_cb(int __attribute__((unused)) foo, unsigned int value, void * __attribute__((unused)) bar);
+static void ic_cb(int __attribute__((unused)) foo, unsigned int value, void * data);
 
-static void tmr_cb(int tmr);
+static void ic_speed_cb(int __attribute__((unused)) ic_id, unsigned int value, void * data);
+
+static void encoder_update(int type, long pos, long offset);
 
-static void tmr2_3_cb(int tmr);
+static void qei_index_cb(int __attribute__((unused)) ei_id, void * __attribute__((unused)) data);
 
-static void ic_cb(int __attribute__((unused)) foo, unsigned int __attribute((unused)) bar, void * data);
+static long encoder_read(int type, long* offset);
+
+/** Position of a software encoder from values latched with its interrupt masked, pending being its timer interrupt flag read after tmr */
+static __attribute__((always_inline)) long soft_position(int type, long tpos, unsigned int tmr, unsigned int sens, bool pending)
+{
+	// The counter wrapped just before the latch but the timer interrupt did not run yet
+	if(pending && !(tmr & 0x8000))
+		tpos += sens == Software_Encoder_Data[type].up ? 0x00010000L : -0x00010000L;
+	if(sens == Software_Encoder_Data[type].up) 
+		return tpos + tmr;
+	else
+		return tpos - tmr;
+}
+
+/** Account a QEI interrupt in b15 and high_word, poscnt being the counter value when it is accounted */
+static __attribute__((always_inline)) void qei_account_irq(unsigned int poscnt, bool updn, unsigned int* b15, int* high_word)
+{
+	*b15 ^= 0x8000;
+	
+	// If we have done an overflow while b15 was set, then update high_word
+	if((!*b15) && (poscnt < 0x3FFF)) 
+		if (updn)
+			(*high_word)++;		// Forward
+		
+	// If we have done an underflow while b15 was not set, then update high_word
+	if((*b15) && (poscnt > 0x3FFF)) 
+		if (!updn)
+			(*high_word)--;		// Backward
+}
 
 static void init_qei1_module(int ipl, bool reverse, int x2x4)
 {
@@ -127,13 +189,36 @@ static void init_timer_encoder(unsigned timer, int ipl)
 {
 	timer_init(timer, 0xFFFF,-1);
 	timer_set_clock_source(timer, TIMER_CLOCK_EXTERNAL);
-	if(timer == TIMER_2 || timer == TIMER_3)
-		timer_enable_interrupt(timer, tmr2_3_cb, ipl);
-	else
-		timer_enable_interrupt(timer, tmr_cb, ipl);
+	timer_enable_interrupt(timer, tmr_cb, ipl);
 	timer_set_enabled(timer, true);
 }
 
+static volatile unsigned int* timer_counter(int timer)
+{
+	switch(timer)
+	{
+		case TIMER_1: return &TMR1;
+		case TIMER_2: return &TMR2;
+		case TIMER_3: return &TMR3;
+		case TIMER_4: return &TMR4;
+		case TIMER_5: return &TMR5;
+#ifdef _T6IF
+		case TIMER_6: return &TMR6;
+#endif
+#ifdef _T7IF
+		case TIMER_7: return &TMR7;
+#endif
+#ifdef _T8IF
+		case TIMER_8: return &TMR8;
+#endif
+#ifdef _T9IF
+		case TIMER_9: return &TMR9;
+#endif
+		default:
+			ERROR(ENCODER_INVALID_TYPE, &timer);
+	}
+}
+
 //-------------------
 // Exported functions
 //-------------------
@@ -168,70 +253,30 @@ void encoder_init(int type, int encoder_ic, long* pos, int* speed, int direction
 		QEI_Encoder_Data.ipl = priority;
 		QEI_Encoder_Data.pos = pos;
 		QEI_Encoder_Data.speed = speed;
+		QEI_Encoder_Data.offset = 0;
+		QEI_Encoder_Data.step_offset = 0;
 		init_qei1_module(priority, direction, decoding_mode);
 		return;
-	case ENCODER_TIMER_2:
-		Software_Encoder_Data[1].ipl = priority;
-		Software_Encoder_Data[1].pos = pos;
-		Software_Encoder_Data[1].speed = speed;
-		Software_Encoder_Data[1].sens = gpio_read(gpio_dir);
-		Software_Encoder_Data[1].up = !direction;  
-		Software_Encoder_Data[1].mode = gpio_speed;
-		Software_Encoder_Data[1].g_sens = gpio_dir;
-
-		ic_enable(encoder_ic, IC_TIMER2, IC_EDGE_CAPTURE, ic_tmr2_cb, priority, 0);
-
-		gpio_set_dir(gpio_dir, GPIO_INPUT);
-
-		if(decoding_mode == ENCODER_MODE_X4) 
-			gpio_set_dir(gpio_speed, GPIO_INPUT);
-		else if(decoding_mode == ENCODER_MODE_X2) {
-			gpio_write(gpio_speed, true);
-			gpio_set_dir(gpio_speed, GPIO_OUTPUT);
-		} else
-			ERROR(ENCODER_INVALID_MODE, &decoding_mode)
-
-		init_timer_encoder(TIMER_2, priority);
-		return;
-
-	case ENCODER_TIMER_3:
-		Software_Encoder_Data[2].ipl = priority;
-		Software_Encoder_Data[2].pos = pos;
-		Software_Encoder_Data[2].speed = speed;
-		Software_Encoder_Data[2].sens = gpio_read(gpio_dir);
-		Software_Encoder_Data[2].up = !direction;
-		Software_Encoder_Data[2].mode = gpio_speed;
-		Software_Encoder_Data[2].g_sens = gpio_dir;
-		ic_enable(encoder_ic, IC_TIMER3, IC_EDGE_CAPTURE, ic_tmr3_cb, priority, 0);
-		
-		gpio_set_dir(gpio_dir, GPIO_INPUT);
-
-		if(decoding_mode == ENCODER_MODE_X4) 
-			gpio_set_dir(gpio_speed, GPIO_INPUT);
-		else if(decoding_mode == ENCODER_MODE_X2) {
-			gpio_write(gpio_speed, true);
-			gpio_set_dir(gpio_speed, GPIO_OUTPUT);
-		} else
-			ERROR(ENCODER_INVALID_MODE, &decoding_mode)
-
-		init_timer_encoder(TIMER_3, priority);
-		return;
-		
-	case ENCODER_TIMER_1:
-	case ENCODER_TIMER_4:
-	case ENCODER_TIMER_5:
-	case ENCODER_TIMER_6:
-	case ENCODER_TIMER_7:
-	case ENCODER_TIMER_8:
-	case ENCODER_TIMER_9:
+	case ENCODER_TIMER_1 ... ENCODER_TIMER_9:
 		Software_Encoder_Data[type].ipl = priority;
 		Software_Encoder_Data[type].pos = pos;
 		Software_Encoder_Data[type].speed = speed;
-		Software_Encoder_Data[type].sens = gpio_read(gpio_dir);
-		Software_Encoder_Data[type].up = !direction;
 		Software_Encoder_Data[type].mode = gpio_speed;
 		Software_Encoder_Data[type].g_sens = gpio_dir;
-		ic_enable(encoder_ic, 0, IC_EDGE_CAPTURE, ic_cb, priority, (void *) type);
+		
+		// Resolve the registers once, so that the interrupts do not have to
+		Software_Encoder_Data[type].tmr = timer_counter(type);
+		gpio_group_init(&Software_Encoder_Data[type].dir, &gpio_dir, 1);
+		Software_Encoder_Data[type].sens = gpio_group_read(&Software_Encoder_Data[type].dir);
+		// A missing direction pin always reads low, so direction alone sets the counting
+		if(direction)
+			Software_Encoder_Data[type].up = 0;
+		else
+			Software_Encoder_Data[type].up = gpio_dir == GPIO_NONE ? 1 : Software_Encoder_Data[type].dir.mask;
+		
+		// Only timer 2 and 3 can be the time base of the Input Capture
+		Software_Encoder_Data[type].capture = type == ENCODER_TIMER_2 || type == ENCODER_TIMER_3;
+		ic_enable(encoder_ic, type == ENCODER_TIMER_2 ? IC_TIMER2 : IC_TIMER3, IC_EDGE_CAPTURE, ic_cb, priority, (void *) type);
 		
 		gpio_set_dir(gpio_dir, GPIO_INPUT);
 
@@ -246,13 +291,155 @@ void encoder_init(int type, int encoder_ic, long* pos, int* speed, int direction
 		init_timer_encoder(type, priority);
 		return;
 	
-	
 	default:
 		ERROR(ENCODER_INVALID_TYPE, &type)
 	}
 
 }
 
+/**
+	Enable the capture of the position at the index pulse of the hardware encoder.
+	
+	The index signal must be routed to an External Interrupt, which latches the position when
+	the pulse comes. The index input of the QEI itself is not used: resetting the counter in
+	hardware would break the overflow tracking of errata 31. When resetting on index, the
+	position becomes relative to the index and the speed is not disturbed; this allows homing
+	in a single pass. encoder_init() must have been called with \ref ENCODER_TYPE_HARD before.
+	
+	\param	ei_id
+			External Interrupt receiving the index signal, one of \ref ei_identifiers. It runs at the priority of the encoder.
+	\param	polarity
+			Edge of the index pulse to catch, one of \ref ei_polarity.
+	\param	reset
+			If true, the position is set to 0 at each index pulse.
+	\param	callback
+			Function called at each index pulse with the position at the pulse, before any reset; may be NULL.
+*/
+void encoder_enable_index(int ei_id, int polarity, bool reset, encoder_index_callback callback)
+{
+	QEI_Encoder_Data.index_reset = reset;
+	QEI_Encoder_Data.index_callback = callback;
+	
+	ei_init(ei_id, polarity, QEI_Encoder_Data.ipl);
+	ei_enable(ei_id, qei_index_cb, NULL);
+}
+
+/**
+	Disable the capture of the position at the index pulse.
+	
+	\param	ei_id
+			External Interrupt given to encoder_enable_index().
+*/
+void encoder_disable_index(int ei_id)
+{
+	ei_disable(ei_id);
+}
+
+/**
+	Enable the estimation of a fine speed from the timestamps of the encoder edges.
+	
+	An Input Capture timestamps the edges of one encoder signal with a free-running time base.
+	At low count rates, encoder_step() computes the speed from the amount of counts between the
+	two last captured edges divided by their time difference; when no edge comes, the speed
+	decays as the time since the last edge grows. At high count rates, it uses the difference of
+	positions. In between, both are mixed linearly, so the estimate does not jump when switching.
+	
+	\param	type
+			Type of encoder, either hardware or software, one of \ref encoder_type.
+	\param	ic
+			Input Capture receiving one of the encoder signals, one of \ref ic_identifiers. It must not be the one used for the direction of a software encoder.
+	\param	ic_timer
+			Time base of the Input Capture, one of \ref ic_timer_source. The timer must be free-running with a period of 0xFFFF, and must not be the counter of the encoder.
+	\param	ic_mode
+			Edges to capture, one of \ref ic_modes. Capturing fewer edges lowers the interrupt rate at high speed.
+	\param	step_period
+			Time between two calls to encoder_step(), in ticks of the time base.
+	\param	speed
+			Pointer to where encoder_step() must update the fine speed, in 1/256 count per step.
+	\param 	priority
+			Interrupt priority, must be the one given to encoder_init() for this encoder, so that the
+			Input Capture interrupt reads a position that no encoder interrupt is updating.
+*/
+void encoder_init_speed_estimation(int type, int ic, int ic_timer, int ic_mode, unsigned int step_period, long* speed, int priority)
+{
+	ERROR_CHECK_RANGE(type, ENCODER_TIMER_1, ENCODER_TYPE_HARD, ENCODER_INVALID_TYPE);
+	if(!step_period)
+		ERROR(ENCODER_INVALID_STEP_PERIOD, &step_period);
+	if(priority != (type == ENCODER_TYPE_HARD ? QEI_Encoder_Data.ipl : Software_Encoder_Data[type].ipl))
+		ERROR(GENERIC_ERROR_INVALID_INTERRUPT_PRIORITY, &priority);
+	if((type == ENCODER_TIMER_2 && ic_timer == IC_TIMER2) || (type == ENCODER_TIMER_3 && ic_timer == IC_TIMER3))
+		ERROR(ENCODER_INVALID_TYPE, &type);
+
+	Speed_Estimator_Data[type].speed = speed;
+	Speed_Estimator_Data[type].period = step_period;
+	Speed_Estimator_Data[type].max_idle = 0xFFFF / step_period;
+	Speed_Estimator_Data[type].ipl = priority;
+	Speed_Estimator_Data[type].captured = false;
+	Speed_Estimator_Data[type].idle = Speed_Estimator_Data[type].max_idle;
+	Speed_Estimator_Data[type].edge_counts = 0;
+	Speed_Estimator_Data[type].period_speed = 0;
+	*speed = 0;
+
+	ic_enable(ic, ic_timer, ic_mode, ic_speed_cb, priority, (void *) type);
+}
+
+/** Update the fine speed of an encoder, diff is the difference of positions since the last step */
+static void encoder_estimate_speed(int type, long diff)
+{
+	int flags;
+	bool captured;
+	unsigned int stamp;
+	unsigned int dt;
+	long count;
+	long delta;
+	long bound;
+	unsigned long adiff = diff < 0 ? -diff : diff;
+
+	RAISE_IPL(flags, Speed_Estimator_Data[type].ipl);
+	captured = Speed_Estimator_Data[type].captured;
+	stamp = Speed_Estimator_Data[type].stamp;
+	count = Speed_Estimator_Data[type].count;
+	Speed_Estimator_Data[type].captured = false;
+	IRQ_ENABLE(flags);
+
+	if(captured)
+	{
+		// speed between the reference edge and this one, if they are less than a timer period apart
+		dt = stamp - Speed_Estimator_Data[type].ref_stamp;
+		if(Speed_Estimator_Data[type].idle < Speed_Estimator_Data[type].max_idle && dt)
+		{
+			delta = count - Speed_Estimator_Data[type].ref_count;
+			Speed_Estimator_Data[type].period_speed = (delta * (long) Speed_Estimator_Data[type].period << ENCODER_SPEED_SHIFT) / dt;
+			Speed_Estimator_Data[type].edge_counts = delta < 0 ? -delta : delta;
+		}
+		Speed_Estimator_Data[type].ref_stamp = stamp;
+		Speed_Estimator_Data[type].ref_count = count;
+		Speed_Estimator_Data[type].idle = 0;
+	}
+	else if(Speed_Estimator_Data[type].idle < Speed_Estimator_Data[type].max_idle)
+	{
+		// no edge for idle steps, so the speed is at most the counts of an edge interval during that time
+		Speed_Estimator_Data[type].idle++;
+		bound = ((long) Speed_Estimator_Data[type].edge_counts << ENCODER_SPEED_SHIFT) / Speed_Estimator_Data[type].idle;
+		if(Speed_Estimator_Data[type].period_speed > bound)
+			Speed_Estimator_Data[type].period_speed = bound;
+		else if(Speed_Estimator_Data[type].period_speed < -bound)
+			Speed_Estimator_Data[type].period_speed = -bound;
+	}
+	else
+	{
+		Speed_Estimator_Data[type].period_speed = 0;
+	}
+
+	if(adiff >= ENCODER_SPEED_HIGH)
+		*Speed_Estimator_Data[type].speed = diff << ENCODER_SPEED_SHIFT;
+	else if(adiff <= ENCODER_SPEED_LOW)
+		*Speed_Estimator_Data[type].speed = Speed_Estimator_Data[type].period_speed;
+	else
+		*Speed_Estimator_Data[type].speed = ((diff << ENCODER_SPEED_SHIFT) * (long) (adiff - ENCODER_SPEED_LOW) +
+			Speed_Estimator_Data[type].period_speed * (long) (ENCODER_SPEED_HIGH - adiff)) / (ENCODER_SPEED_HIGH - ENCODER_SPEED_LOW);
+}
+
 /** 
 	Get the position of the encoder without interfering with the speed mesurment
 	
@@ -260,6 +447,14 @@ void encoder_init(int type, int encoder_ic, long* pos, int* speed, int direction
 			Type of encoder, either hardware of software, one of \ref encoder_type.
 */
 long encoder_get_position(int type) {
+	long offset;
+	long pos = encoder_read(type, &offset);
+	
+	return pos - offset;
+}
+
+/** Read the counters of an encoder, return the raw position and store in offset the counter value taken as position 0 */
+static long encoder_read(int type, long* offset) {
 	unsigned int temp1;
 	unsigned int temp2;
 	unsigned int b15;
@@ -271,11 +466,12 @@ long encoder_get_position(int type) {
 				barrier();
 				
 				temp3 = Software_Encoder_Data[type].tpos;
-				temp1 = timer_get_value(type);
+				temp1 = *Software_Encoder_Data[type].tmr;
 				temp2 = Software_Encoder_Data[type].sens;
 					
 				barrier();
 			} while(Software_Encoder_Data[type].got_irq);
+			*offset = 0;
 				
 			if(temp2 == Software_Encoder_Data[type].up) 
 				temp3 += temp1;
@@ -291,6 +487,7 @@ long encoder_get_position(int type) {
 				temp1 = POS1CNT;
 				temp2 = QEI_Encoder_Data.high_word;
 				b15 = QEI_Encoder_Data.poscnt_b15;
+				*offset = QEI_Encoder_Data.offset;
 				barrier();
 			} while(QEI_Encoder_Data.got_irq);
 	
@@ -299,9 +496,55 @@ long encoder_get_position(int type) {
 			ERROR(ENCODER_INVALID_TYPE, &type);
 	}
 }
-			
 
+/**
+	Read the raw position of an encoder from an interrupt.
+	
+	Unlike encoder_read(), it does not clear got_irq, so it does not disturb a read in progress
+	in the interrupted code. The encoder interrupts are masked during the read and the pending ones
+	are accounted from the latched values, as encoder_snapshot() does.
+*/
+static long encoder_read_irq(int type)
+{
+	unsigned int tmr;
+	unsigned int sens;
+	unsigned int poscnt;
+	unsigned int b15;
+	int high_word;
+	bool updn;
+	bool pending;
+	long pos;
+	int flags;
 	
+	switch(type) {
+		case ENCODER_TIMER_1 ... ENCODER_TIMER_9:
+			RAISE_IPL(flags, Software_Encoder_Data[type].ipl);
+			tmr = *Software_Encoder_Data[type].tmr;
+			pos = Software_Encoder_Data[type].tpos;
+			sens = Software_Encoder_Data[type].sens;
+			pending = timer_get_if(type);
+			IRQ_ENABLE(flags);
+			
+			return soft_position(type, pos, tmr, sens, pending);
+			
+		case ENCODER_TYPE_HARD:
+			RAISE_IPL(flags, QEI_Encoder_Data.ipl);
+			poscnt = POS1CNT;
+			updn = QEI1CONbits.UPDN;
+			high_word = QEI_Encoder_Data.high_word;
+			b15 = QEI_Encoder_Data.poscnt_b15;
+			pending = IFS3bits.QEIIF;
+			IRQ_ENABLE(flags);
+			
+			if(pending)
+				qei_account_irq(poscnt, updn, &b15, &high_word);
+			return ((long) high_word) << 16 | (poscnt + b15);
+			
+		default:
+			ERROR(ENCODER_INVALID_TYPE, &type);
+	}
+}
+
 
 /**
 	Update the position and speed variables of an encoder.
@@ -311,24 +554,122 @@ long encoder_get_position(int type) {
 */
 void encoder_step(int type)
 {
-	long pos = encoder_get_position(type);
+	long offset;
+	long pos = encoder_read(type, &offset);
+	
+	encoder_update(type, pos - offset, offset);
+}
+
+/**
+	Latch the positions of all initialized encoders at the same instant and update their position and speed variables.
+	
+	The counters are read back-to-back in a single critical section, whose length only depends
+	on the amount of encoders, so a multi-axis controller sees coherent positions. Interrupts
+	pending at that time are accounted from the latched values. The position and speed variables
+	of each encoder, and its fine speed if enabled, are then updated as by encoder_step().
+	
+	\param	snapshot
+			Where to store the latched positions and timestamp.
+	\param	timestamp_timer
+			Timer whose counter is latched with the positions, one of \ref timer_identifiers, or -1 for none.
+*/
+void encoder_snapshot(encoder_snapshot_data* snapshot, int timestamp_timer)
+{
+	volatile unsigned int* stamp = timestamp_timer < 0 ? NULL : timer_counter(timestamp_timer);
+	unsigned int tmr[ENCODER_TYPE_HARD];
+	unsigned int sens[ENCODER_TYPE_HARD];
+	bool pending[ENCODER_TYPE_HARD + 1];
+	unsigned int poscnt = 0;
+	unsigned int b15 = 0;
+	int high_word = 0;
+	bool updn = false;
+	long offset = 0;
+	int flags;
+	int type;
+	
+	IRQ_DISABLE(flags);
+	
+	// Counters first, as close as possible to each other
+	for(type = ENCODER_TIMER_1; type < ENCODER_TYPE_HARD; type++)
+		if(Software_Encoder_Data[type].pos)
+			tmr[type] = *Software_Encoder_Data[type].tmr;
+	if(QEI_Encoder_Data.pos)
+	{
+		poscnt = POS1CNT;
+		updn = QEI1CONbits.UPDN;
+	}
+	snapshot->timestamp = stamp ? *stamp : 0;
+	
+	// Then the state maintained by the interrupts, which cannot change anymore
+	for(type = ENCODER_TIMER_1; type < ENCODER_TYPE_HARD; type++)
+	{
+		if(Software_Encoder_Data[type].pos)
+		{
+			snapshot->position[type] = Software_Encoder_Data[type].tpos;
+			sens[type] = Software_Encoder_Data[type].sens;
+			pending[type] = timer_get_if(type);
+		}
+	}
+	if(QEI_Encoder_Data.pos)
+	{
+		high_word = QEI_Encoder_Data.high_word;
+		b15 = QEI_Encoder_Data.poscnt_b15;
+		offset = QEI_Encoder_Data.offset;
+		pending[ENCODER_TYPE_HARD] = IFS3bits.QEIIF;
+	}
+	
+	IRQ_ENABLE(flags);
+	
+	for(type = ENCODER_TIMER_1; type < ENCODER_TYPE_HARD; type++)
+	{
+		if(!Software_Encoder_Data[type].pos)
+		{
+			snapshot->position[type] = 0;
+			continue;
+		}
+		snapshot->position[type] = soft_position(type, snapshot->position[type], tmr[type], sens[type], pending[type]);
+		encoder_update(type, snapshot->position[type], 0);
+	}
+	
+	if(QEI_Encoder_Data.pos)
+	{
+		if(pending[ENCODER_TYPE_HARD])
+			qei_account_irq(poscnt, updn, &b15, &high_word);
+		snapshot->position[ENCODER_TYPE_HARD] = (((long) high_word) << 16 | (poscnt + b15)) - offset;
+		encoder_update(ENCODER_TYPE_HARD, snapshot->position[ENCODER_TYPE_HARD], offset);
+	}
+	else
+		snapshot->position[ENCODER_TYPE_HARD] = 0;
+}
+
+/** Update the position and speed variables of an encoder from its current position and offset */
+static void encoder_update(int type, long pos, long offset)
+{
+	long diff;
 
 	switch(type) {
 		case ENCODER_TIMER_1 ... ENCODER_TIMER_9:
 		
-			*(Software_Encoder_Data[type].speed) = pos - *(Software_Encoder_Data[type].pos);
+			diff = pos - *(Software_Encoder_Data[type].pos);
+			*(Software_Encoder_Data[type].speed) = diff;
 			*(Software_Encoder_Data[type].pos) = pos;
 
 			break;
 		case ENCODER_TYPE_HARD:
 	
-			*QEI_Encoder_Data.speed = pos - *QEI_Encoder_Data.pos;
+			// a reset on index moves the position but not the encoder
+			diff = pos - *QEI_Encoder_Data.pos + (offset - QEI_Encoder_Data.step_offset);
+			QEI_Encoder_Data.step_offset = offset;
+			*QEI_Encoder_Data.speed = diff;
 			*QEI_Encoder_Data.pos = pos;
 			
 			break;
 		default:
 			ERROR(ENCODER_INVALID_TYPE, &type);
 	}
+
+	if(Speed_Estimator_Data[type].speed)
+		encoder_estimate_speed(type, diff);
 }
 
 /**
@@ -361,6 +702,8 @@ void encoder_reset(int type)
 			QEI_Encoder_Data.high_word = 0;
 			POS1CNT = 0;
 			QEI_Encoder_Data.poscnt_b15 = 0;
+			QEI_Encoder_Data.offset = 0;
+			QEI_Encoder_Data.step_offset = 0;
 			
 			*QEI_Encoder_Data.speed = 0;
 			*QEI_Encoder_Data.pos = 0;
@@ -372,99 +715,62 @@ void encoder_reset(int type)
 	}	
 }
 
-//! Callback for Input Capture 
-static void ic_tmr2_cb(int __attribute__((unused)) foo, unsigned int value, void * __attribute__((unused)) bar)
+/**
+	Account a direction change of a software encoder.
+	
+	The counts up to value were done in the previous direction, the ones after it in the new direction.
+	The counter is not cleared but decreased by what was read, with atomic_sub() which is a single
+	read-modify-write instruction, so that no count coming in between is lost. If the counter wraps around in
+	between, the remainder is still right but the timer interrupt must not account the wrap again.
+	
+	\param	e
+			index of the encoder in Software_Encoder_Data
+	\param	value
+			counter value at the direction change
+*/
+static __attribute__((always_inline)) void encoder_direction_change(int e, unsigned int value)
 {
 	unsigned int tmr;
+	long done;
 
-	if(Software_Encoder_Data[1].sens == Software_Encoder_Data[1].up) 
-		Software_Encoder_Data[1].tpos += value;
-	else
-		Software_Encoder_Data[1].tpos -= value;
-
-	/* Now update the timer with the correct value */
-	/* Yeah, it's a bit racy, but we are a _lot_ more faster than the external clock
-	 * So the race window is small */
-	 
-	 // Race window could be closed by doing a "TMR2 -= tmr" atomic instruction and then checking that 
-	 // TMR2 is really at 0 but it's too much pain for a such small race.
-	tmr = TMR2;
-	TMR2 = 0;
-
+	tmr = *Software_Encoder_Data[e].tmr;
+	atomic_sub(Software_Encoder_Data[e].tmr, tmr);
+	
 	if (tmr < value)
 	{
-		/* WTF ?!? the timer has done an overflow while the motor has changed direction ...*/
-		/* what can I do ? ... mmm .... */
-		/* we must account the number of imp. done since the IC trigger */
-		/* Clear the timer interrupt flag so it don't trigger and account false results */
-		IFS0bits.T2IF = 0;
-		if(Software_Encoder_Data[1].sens == Software_Encoder_Data[1].up) {
-			Software_Encoder_Data[1].tpos -= (((unsigned int) 0xFFFF) - value) + tmr;
-		} else {
-			Software_Encoder_Data[1].tpos += (((unsigned int) 0xFFFF) - value) + tmr;
-		}
-	} else {
-		/* tmr - icval is the number of imp. done since we have changed direction */
-		if(Software_Encoder_Data[1].sens == Software_Encoder_Data[1].up) 
-			Software_Encoder_Data[1].tpos -= ((long) tmr) - ((long) value);
-		else
-			Software_Encoder_Data[1].tpos += ((long) tmr) - ((long) value);
+		/* The timer has done an overflow since the direction change, account it here
+		 * and clear the timer interrupt flag so it does not account it again */
+		timer_set_if(e, false);
+		done = (long) value - (0x00010000L - value + tmr);
 	}
-	
-	Software_Encoder_Data[1].got_irq = 1;
-	Software_Encoder_Data[1].sens = gpio_read(Software_Encoder_Data[1].g_sens);
-}
-
-//! Callback for Input Capture 
-static void ic_tmr3_cb(int __attribute__((unused)) foo, unsigned int value, void * __attribute__((unused)) bar)
-{
-	unsigned int tmr;
-
-	if(Software_Encoder_Data[2].sens == Software_Encoder_Data[2].up) 
-		Software_Encoder_Data[2].tpos += value;
 	else
-		Software_Encoder_Data[2].tpos -= value;
-
-	/* Now update the timer with the correct value */
-	/* Yeah, it's a bit racy, but we are a _lot_ more faster than the external clock
-	 * So the race window is small */
-	tmr = TMR3;
-	TMR3 = 0;
-
-	if (tmr < value)
 	{
-		/* WTF ?!? the timer has done an overflow while the motor has changed direction ...*/
-		/* what can I do ? ... mmm .... */
-		/* we must account the number of imp. done since the IC trigger */
-		/* Clear the timer interrupt flag so it don't trigger and account false results */
-		IFS0bits.T3IF = 0;
-		if(Software_Encoder_Data[2].sens == Software_Encoder_Data[2].up) {
-			Software_Encoder_Data[2].tpos -= (((unsigned int) 0xFFFF) - value) + tmr;
-		} else {
-			Software_Encoder_Data[2].tpos += (((unsigned int) 0xFFFF) - value) + tmr;
-		}
-	} else {
-		/* tmr - icval is the number of imp. done since we have changed direction */
-		if(Software_Encoder_Data[2].sens == Software_Encoder_Data[2].up) 
-			Software_Encoder_Data[2].tpos -= ((long) tmr) - ((long) value);
-		else
-			Software_Encoder_Data[2].tpos += ((long) tmr) - ((long) value);
+		/* tmr - value is the number of imp. done since we have changed direction.
+		 * The counter was close to the top and the flag is set: it wrapped around
+		 * after the read and the subtraction already took this into account */
+		if ((tmr & 0x8000) && timer_get_if(e))
+			timer_set_if(e, false);
+		done = (long) value - ((long) tmr - (long) value);
 	}
 	
-	Software_Encoder_Data[2].sens = gpio_read(Software_Encoder_Data[2].g_sens);
+	if(Software_Encoder_Data[e].sens == Software_Encoder_Data[e].up) 
+		Software_Encoder_Data[e].tpos += done;
+	else
+		Software_Encoder_Data[e].tpos -= done;
 	
-	Software_Encoder_Data[2].got_irq = 1;
+	Software_Encoder_Data[e].sens = gpio_group_read(&Software_Encoder_Data[e].dir);
+	Software_Encoder_Data[e].got_irq = 1;
 }
 
-static void tmr2_3_cb(int tmr) {
-	
-	if(Software_Encoder_Data[tmr].sens != gpio_read(Software_Encoder_Data[tmr].g_sens))
+//! Callback for the timer overflow of all software encoders
+static void tmr_cb(int tmr)
+{
+	if (Software_Encoder_Data[tmr].capture && Software_Encoder_Data[tmr].sens != gpio_group_read(&Software_Encoder_Data[tmr].dir))
 	{
 		/* Wow, we changed direction and IC interrupt has still not fired ...
-		 * Do not do anything */
-		return ;
+		 * Do not do anything, the IC will account the overflow */
+		return;
 	}
-
 	
 	if (Software_Encoder_Data[tmr].sens == Software_Encoder_Data[tmr].up) 
 		Software_Encoder_Data[tmr].tpos += 0x00010000L;
@@ -474,62 +780,50 @@ static void tmr2_3_cb(int tmr) {
 	Software_Encoder_Data[tmr].got_irq = 1;
 }
 
-static void tmr_cb(int tmr) {
-	if (Software_Encoder_Data[tmr].sens == Software_Encoder_Data[tmr].up) 
-		Software_Encoder_Data[tmr].tpos += 0x00010000L;
+//! Callback for the Input Capture on the direction pin of all software encoders
+static void ic_cb(int __attribute__((unused)) foo, unsigned int value, void * data)
+{
+	int e = (int) data;
+	
+	// Without timestamp, the direction changed when the interrupt runs
+	if (Software_Encoder_Data[e].capture)
+		encoder_direction_change(e, value);
 	else
-		Software_Encoder_Data[tmr].tpos -= 0x00010000L;
-
-
-	Software_Encoder_Data[tmr].got_irq = 1;
+		encoder_direction_change(e, *Software_Encoder_Data[e].tmr);
 }
 
-static void ic_cb(int __attribute__((unused)) foo, unsigned int __attribute((unused)) bar, void * data) {
-	unsigned int value = 0;
-	unsigned int tmr = (unsigned int) data;
-	
-	// I don't use "molole" timer access function because I want to be _FAST_ to avoid as much
-	// as possible a race between timer read and timer clear
-	switch(tmr) {
-		case TIMER_1:
-			value = TMR1;
-			TMR1 = 0;
-			break;
-		case TIMER_4:
-			value = TMR4;
-			TMR4 = 0;
-			break;
-		case TIMER_5:
-			value = TMR5;
-			TMR5 = 0;
-			break;
-		case TIMER_6:
-			value = TMR6;
-			TMR6 = 0;
-			break;
-		case TIMER_7:
-			value = TMR7;
-			TMR7 = 0;
-			break;
-		case TIMER_8:
-			value = TMR8;
-			TMR8 = 0;
-			break;
-		case TIMER_9:
-			value = TMR9;
-			TMR9 = 0;
-			break;
-	}
-	
-	if(Software_Encoder_Data[tmr].sens == Software_Encoder_Data[tmr].up) 
-		Software_Encoder_Data[tmr].tpos += value;
-	else
-		Software_Encoder_Data[tmr].tpos -= value;
+//! Callback for the External Interrupt on the index pulse
+static void qei_index_cb(int __attribute__((unused)) ei_id, void * __attribute__((unused)) data)
+{
+	unsigned int poscnt = POS1CNT;
+	unsigned int b15 = QEI_Encoder_Data.poscnt_b15;
+	int high_word = QEI_Encoder_Data.high_word;
+	long raw;
+	long pos;
 	
-	Software_Encoder_Data[tmr].sens = gpio_read(Software_Encoder_Data[tmr].g_sens);
+	// Same priority as the QEI interrupt, which might be pending but cannot run now
+	if(IFS3bits.QEIIF)
+		qei_account_irq(poscnt, QEI1CONbits.UPDN, &b15, &high_word);
+	raw = ((long) high_word) << 16 | (poscnt + b15);
+	pos = raw - QEI_Encoder_Data.offset;
 	
-	Software_Encoder_Data[tmr].got_irq = 1;
+	if(QEI_Encoder_Data.index_reset)
+		QEI_Encoder_Data.offset = raw;
+	QEI_Encoder_Data.got_irq = 1;
 	
+	if(QEI_Encoder_Data.index_callback)
+		QEI_Encoder_Data.index_callback(pos);
+}
+
+//! Callback for the Input Capture timestamping the encoder edges
+static void ic_speed_cb(int __attribute__((unused)) ic_id, unsigned int value, void * data)
+{
+	int type = (int) data;
+
+	// raw position, only differences matter and a reset on index must not disturb them
+	Speed_Estimator_Data[type].stamp = value;
+	Speed_Estimator_Data[type].count = encoder_read_irq(type);
+	Speed_Estimator_Data[type].captured = true;
 }
 
 //--------------------------
@@ -547,19 +841,7 @@ void _ISR _QEIInterrupt(void)
 	
 	QEI_Encoder_Data.got_irq = 1;
 	
-	QEI_Encoder_Data.poscnt_b15 ^=0x8000;
-	
-	// If we have done an overflow while b15 was set, then update high_word
-	if((!QEI_Encoder_Data.poscnt_b15) && (POS1CNT < 0x3FFF)) 
-		if (QEI1CONbits.UPDN)
-			QEI_Encoder_Data.high_word++;		// Forward
-		
-	// If we have done an underflow while b15 was not set, then update high_word
-	if((QEI_Encoder_Data.poscnt_b15) && (POS1CNT > 0x3FFF)) 
-		if (!QEI1CONbits.UPDN)
-			QEI_Encoder_Data.high_word--;
-
-	
+	qei_account_irq(POS1CNT, QEI1CONbits.UPDN, &QEI_Encoder_Data.poscnt_b15, &QEI_Encoder_Data.high_word);
 }
 
 /*@}*/
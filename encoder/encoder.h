@@ -43,6 +43,7 @@ enum encoder_errors
 	ENCODER_ERROR_BASE = 0x0800,
 	ENCODER_INVALID_TYPE,				/**< The specified encoder type is invalid, must be one of \ref encoder_type */
 	ENCODER_INVALID_MODE,				/**< The specified encoder speed is invalid, must be one of \ref encoder_mode */
+	ENCODER_INVALID_STEP_PERIOD,		/**< The specified step period is zero */
 };
 
 
@@ -75,14 +76,32 @@ enum encoder_mode
 	ENCODER_MODE_X4 = 1,	/**< 4 times mode */
 };
 
+/** Callback at the index pulse of the hardware encoder, position is the one at the pulse */
+typedef void (*encoder_index_callback)(long position);
+
+/** Positions of all encoders latched at the same instant by encoder_snapshot() */
+typedef struct
+{
+	long position[ENCODER_TYPE_HARD + 1];	/**< position of each encoder, indexed by \ref encoder_type ; 0 for the ones not initialized */
+	unsigned int timestamp;				/**< value of the timestamp timer when the positions were latched, 0 if there is none */
+} encoder_snapshot_data;
+
 // Functions, doc in the .c
 
 void encoder_init(int type, int encoder_ic, long* pos, int* speed, int direction, gpio gpio_dir, gpio gpio_speed, int decoding_mode, int priority);
 
+void encoder_enable_index(int ei_id, int polarity, bool reset, encoder_index_callback callback);
+
+void encoder_disable_index(int ei_id);
+
+void encoder_init_speed_estimation(int type, int ic, int ic_timer, int ic_mode, unsigned int step_period, long* speed, int priority);
+
 void encoder_step(int type);
 
 long encoder_get_position(int type);
 
+void encoder_snapshot(encoder_snapshot_data* snapshot, int timestamp_timer);
+
 void encoder_reset(int type);
 
 /*@}*/
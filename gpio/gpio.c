@@ -43,6 +43,9 @@
 	LATx
 */
 
+/** TRIS, PORT and LAT of the port of a group without pin, which a null mask never changes */
+static unsigned int gpio_group_no_port[3];
+
 #define ODC_EXIST(p) ((defined _ODC## p ##0) || (defined _ODC## p ##1) || (defined _ODC## p ##2) || (defined _ODC## p ##3) || (defined _ODC## p ##4) || (defined _ODC## p ##5)  || (defined _ODC## p ##6) || (defined _ODC## p ##7) || (defined _ODC## p ##8) || (defined _ODC## p ##8) || (defined _ODC## p ##9) || (defined _ODC## p ##10) || (defined _ODC## p ##11) || (defined _ODC## p ##12) || (defined _ODC## p ##13) || (defined _ODC## p ##14) || (defined _ODC## p ##15))
 
 /** 
@@ -397,4 +400,39 @@ void gpio_set_opendrain_byte(gpio gpio_id, int opendrain) {
 		gpio_set_opendrain((gpio_id & 0xFFF0) | i, opendrain);
 }
 
+/**
+	Resolve the LAT register and mask of a group of GPIOs once, so that gpio_group_set(),
+	gpio_group_clear() and gpio_group_toggle() cost a single instruction.
+	
+	\param	group
+			the group to initialize
+	\param	gpios
+			identifiers of the GPIOs, must be created by GPIO_MAKE_ID() and be on the same port; GPIO_NONE are ignored
+	\param	count
+			amount of GPIOs in gpios
+*/
+void gpio_group_init(gpio_group * group, const gpio * gpios, unsigned int count)
+{
+	volatile unsigned int * ptr;
+	unsigned int i;
+	
+	// Without pin, the group acts on a dummy port
+	group->lat = &gpio_group_no_port[2];
+	group->mask = 0;
+	
+	for(i = 0; i < count; i++)
+	{
+		ptr = (volatile unsigned int *) (gpios[i] >> 4);
+		if(ptr == GPIO_NONE)
+			continue;
+		
+		ptr += 2;
+		if(group->mask && ptr != group->lat)
+			ERROR(GPIO_NOT_SAME_PORT, (void *) &gpios[i]);
+		
+		group->lat = ptr;
+		group->mask |= 1 << (gpios[i] & 0xF);
+	}
+}
+
 /*@}*/
@@ -43,6 +43,7 @@ enum gpio_errors
 	GPIO_INVALID_GPIO,			/**< The specified GPIO doesn't exist */
 	GPIO_INVALID_DIR,			/**< The specified direction doesn't exist */
 	GPIO_INVALID_VALUE,			/**< The specified value is not true of false */
+	GPIO_NOT_SAME_PORT,			/**< The GPIOs of a group are not all on the same port */
 };
 
 /** TRIS configuration mode */
@@ -98,6 +99,13 @@ enum gpio_pin_number
 /** GPIO identifier */
 typedef unsigned int gpio;
 
+/** Pins of a same port, whose LAT register and mask are resolved once by gpio_group_init() */
+typedef struct
+{
+	volatile unsigned int * lat;	/**< LAT register of the port */
+	unsigned int mask;				/**< pins of the group in the port */
+} gpio_group;
+
 
 // Functions, doc in the .c
 
@@ -116,6 +124,38 @@ void gpio_set_dir_word(gpio gpio_id, int dir);
 unsigned int gpio_read_word(gpio gpio_id);
 void gpio_write_word(gpio gpio_id, unsigned int value);
 
+void gpio_group_init(gpio_group * group, const gpio * gpios, unsigned int count);
+
+/** Set all pins of a group to VCC, in one atomic instruction */
+static inline __attribute__((always_inline)) void gpio_group_set(const gpio_group * group)
+{
+	atomic_or(group->lat, group->mask);
+}
+
+/** Set all pins of a group to GND, in one atomic instruction */
+static inline __attribute__((always_inline)) void gpio_group_clear(const gpio_group * group)
+{
+	atomic_and(group->lat, ~group->mask);
+}
+
+/** Toggle all pins of a group, in one atomic instruction */
+static inline __attribute__((always_inline)) void gpio_group_toggle(const gpio_group * group)
+{
+	atomic_xor(group->lat, group->mask);
+}
+
+/** Read the pins of a group, as a mask of the ones at VCC; PORT is the register before LAT */
+static inline __attribute__((always_inline)) unsigned int gpio_group_read(const gpio_group * group)
+{
+	return group->lat[-1] & group->mask;
+}
+
+/** Configure all pins of a group as outputs, in one atomic instruction; TRIS is two registers before LAT */
+static inline __attribute__((always_inline)) void gpio_group_set_output(const gpio_group * group)
+{
+	atomic_and(group->lat - 2, ~group->mask);
+}
+
 /*@}*/
 
 #endif
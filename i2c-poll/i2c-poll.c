@@ -0,0 +1,260 @@
+/*
+	Molole - Mobots Low Level library
+	An open source toolkit for robot programming using DsPICs
+
+	Copyright (C) 2007--2011 Stephane Magnenat <stephane at magnenat dot net>,
+	Philippe Retornaz <philippe dot retornaz at epfl dot ch>
+	Mobots group (http://mobots.epfl.ch), Robotics system laboratory (http://lsro.epfl.ch)
+	EPFL Ecole polytechnique federale de Lausanne (http://www.epfl.ch)
+
+	See authors.txt for more details about other contributors.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+//--------------------
+// Usage documentation
+//--------------------
+
+/**
+	\defgroup i2c-poll I2C sensor polling
+	
+	Periodic reading of register-based I2C sensors.
+
+	The application declares an array of \ref i2c_poll_sensor, initializes each with
+	i2c_poll_init_sensor(), calls i2c_poll_start() once and then i2c_poll_tick() periodically,
+	typically from a timer callback.
+	When a sensor is due, its register is read through the I2C master queue
+	(see i2c_master_transfert_queue()); the reads on a bus are chained back-to-back
+	from the I2C interrupt.
+	Each sensor has two snapshot buffers: the bus writes in one while the other holds
+	the latest value, and they are swapped when a read succeeds.
+	i2c_poll_read() copies the latest value without disabling interrupts.
+	
+	Sensors on different buses are read in parallel.
+	The I2C masters must have been initialized by i2c_init() and i2c_init_master().
+*/
+/*@{*/
+
+/** \file
+	Implementation of the periodic I2C sensor polling service.
+*/
+
+
+//------------
+// Definitions
+//------------
+
+#include <string.h>
+
+#include "i2c-poll.h"
+#include "../types/uc.h"
+#include "../error/error.h"
+#include "../i2c/i2c.h"
+
+//-----------------------
+// Structures definitions
+//-----------------------
+
+/** Polling service data */
+static struct
+{
+	i2c_poll_sensor* sensors;		/**< sensors to poll */
+	unsigned int count;				/**< amount of sensors */
+	int priority;					/**< priority of the reads in the I2C master queues */
+	i2c_poll_sensor* active[3];		/**< sensor being read on each bus, NULL if none */
+} I2C_Poll_Data;
+
+
+//-------------------
+// Internal functions
+//-------------------
+
+static void i2c_poll_read_done(int i2c_id, bool result);
+
+/** Start the read of the next due sensor of a bus, must be called with interrupts disabled */
+static void i2c_poll_start_next(int i2c_id)
+{
+	i2c_poll_sensor* sensor;
+	unsigned int i;
+
+	for (i = 0; i < I2C_Poll_Data.count; i++)
+	{
+		sensor = &I2C_Poll_Data.sensors[i];
+		if (sensor->i2c_id == i2c_id && sensor->pending)
+		{
+			sensor->pending = false;
+			I2C_Poll_Data.active[i2c_id] = sensor;
+			// read directly into the snapshot that is not published
+			i2c_master_transfert_queue(i2c_id, sensor->address, &sensor->reg, 1, sensor->snapshots[(sensor->sequence + 1) & 1], sensor->size, i2c_poll_read_done, I2C_Poll_Data.priority);
+			return;
+		}
+	}
+	I2C_Poll_Data.active[i2c_id] = NULL;
+}
+
+/** Callback from the I2C master when the read of the active sensor of a bus has ended */
+static void i2c_poll_read_done(int i2c_id, bool result)
+{
+	i2c_poll_sensor* sensor = I2C_Poll_Data.active[i2c_id];
+	int flags;
+
+	// publish the new snapshot; 0 means never read, so wrap to 2, which keeps the lsb alternating
+	if (result)
+		sensor->sequence = sensor->sequence == 0xFFFF ? 2 : sensor->sequence + 1;
+	else
+		sensor->errors++;
+
+	IRQ_DISABLE(flags);
+	i2c_poll_start_next(i2c_id);
+	IRQ_ENABLE(flags);
+}
+
+
+//-------------------
+// Exported functions
+//-------------------
+
+/**
+	Initialize a sensor to be polled.
+
+	\param	sensor
+			sensor to initialize
+	\param	i2c_id
+			identifier of the I2C bus, \ref I2C_1 or \ref I2C_2
+	\param	address
+			I2C address of the sensor (7 bits, unshifted)
+	\param	reg
+			register to read
+	\param	size
+			amount of data to read, from 1 to \ref I2C_POLL_MAX_DATA
+	\param	period
+			amount of calls to i2c_poll_tick() between two reads
+*/
+void i2c_poll_init_sensor(i2c_poll_sensor* sensor, int i2c_id, unsigned char address, unsigned char reg, unsigned int size, unsigned int period)
+{
+	ERROR_CHECK_RANGE(i2c_id, I2C_1, I2C_3, I2C_ERROR_INVALID_ID);
+	ERROR_CHECK_RANGE(size, 1, I2C_POLL_MAX_DATA, I2C_POLL_ERROR_INVALID_SIZE);
+	if (period == 0)
+		ERROR(I2C_POLL_ERROR_INVALID_PERIOD, &period);
+
+	sensor->i2c_id = i2c_id;
+	sensor->address = address;
+	sensor->reg = reg;
+	sensor->size = size;
+	sensor->period = period;
+	sensor->countdown = period;
+	sensor->pending = false;
+	sensor->sequence = 0;
+	sensor->errors = 0;
+	memset(sensor->snapshots, 0, sizeof(sensor->snapshots));
+}
+
+/**
+	Start polling sensors.
+
+	The sensors are read for the first time at the first call of i2c_poll_tick().
+
+	\param	sensors
+			array of sensors, initialized with i2c_poll_init_sensor(), that must remain valid
+	\param	count
+			amount of sensors
+	\param	priority
+			priority of the reads relatively to the other transferts queued on the I2C masters
+*/
+void i2c_poll_start(i2c_poll_sensor* sensors, unsigned int count, int priority)
+{
+	unsigned int i;
+	int flags;
+
+	IRQ_DISABLE(flags);
+	I2C_Poll_Data.sensors = sensors;
+	I2C_Poll_Data.count = count;
+	I2C_Poll_Data.priority = priority;
+	for (i = 0; i < count; i++)
+		sensors[i].countdown = 1;
+	IRQ_ENABLE(flags);
+}
+
+/**
+	Advance the polling service by one tick, and start the reads that are due.
+
+	If the previous read of a sensor has not started yet when the next one is due,
+	only one read is done.
+*/
+void i2c_poll_tick(void)
+{
+	i2c_poll_sensor* sensor;
+	unsigned int i;
+	int i2c_id;
+	int flags;
+
+	IRQ_DISABLE(flags);
+	for (i = 0; i < I2C_Poll_Data.count; i++)
+	{
+		sensor = &I2C_Poll_Data.sensors[i];
+		if (--sensor->countdown == 0)
+		{
+			sensor->countdown = sensor->period;
+			sensor->pending = true;
+		}
+	}
+	for (i2c_id = I2C_1; i2c_id <= I2C_3; i2c_id++)
+	{
+		if (I2C_Poll_Data.active[i2c_id] == NULL)
+			i2c_poll_start_next(i2c_id);
+	}
+	IRQ_ENABLE(flags);
+}
+
+/**
+	Copy the latest value read from a sensor.
+
+	This is lock-free: if a new value is published during the copy, the copy is restarted.
+
+	\param	sensor
+			sensor to read
+	\param	data
+			where to copy the value, must hold the size given to i2c_poll_init_sensor()
+
+	\return	sequence number of the latest successful read of this sensor, 0 if data was never read;
+			it counts the reads but skips 0 when wrapping around, and comparing it with the
+			previous one tells whether the value is new.
+*/
+unsigned int i2c_poll_read(const i2c_poll_sensor* sensor, unsigned char* data)
+{
+	unsigned int sequence;
+
+	do
+	{
+		sequence = sensor->sequence;
+		memcpy(data, sensor->snapshots[sequence & 1], sensor->size);
+	}
+	while (sequence != sensor->sequence);
+
+	return sequence;
+}
+
+/**
+	Return the amount of failed reads of a sensor.
+
+	\param	sensor
+			sensor to query
+*/
+unsigned int i2c_poll_get_errors(const i2c_poll_sensor* sensor)
+{
+	return sensor->errors;
+}
+
+/*@}*/
@@ -0,0 +1,81 @@
+/*
+	Molole - Mobots Low Level library
+	An open source toolkit for robot programming using DsPICs
+
+	Copyright (C) 2007--2011 Stephane Magnenat <stephane at magnenat dot net>,
+	Philippe Retornaz <philippe dot retornaz at epfl dot ch>
+	Mobots group (http://mobots.epfl.ch), Robotics system laboratory (http://lsro.epfl.ch)
+	EPFL Ecole polytechnique federale de Lausanne (http://www.epfl.ch)
+
+	See authors.txt for more details about other contributors.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _MOLOLE_I2C_POLL_H
+#define _MOLOLE_I2C_POLL_H
+
+#include "../types/types.h"
+
+/** \addtogroup i2c-poll */
+/*@{*/
+
+/** \file
+	Periodic I2C sensor polling service definitions
+*/
+
+// Defines
+
+/** Errors the I2C polling service can throw */
+enum i2c_poll_errors
+{
+	I2C_POLL_ERROR_BASE = 0x1300,
+	I2C_POLL_ERROR_INVALID_SIZE,		/**< The amount of data to read is not between 1 and \ref I2C_POLL_MAX_DATA */
+	I2C_POLL_ERROR_INVALID_PERIOD,		/**< The polling period is zero */
+};
+
+/** Maximum amount of data read from one sensor */
+#define I2C_POLL_MAX_DATA 6
+
+/** A sensor read periodically by the polling service.
+	Allocated by the application and initialized with i2c_poll_init_sensor(), the fields are private. */
+typedef struct
+{
+	int i2c_id;					/**< I2C bus of the sensor */
+	unsigned char address;		/**< I2C address of the sensor (7 bits, unshifted) */
+	unsigned char reg;			/**< register to read, written before reading */
+	unsigned int size;			/**< amount of data to read */
+	unsigned int period;		/**< amount of ticks between two reads */
+	unsigned int countdown;		/**< ticks left before the next read */
+	bool pending;				/**< true if a read is due but not started yet */
+	volatile unsigned int sequence;		/**< sequence of successful reads, 0 if never read and never 0 afterwards, its lsb is the index of the latest snapshot */
+	unsigned int errors;		/**< amount of failed reads */
+	unsigned char snapshots[2][I2C_POLL_MAX_DATA];	/**< latest snapshot and the one being read from the bus */
+} i2c_poll_sensor;
+
+// Functions, doc in the .c
+
+void i2c_poll_init_sensor(i2c_poll_sensor* sensor, int i2c_id, unsigned char address, unsigned char reg, unsigned int size, unsigned int period);
+
+void i2c_poll_start(i2c_poll_sensor* sensors, unsigned int count, int priority);
+
+void i2c_poll_tick(void);
+
+unsigned int i2c_poll_read(const i2c_poll_sensor* sensor, unsigned char* data);
+
+unsigned int i2c_poll_get_errors(const i2c_poll_sensor* sensor);
+
+/*@}*/
+
+#endif
@@ -27,6 +27,7 @@
 
 #include "../types/types.h"
 #include "../error/error.h"
+#include "../gpio/gpio.h"
 
 /** Errors I2C can throw */
 enum i2c_errors
@@ -37,6 +38,8 @@ enum i2c_errors
 	I2C_ERROR_MASTER_BUSY,				/**< A master start was called while the master was busy. */
 	I2C_INVALID_OPERATION,				/**< The operation asked is invalid */
 	I2C_PROTOCOL_INTERNAL_ERROR,		/**< The state machine is confused. Please report a such bug it should never happens */
+	I2C_ERROR_QUEUE_FULL,				/**< No more descriptor available to queue a master transfert. */
+	I2C_ERROR_INVALID_REGISTER_MAP,		/**< The register map is NULL or its size is not between 1 and 256. */
 };
 
 /** \addtogroup i2c */
@@ -68,6 +71,10 @@ typedef bool (*i2c_set_data_callback)(int i2c_id, unsigned char data);
 typedef bool (*i2c_get_data_callback)(int i2c_id, unsigned char* data);
 
 
+/** I2C callback when the master has written into a slave register map.
+	Called once per message, with the first register written and the amount of registers written. */
+typedef void (*i2c_register_map_callback)(int i2c_id, unsigned int first, unsigned int count);
+
 /** I2C callback when an error condition is detected on the bus */
 typedef void (*i2c_error_callback)(int i2c_id, int error_type);
 
@@ -85,6 +92,18 @@ void i2c_init_slave(
 	int priority
 );
 
+void i2c_init_slave_register_map(
+	int i2c_id,
+	unsigned char address,
+	unsigned char* map,
+	const unsigned char* write_mask,
+	unsigned int size,
+	i2c_register_map_callback write_callback,
+	int priority
+);
+
+void i2c_slave_register_map_poll(int i2c_id);
+
 void i2c_disable_slave(int i2c_id);
 
 void i2c_slave_return_to_idle(int i2c_id);
@@ -110,16 +129,59 @@ enum i2c_master_operation
 */
 typedef int (*i2c_master_operation_completed_callback)(int i2c_id, unsigned char** data, void* user_data, bool nack);
 
+/** Op-codes of a compiled I2C master transfert program, see \ref i2c_master_program_step */
+enum i2c_master_program_opcodes
+{
+	I2C_PROGRAM_WRITE,		/**< Write count bytes from data, abort the program with a stop on NAck */
+	I2C_PROGRAM_READ,		/**< Read count bytes into data, ack all but the last byte which is nacked */
+	I2C_PROGRAM_RESTART,	/**< Restart bit */
+	I2C_PROGRAM_STOP,		/**< Stop bit */
+	I2C_PROGRAM_END			/**< End of program, the bus must have been stopped before */
+};
+
+/** One step of a compiled I2C master transfert program.
+	The start bit is implicit, the address byte is written as a \ref I2C_PROGRAM_WRITE step.
+	Write and read steps must have a non-zero count. */
+typedef struct
+{
+	unsigned char opcode;		/**< one of \ref i2c_master_program_opcodes */
+	unsigned char* data;		/**< source or destination of \ref I2C_PROGRAM_WRITE and \ref I2C_PROGRAM_READ */
+	unsigned int count;			/**< amount of data of \ref I2C_PROGRAM_WRITE and \ref I2C_PROGRAM_READ */
+} i2c_master_program_step;
+
+/** Statistics of an I2C master, see i2c_master_get_statistics() */
+typedef struct
+{
+	unsigned int nacks;			/**< Written bytes that were NAcked, by programs or by operation callbacks */
+	unsigned int timeouts;		/**< Transferts aborted because they did not complete in time */
+	unsigned int recoveries;	/**< Bus recovery sequences that were run */
+} i2c_master_statistics;
+
+/** I2C callback when a master transfert has finished, result is true if successfull, false otherwise */
+typedef void (*i2c_master_transfert_result_callback)(int i2c_id, bool result);
+
 // Functions, doc in the .c
 
 void i2c_init_master(int i2c_id, long speed, int priority);
 
 void i2c_master_start_operations(int i2c_id, i2c_master_operation_completed_callback operation_completed_callback, void* user_data);
 
+void i2c_master_start_program(int i2c_id, const i2c_master_program_step* program, i2c_master_transfert_result_callback result_callback);
+
 void i2c_master_reset(int i2c_id);
 
 bool i2c_master_is_busy(int i2c_id);
 
+void i2c_master_set_timeout(int i2c_id, unsigned int timeout, gpio scl, gpio sda);
+
+void i2c_master_timeout_tick(void);
+
+void i2c_master_recover_bus(int i2c_id);
+
+void i2c_master_get_statistics(int i2c_id, i2c_master_statistics* statistics);
+
+void i2c_master_reset_statistics(int i2c_id);
+
 // high level helpers for I2C master
 
 /** Results of I2C high level protocol operations */
@@ -132,13 +194,14 @@ enum i2c_protocol_results
 	I2C_INTERNAL_ERROR,					/**< A internal error has occured, either this is memory corruption or this is a driver bug. */
 };
 
-/** I2C callback when async master transfert has finished operations, result is true if successfull, false otherwise */
-typedef void (*i2c_master_transfert_result_callback)(int i2c_id, bool result);
-
 // Functions, doc in the .c
 
 void i2c_master_transfert_async(int i2c_id, unsigned char addr, unsigned char* write_data, unsigned write_count, unsigned char* read_data, unsigned read_count, i2c_master_transfert_result_callback result_callback);
 
+void i2c_master_transfert_queue(int i2c_id, unsigned char addr, unsigned char* write_data, unsigned write_count, unsigned char* read_data, unsigned read_count, i2c_master_transfert_result_callback result_callback, int priority);
+
+unsigned int i2c_master_queue_length(int i2c_id);
+
 int i2c_master_transfert_block(int i2c_id, unsigned char addr, unsigned char* write_data, unsigned write_count, unsigned char* read_data, unsigned read_count);
 
 bool __attribute((deprecated)) i2c_read(int i2c_id, unsigned char device_add, unsigned char reg, unsigned char *data, unsigned int size);
@@ -44,6 +44,7 @@
 #include "../types/uc.h"
 #include "../error/error.h"
 #include "../clock/clock.h"
+#include "../gpio/gpio.h"
 
 
 //-----------------------
@@ -57,12 +58,210 @@ static struct
 	void* user_data; /**< optional user data that is passed to operation_completed_callback callback */
 	int prev_operation; /**< previous operation, \ref I2C_MASTER_NONE if start of message */
 	unsigned char* prev_data; /**< pointer to data for previous operation, in case of \ref I2C_MASTER_READ */
+	const i2c_master_program_step* program; /**< current step of the running program, NULL if no program is running */
+	unsigned char* program_data; /**< pointer to the next data of the current step */
+	unsigned int program_count; /**< amount of data still to transfert in the current step */
+	bool program_result; /**< false if the program was aborted because of a NAck */
+	i2c_master_transfert_result_callback program_callback; /**< function to call upon program termination */
+	unsigned int timeout; /**< amount of ticks a transfert may last, 0 if disabled */
+	unsigned int timeout_left; /**< ticks left before the current transfert is aborted */
+	gpio scl; /**< SCL pin for the bus recovery sequence, GPIO_NONE if not available */
+	gpio sda; /**< SDA pin for the bus recovery sequence, GPIO_NONE if not available */
+	bool recovering; /**< true while an aborted transfert waits for the end of the bus recovery */
+	i2c_master_statistics statistics; /**< error counters */
 } I2C_Master_Data[3] = {
-	{ NULL, NULL, I2C_MASTER_NONE, NULL},
-	{ NULL, NULL, I2C_MASTER_NONE, NULL},
-	{ NULL, NULL, I2C_MASTER_NONE, NULL}
+	{ NULL, NULL, I2C_MASTER_NONE, NULL, NULL, NULL, 0, false, NULL, 0, 0, GPIO_NONE, GPIO_NONE, false, {0, 0, 0}},
+	{ NULL, NULL, I2C_MASTER_NONE, NULL, NULL, NULL, 0, false, NULL, 0, 0, GPIO_NONE, GPIO_NONE, false, {0, 0, 0}},
+	{ NULL, NULL, I2C_MASTER_NONE, NULL, NULL, NULL, 0, false, NULL, 0, 0, GPIO_NONE, GPIO_NONE, false, {0, 0, 0}}
 };
 
+/** Program executed when a NAck aborts a running program */
+static const i2c_master_program_step I2C_master_abort_program[] = {
+	{ I2C_PROGRAM_STOP, NULL, 0 },
+	{ I2C_PROGRAM_END, NULL, 0 }
+};
+
+// Bits of I2CxCON and I2CxSTAT, the program executor accesses them through pointers
+#define I2C_CON_SEN			(1 << 0)
+#define I2C_CON_RSEN		(1 << 1)
+#define I2C_CON_PEN			(1 << 2)
+#define I2C_CON_RCEN		(1 << 3)
+#define I2C_CON_ACKEN		(1 << 4)
+#define I2C_CON_ACKDT		(1 << 5)
+#define I2C_CON_I2CEN		(1 << 15)
+#define I2C_STAT_ACKSTAT	(1 << 15)
+
+/** Half period of the clock generated by the bus recovery sequence, in us (100 kHz) */
+#define I2C_RECOVERY_HALF_PERIOD 5
+
+
+//-------------------
+// Internal functions
+//-------------------
+
+/** Return the address of the I2CxCON register of an I2C */
+static volatile unsigned int* i2c_master_con(int i2c_id)
+{
+#ifdef _MI2C2IF
+	if (i2c_id == I2C_2)
+		return &I2C2CON;
+#endif
+#ifdef _MI2C3IF
+	if (i2c_id == I2C_3)
+		return &I2C3CON;
+#endif
+	return &I2C1CON;
+}
+
+/** Drive an open-drain line low by making it an output, the latch being always 0 */
+static void i2c_master_recovery_pull(gpio gpio_id)
+{
+	gpio_set_dir(gpio_id, GPIO_OUTPUT);
+	clock_delay_us(I2C_RECOVERY_HALF_PERIOD);
+}
+
+/** Release an open-drain line by making it an input */
+static void i2c_master_recovery_release(gpio gpio_id)
+{
+	gpio_set_dir(gpio_id, GPIO_INPUT);
+	clock_delay_us(I2C_RECOVERY_HALF_PERIOD);
+}
+
+/** Clear the master interrupt flag of an I2C */
+static void i2c_master_clear_flag(int i2c_id)
+{
+	if (i2c_id == I2C_1)
+		_MI2C1IF = 0;
+#ifdef _MI2C2IF
+	else if (i2c_id == I2C_2)
+		_MI2C2IF = 0;
+#endif
+#ifdef _MI2C3IF
+	else if (i2c_id == I2C_3)
+		_MI2C3IF = 0;
+#endif
+}
+
+/**
+	Abort the transfert in progress and disable the module, which then stays busy
+	until i2c_master_recover_bus() has run.
+	Must be called with the I2C interrupt masked.
+
+	\return	the callback of the running program, to call with a failed result once the bus is recovered, or NULL
+*/
+static i2c_master_transfert_result_callback i2c_master_abort(int i2c_id)
+{
+	i2c_master_transfert_result_callback callback = NULL;
+
+	if (I2C_Master_Data[i2c_id].program)
+		callback = I2C_Master_Data[i2c_id].program_callback;
+
+	I2C_Master_Data[i2c_id].operation_completed_callback = 0;
+	I2C_Master_Data[i2c_id].program = NULL;
+	I2C_Master_Data[i2c_id].prev_operation = I2C_MASTER_NONE;
+	I2C_Master_Data[i2c_id].recovering = true;
+
+	// no interrupt may come from the aborted transfert once the interrupts are unmasked
+	*i2c_master_con(i2c_id) &= ~I2C_CON_I2CEN;
+	i2c_master_clear_flag(i2c_id);
+
+	return callback;
+}
+
+/** Move the program executor of an I2C to the given step */
+static __attribute__((always_inline)) void i2c_master_program_jump(int i2c_id, const i2c_master_program_step* step)
+{
+	I2C_Master_Data[i2c_id].program = step;
+	I2C_Master_Data[i2c_id].program_data = step->data;
+	I2C_Master_Data[i2c_id].program_count = step->count;
+}
+
+/**
+	Execute a running program, called from the interrupt when the previous bus operation is completed.
+
+	Inlined in each interrupt with constant register addresses, so that the per-byte
+	cost is a few tests and no indirect call.
+*/
+static __attribute__((always_inline)) void i2c_master_program_run(int i2c_id, volatile unsigned int* con, volatile unsigned int* stat, volatile unsigned int* trn, volatile unsigned int* rcv)
+{
+	const i2c_master_program_step* step;
+	i2c_master_transfert_result_callback callback;
+
+	// completion of the previous operation
+	switch (I2C_Master_Data[i2c_id].prev_operation)
+	{
+		case I2C_MASTER_WRITE:
+			if (*stat & I2C_STAT_ACKSTAT)
+			{
+				I2C_Master_Data[i2c_id].statistics.nacks++;
+				I2C_Master_Data[i2c_id].program_result = false;
+				i2c_master_program_jump(i2c_id, I2C_master_abort_program);
+			}
+		break;
+
+		case I2C_MASTER_READ:
+			*(I2C_Master_Data[i2c_id].program_data++) = *rcv;
+			if (--I2C_Master_Data[i2c_id].program_count)
+			{
+				*con &= ~I2C_CON_ACKDT;
+				*con |= I2C_CON_ACKEN;
+				I2C_Master_Data[i2c_id].prev_operation = I2C_MASTER_ACK;
+			}
+			else
+			{
+				*con |= I2C_CON_ACKDT;
+				*con |= I2C_CON_ACKEN;
+				I2C_Master_Data[i2c_id].prev_operation = I2C_MASTER_NACK;
+				i2c_master_program_jump(i2c_id, I2C_Master_Data[i2c_id].program + 1);
+			}
+		return;
+
+		default:
+		break;
+	}
+
+	// execution of the current step
+	step = I2C_Master_Data[i2c_id].program;
+	switch (step->opcode)
+	{
+		case I2C_PROGRAM_WRITE:
+			*trn = *(I2C_Master_Data[i2c_id].program_data++);
+			if (--I2C_Master_Data[i2c_id].program_count == 0)
+				i2c_master_program_jump(i2c_id, step + 1);
+			I2C_Master_Data[i2c_id].prev_operation = I2C_MASTER_WRITE;
+		break;
+
+		case I2C_PROGRAM_READ:
+			*con |= I2C_CON_RCEN;
+			I2C_Master_Data[i2c_id].prev_operation = I2C_MASTER_READ;
+		break;
+
+		case I2C_PROGRAM_RESTART:
+			*con |= I2C_CON_RSEN;
+			i2c_master_program_jump(i2c_id, step + 1);
+			I2C_Master_Data[i2c_id].prev_operation = I2C_MASTER_RESTART;
+		break;
+
+		case I2C_PROGRAM_STOP:
+			*con |= I2C_CON_PEN;
+			i2c_master_program_jump(i2c_id, step + 1);
+			I2C_Master_Data[i2c_id].prev_operation = I2C_MASTER_STOP;
+		break;
+
+		case I2C_PROGRAM_END:
+			// release the bus before calling back, the callback may want to immediatly restart a transfert
+			callback = I2C_Master_Data[i2c_id].program_callback;
+			I2C_Master_Data[i2c_id].program = NULL;
+			if (callback)
+				callback(i2c_id, I2C_Master_Data[i2c_id].program_result);
+		break;
+
+		default:
+			ERROR(I2C_PROTOCOL_INTERNAL_ERROR, (void*)step);
+		break;
+	}
+}
+
 
 //-------------------
 // Exported functions
@@ -138,12 +337,57 @@ void i2c_init_master(int i2c_id, long speed, int priority)
 void i2c_master_start_operations(int i2c_id, i2c_master_operation_completed_callback operation_completed_callback, void* user_data)
 {
 	i2c_check_range(i2c_id);
-	if (I2C_Master_Data[i2c_id].operation_completed_callback != 0)
+	if (i2c_master_is_busy(i2c_id))
 		ERROR(I2C_ERROR_MASTER_BUSY, &(I2C_Master_Data[i2c_id].operation_completed_callback));
 
 	I2C_Master_Data[i2c_id].operation_completed_callback = operation_completed_callback;
 	I2C_Master_Data[i2c_id].user_data = user_data;
 	I2C_Master_Data[i2c_id].prev_operation = I2C_MASTER_NONE;
+	I2C_Master_Data[i2c_id].timeout_left = I2C_Master_Data[i2c_id].timeout;
+
+	if (i2c_id == I2C_1)
+	{
+		I2C1CONbits.SEN = 1;
+	}
+#ifdef _MI2C2IF
+	else if (i2c_id == I2C_2)
+	{
+		I2C2CONbits.SEN = 1;
+	}
+#endif
+#ifdef _MI2C3IF
+	else if (i2c_id == I2C_3)
+	{
+		I2C3CONbits.SEN = 1;
+	}
+#endif
+}
+
+/**
+	Start executing a compiled transfert program.
+
+	The program is executed directly by the interrupt, without calling any
+	user function per byte; this is the fast path used by the high-level protocol.
+	The program and the data it points to must remain valid until result_callback is called.
+
+	\param	i2c_id
+			identifier of the I2C, \ref I2C_1 or \ref I2C_2
+	\param	program
+			array of steps, terminated by \ref I2C_PROGRAM_END
+	\param	result_callback
+			function to call when the program has ended, may be NULL
+*/
+void i2c_master_start_program(int i2c_id, const i2c_master_program_step* program, i2c_master_transfert_result_callback result_callback)
+{
+	i2c_check_range(i2c_id);
+	if (i2c_master_is_busy(i2c_id))
+		ERROR(I2C_ERROR_MASTER_BUSY, &(I2C_Master_Data[i2c_id].program));
+
+	I2C_Master_Data[i2c_id].program_callback = result_callback;
+	I2C_Master_Data[i2c_id].program_result = true;
+	I2C_Master_Data[i2c_id].prev_operation = I2C_MASTER_NONE;
+	I2C_Master_Data[i2c_id].timeout_left = I2C_Master_Data[i2c_id].timeout;
+	i2c_master_program_jump(i2c_id, program);
 
 	if (i2c_id == I2C_1)
 	{
@@ -175,7 +419,7 @@ bool i2c_master_is_busy(int i2c_id)
 {
 	i2c_check_range(i2c_id);
 
-	return I2C_Master_Data[i2c_id].operation_completed_callback != 0;
+	return I2C_Master_Data[i2c_id].operation_completed_callback != 0 || I2C_Master_Data[i2c_id].program != NULL || I2C_Master_Data[i2c_id].recovering;
 }
 
 /**
@@ -192,6 +436,169 @@ void i2c_master_reset(int i2c_id)
 	i2c_check_range(i2c_id);
 
 	I2C_Master_Data[i2c_id].operation_completed_callback = 0;
+	I2C_Master_Data[i2c_id].program = NULL;
+}
+
+/**
+	Configure the timeout of the transferts of an I2C master.
+
+	The timeout is counted in calls to i2c_master_timeout_tick(), which the
+	application must call periodically, typically from a timer callback.
+	When a transfert does not complete in time, it is aborted, the bus is recovered
+	and, for programs and high-level transferts, the result callback is called with false.
+
+	\param	i2c_id
+			identifier of the I2C, \ref I2C_1 or \ref I2C_2
+	\param	timeout
+			amount of ticks a transfert may last, 0 to disable the timeout
+	\param	scl
+			GPIO of the SCL pin, used by the bus recovery sequence, or GPIO_NONE
+	\param	sda
+			GPIO of the SDA pin, used by the bus recovery sequence, or GPIO_NONE
+*/
+void i2c_master_set_timeout(int i2c_id, unsigned int timeout, gpio scl, gpio sda)
+{
+	int flags;
+
+	i2c_check_range(i2c_id);
+
+	IRQ_DISABLE(flags);
+	I2C_Master_Data[i2c_id].timeout = timeout;
+	I2C_Master_Data[i2c_id].timeout_left = timeout;
+	I2C_Master_Data[i2c_id].scl = scl;
+	I2C_Master_Data[i2c_id].sda = sda;
+	IRQ_ENABLE(flags);
+}
+
+/**
+	Count down the timeout of the transferts in progress on all I2C masters.
+
+	Must be called periodically, the period being the unit of the timeout
+	given to i2c_master_set_timeout().
+	Its interrupt priority must not be higher than the one of the I2C interrupts.
+	When a transfert times out, the bus recovery sequence runs from this function with the
+	interrupts unmasked, which delays the caller by up to about 120 us.
+*/
+void i2c_master_timeout_tick(void)
+{
+	i2c_master_transfert_result_callback callback;
+	bool expired;
+	int i2c_id;
+	int flags;
+
+	for (i2c_id = I2C_1; i2c_id <= I2C_3; i2c_id++)
+	{
+		if (I2C_Master_Data[i2c_id].timeout == 0)
+			continue;
+
+		callback = NULL;
+		IRQ_DISABLE(flags);
+		expired = !I2C_Master_Data[i2c_id].recovering && i2c_master_is_busy(i2c_id) && --I2C_Master_Data[i2c_id].timeout_left == 0;
+		if (expired)
+		{
+			I2C_Master_Data[i2c_id].statistics.timeouts++;
+			callback = i2c_master_abort(i2c_id);
+		}
+		IRQ_ENABLE(flags);
+
+		if (expired)
+		{
+			i2c_master_recover_bus(i2c_id);
+			if (callback)
+				callback(i2c_id, false);
+		}
+	}
+}
+
+/**
+	Reset an I2C module and free a stuck bus.
+
+	If the pins were given to i2c_master_set_timeout(), the module is disabled, up to 9 clock
+	pulses are generated on SCL until the slave releases SDA, and a stop condition is generated.
+	This brings back any slave that was interrupted in the middle of a byte.
+	Must not be called while a transfert is in progress.
+
+	\param	i2c_id
+			identifier of the I2C, \ref I2C_1 or \ref I2C_2
+*/
+void i2c_master_recover_bus(int i2c_id)
+{
+	volatile unsigned int* con;
+	gpio scl, sda;
+	int i;
+
+	i2c_check_range(i2c_id);
+
+	con = i2c_master_con(i2c_id);
+	scl = I2C_Master_Data[i2c_id].scl;
+	sda = I2C_Master_Data[i2c_id].sda;
+
+	// disabling the module gives the pins back to the GPIOs and resets the state machine
+	*con &= ~I2C_CON_I2CEN;
+	*con &= ~(I2C_CON_SEN | I2C_CON_RSEN | I2C_CON_PEN | I2C_CON_RCEN | I2C_CON_ACKEN);
+
+	if (scl != GPIO_NONE && sda != GPIO_NONE)
+	{
+		gpio_write(scl, false);
+		gpio_write(sda, false);
+		i2c_master_recovery_release(sda);
+		i2c_master_recovery_release(scl);
+		for (i = 0; i < 9 && !gpio_read(sda); i++)
+		{
+			i2c_master_recovery_pull(scl);
+			i2c_master_recovery_release(scl);
+		}
+		// stop condition: SDA rising while SCL is high
+		i2c_master_recovery_pull(scl);
+		i2c_master_recovery_pull(sda);
+		i2c_master_recovery_release(scl);
+		i2c_master_recovery_release(sda);
+
+		I2C_Master_Data[i2c_id].statistics.recoveries++;
+	}
+
+	*con |= I2C_CON_I2CEN;
+
+	i2c_master_clear_flag(i2c_id);
+	I2C_Master_Data[i2c_id].recovering = false;
+}
+
+/**
+	Get the error counters of an I2C master.
+
+	\param	i2c_id
+			identifier of the I2C, \ref I2C_1 or \ref I2C_2
+	\param	statistics
+			where to copy the counters
+*/
+void i2c_master_get_statistics(int i2c_id, i2c_master_statistics* statistics)
+{
+	int flags;
+
+	i2c_check_range(i2c_id);
+
+	IRQ_DISABLE(flags);
+	*statistics = I2C_Master_Data[i2c_id].statistics;
+	IRQ_ENABLE(flags);
+}
+
+/**
+	Clear the error counters of an I2C master.
+
+	\param	i2c_id
+			identifier of the I2C, \ref I2C_1 or \ref I2C_2
+*/
+void i2c_master_reset_statistics(int i2c_id)
+{
+	int flags;
+
+	i2c_check_range(i2c_id);
+
+	IRQ_DISABLE(flags);
+	I2C_Master_Data[i2c_id].statistics.nacks = 0;
+	I2C_Master_Data[i2c_id].statistics.timeouts = 0;
+	I2C_Master_Data[i2c_id].statistics.recoveries = 0;
+	IRQ_ENABLE(flags);
 }
 
 //--------------------------
@@ -201,7 +608,7 @@ void i2c_master_reset(int i2c_id)
 /**
 	I2C 1 Interrupt Service Routine.
  
-	Call the user-defined function.
+	Execute the running program or call the user-defined function.
 */
 void _ISR _MI2C1Interrupt(void)
 {
@@ -210,8 +617,16 @@ void _ISR _MI2C1Interrupt(void)
 
 	_MI2C1IF = 0;			// clear master interrupt flag
 
+	if (I2C_Master_Data[I2C_1].program)
+	{
+		i2c_master_program_run(I2C_1, &I2C1CON, &I2C1STAT, &I2C1TRN, &I2C1RCV);
+		return;
+	}
+
 	if (I2C_Master_Data[I2C_1].prev_operation == I2C_MASTER_READ)
 		*(I2C_Master_Data[I2C_1].prev_data) = I2C1RCV;
+	else if (I2C_Master_Data[I2C_1].prev_operation == I2C_MASTER_WRITE && I2C1STATbits.ACKSTAT)
+		I2C_Master_Data[I2C_1].statistics.nacks++;
 
 	next_op = I2C_Master_Data[I2C_1].operation_completed_callback(I2C_1, &data, I2C_Master_Data[I2C_1].user_data, I2C1STATbits.ACKSTAT);
 
@@ -263,7 +678,7 @@ void _ISR _MI2C1Interrupt(void)
 /**
 	I2C 2 Interrupt Service Routine.
  
-	Call the user-defined function.
+	Execute the running program or call the user-defined function.
 */
 #ifdef _MI2C2IF
 void _ISR _MI2C2Interrupt(void)
@@ -273,8 +688,16 @@ void _ISR _MI2C2Interrupt(void)
 
 	_MI2C2IF = 0;			// clear master interrupt flag
 
+	if (I2C_Master_Data[I2C_2].program)
+	{
+		i2c_master_program_run(I2C_2, &I2C2CON, &I2C2STAT, &I2C2TRN, &I2C2RCV);
+		return;
+	}
+
 	if (I2C_Master_Data[I2C_2].prev_operation == I2C_MASTER_READ)
 		*(I2C_Master_Data[I2C_2].prev_data) = I2C2RCV;
+	else if (I2C_Master_Data[I2C_2].prev_operation == I2C_MASTER_WRITE && I2C2STATbits.ACKSTAT)
+		I2C_Master_Data[I2C_2].statistics.nacks++;
 
 	next_op = I2C_Master_Data[I2C_2].operation_completed_callback(I2C_2, &data, I2C_Master_Data[I2C_2].user_data, I2C2STATbits.ACKSTAT);
 
@@ -326,7 +749,7 @@ void _ISR _MI2C2Interrupt(void)
 /**
 	I2C 3 Interrupt Service Routine.
  
-	Call the user-defined function.
+	Execute the running program or call the user-defined function.
 */
 #ifdef _MI2C3IF
 void _ISR _MI2C3Interrupt(void)
@@ -336,8 +759,16 @@ void _ISR _MI2C3Interrupt(void)
 
 	_MI2C3IF = 0;			// clear master interrupt flag
 
+	if (I2C_Master_Data[I2C_3].program)
+	{
+		i2c_master_program_run(I2C_3, &I2C3CON, &I2C3STAT, &I2C3TRN, &I2C3RCV);
+		return;
+	}
+
 	if (I2C_Master_Data[I2C_3].prev_operation == I2C_MASTER_READ)
 		*(I2C_Master_Data[I2C_3].prev_data) = I2C3RCV;
+	else if (I2C_Master_Data[I2C_3].prev_operation == I2C_MASTER_WRITE && I2C3STATbits.ACKSTAT)
+		I2C_Master_Data[I2C_3].statistics.nacks++;
 
 	next_op = I2C_Master_Data[I2C_3].operation_completed_callback(I2C_3, &data, I2C_Master_Data[I2C_3].user_data, I2C3STATbits.ACKSTAT);
 
@@ -50,150 +50,138 @@
 
 
 
-// TODO: doc
+/** States of the high level protocol */
 enum I2C_master_transfert_states
 {
-	I2C_IDLE = 0,
-	I2C_START_DONE,
-	I2C_ADDRESS_DONE,
-	I2C_WRITE_IN_PROGRESS,
-	I2C_RESTART_DONE,
-	I2C_READ_IN_PROGRESS,
-	I2C_ACK_DONE,
-	I2C_NACK_DONE,
-	I2C_STOP_DONE,
+	I2C_IDLE = 0,			/**< no transfert in progress */
+	I2C_IN_PROGRESS,		/**< the program of the transfert is being executed */
 };
 
-// TODO: doc
+/** Maximum length of a compiled transfert: address, write, restart, address, read, stop and end */
+#define I2C_PROGRAM_MAX_LENGTH 7
+
+/** High level protocol data of one I2C master */
 typedef struct {
-	int state;
-	bool result;	/** true if last transfert was successful, false otherwise; false during transfert */
-	unsigned char address; /** address to write on the bus */
-	unsigned char * write_data; /** ptr to the data waiting to be written on the bus */
-	unsigned int write_data_size; /** byte still to be written on the bus */
-	unsigned char * read_data; /** ptr where to put data to read */
-	unsigned int read_data_size; /** byte still to be read on the bus */
+	int state; /** one of \ref I2C_master_transfert_states */
+	bool result;	/** true if last transfert was successful, false otherwise */
+	unsigned char address[2]; /** address to write on the bus, for writing and for reading */
+	i2c_master_program_step program[I2C_PROGRAM_MAX_LENGTH]; /** compiled transfert, executed by the interrupt */
 	i2c_master_transfert_result_callback result_callback;
 } I2C_Master_Protocol_Data;
 
 /** data for the master I2C 1 and 2 high level protocol */
 static I2C_Master_Protocol_Data I2C_master_transfert_datas[3];
 
-//-------------------
-// Internal callbacks
-//-------------------
+/** Number of transaction descriptors shared by all I2C master queues */
+#define I2C_MASTER_QUEUE_SIZE 8
+
+/** A pending transfert, queued by i2c_master_transfert_queue() */
+typedef struct I2C_Master_Transaction_t {
+	struct I2C_Master_Transaction_t * next; /** next transaction on the same bus, by decreasing priority */
+	bool used; /** true if this descriptor is allocated, false if it is in the pool */
+	unsigned char address; /** address (7 bits, unshifted) */
+	unsigned char * write_data; /** ptr to the data to write on the bus */
+	unsigned int write_count; /** amount of data to write on the bus */
+	unsigned char * read_data; /** ptr where to put data to read */
+	unsigned int read_count; /** amount of data to read from the bus */
+	i2c_master_transfert_result_callback result_callback;
+	int priority; /** higher priority transactions are started first */
+} I2C_Master_Transaction;
+
+/** statically allocated descriptors for the transaction queues */
+static I2C_Master_Transaction I2C_master_transaction_pool[I2C_MASTER_QUEUE_SIZE];
+
+/** head of the transaction queue of each I2C master, NULL if empty */
+static I2C_Master_Transaction * I2C_master_transaction_queues[3];
+
+/** true once the transfert of i2c_master_transfert_block() has ended, one per I2C master */
+static volatile bool I2C_master_block_done[3];
+
+/** result of the transfert of i2c_master_transfert_block(), one per I2C master */
+static volatile bool I2C_master_block_result[3];
 
-/** callback from low-level I2C layer on I2C interrupt */
-static int i2c_master_transfert_op(int i2c_id, unsigned char** data, void* user_data, bool nack)
+//-----------------
+// Internal helpers
+//-----------------
+
+static void i2c_master_transfert_done(int i2c_id, bool result);
+
+/** Compile the transfert into a program and start it, the bus must be idle */
+static void i2c_master_transfert_start(int i2c_id, unsigned char addr, unsigned char* write_data, unsigned write_count, unsigned char* read_data, unsigned read_count, i2c_master_transfert_result_callback result_callback)
 {
-	i2c_check_range(i2c_id);
-	
-	int ret = I2C_MASTER_NONE;
-	switch (I2C_master_transfert_datas[i2c_id].state)
-	{
-		case I2C_START_DONE:
-			ret = I2C_MASTER_WRITE;
-
-			if(I2C_master_transfert_datas[i2c_id].write_data_size) 
-				I2C_master_transfert_datas[i2c_id].address &= 0xFFFE;
-			else
-				I2C_master_transfert_datas[i2c_id].address |= 0x1;
-
-			*data = &(I2C_master_transfert_datas[i2c_id].address);
-			I2C_master_transfert_datas[i2c_id].state = I2C_ADDRESS_DONE;
-			
-		break;
-
-		case I2C_ADDRESS_DONE:
-			if(nack) {
-				ret = I2C_MASTER_STOP;
-				I2C_master_transfert_datas[i2c_id].result = false;
-				I2C_master_transfert_datas[i2c_id].state = I2C_STOP_DONE;
-				break;
-			}
-			if(I2C_master_transfert_datas[i2c_id].write_data_size) {
-				*data = I2C_master_transfert_datas[i2c_id].write_data++;
-				I2C_master_transfert_datas[i2c_id].write_data_size--;
-				ret = I2C_MASTER_WRITE;
-				I2C_master_transfert_datas[i2c_id].state = I2C_WRITE_IN_PROGRESS;
-			} else if(I2C_master_transfert_datas[i2c_id].read_data_size) {
-				*data = I2C_master_transfert_datas[i2c_id].read_data++;
-				I2C_master_transfert_datas[i2c_id].read_data_size--;
-				ret = I2C_MASTER_READ;
-				I2C_master_transfert_datas[i2c_id].state = I2C_READ_IN_PROGRESS;
-			} else {
-				ret = I2C_MASTER_STOP;
-				I2C_master_transfert_datas[i2c_id].result = true;
-				I2C_master_transfert_datas[i2c_id].state = I2C_STOP_DONE;
-			}
-			break;
+	I2C_Master_Protocol_Data* d = &I2C_master_transfert_datas[i2c_id];
+	i2c_master_program_step* step = d->program;
 
-		case I2C_WRITE_IN_PROGRESS:
-			if(nack) {
-				ret = I2C_MASTER_STOP;
-				I2C_master_transfert_datas[i2c_id].result = false;
-				I2C_master_transfert_datas[i2c_id].state = I2C_STOP_DONE;
-				break;
-			}
-			if(I2C_master_transfert_datas[i2c_id].write_data_size) {
-				*data = I2C_master_transfert_datas[i2c_id].write_data++;
-				I2C_master_transfert_datas[i2c_id].write_data_size--;
-				ret = I2C_MASTER_WRITE;
-				I2C_master_transfert_datas[i2c_id].state = I2C_WRITE_IN_PROGRESS;
-			} else if(I2C_master_transfert_datas[i2c_id].read_data_size) {
-				ret = I2C_MASTER_RESTART;
-				I2C_master_transfert_datas[i2c_id].state = I2C_START_DONE;
-			} else {
-				ret = I2C_MASTER_STOP;
-				I2C_master_transfert_datas[i2c_id].result = true;
-				I2C_master_transfert_datas[i2c_id].state = I2C_STOP_DONE;
-			}
-			break;
-	
-		case I2C_READ_IN_PROGRESS:
-			if(I2C_master_transfert_datas[i2c_id].read_data_size) {
-				ret = I2C_MASTER_ACK;
-				I2C_master_transfert_datas[i2c_id].state = I2C_ACK_DONE;
-			} else {
-				ret = I2C_MASTER_NACK;
-				I2C_master_transfert_datas[i2c_id].state = I2C_NACK_DONE;
-				I2C_master_transfert_datas[i2c_id].result = true;
-			}
-			break;
+	d->result = true;
+	d->result_callback = result_callback;
+	d->state = I2C_IN_PROGRESS;
+	d->address[0] = addr << 1;
+	d->address[1] = (addr << 1) | 0x1;
 
-		case I2C_NACK_DONE:
-			/* Nack is only generated when we stop reading so we can directly generate a stop */
-			ret = I2C_MASTER_STOP;
-			I2C_master_transfert_datas[i2c_id].state = I2C_STOP_DONE;
-			break;
-		case I2C_ACK_DONE:
-			/* We generate an ack only when we want more data, so we can directly reschedule a transfert */
-			*data = I2C_master_transfert_datas[i2c_id].read_data++;
-			I2C_master_transfert_datas[i2c_id].read_data_size--;
-			I2C_master_transfert_datas[i2c_id].state = I2C_READ_IN_PROGRESS;
-			ret = I2C_MASTER_READ;
-			break;
+	if (write_count)
+	{
+		step->opcode = I2C_PROGRAM_WRITE; step->data = &d->address[0]; step->count = 1; step++;
+		step->opcode = I2C_PROGRAM_WRITE; step->data = write_data; step->count = write_count; step++;
+		if (read_count)
+		{
+			step->opcode = I2C_PROGRAM_RESTART; step++;
+		}
+	}
+	if (read_count || !write_count)
+	{
+		// without data to write, the address is always sent for reading
+		step->opcode = I2C_PROGRAM_WRITE; step->data = &d->address[1]; step->count = 1; step++;
+	}
+	if (read_count)
+	{
+		step->opcode = I2C_PROGRAM_READ; step->data = read_data; step->count = read_count; step++;
+	}
+	step->opcode = I2C_PROGRAM_STOP; step++;
+	step->opcode = I2C_PROGRAM_END;
 
-		case I2C_STOP_DONE:
-			ret = I2C_MASTER_QUIT;
-			I2C_master_transfert_datas[i2c_id].state = I2C_IDLE;
-			
-			/* We have to reset the state machine, the callback may want to
-			   immediatly restart an i2c transfert ... 
-			 */
-			i2c_master_reset(i2c_id);
-			
-			if(I2C_master_transfert_datas[i2c_id].result_callback)
-				I2C_master_transfert_datas[i2c_id].result_callback(i2c_id, I2C_master_transfert_datas[i2c_id].result);
-			break;
+	i2c_master_start_program(i2c_id, d->program, i2c_master_transfert_done);
+}
+
+/** If the bus is idle, remove the first transaction from the queue, release it to the pool and start it */
+static void i2c_master_transfert_start_next(int i2c_id)
+{
+	I2C_Master_Transaction * t;
+	int flags;
 
-		case I2C_IDLE:
-		default:
-			ERROR(I2C_PROTOCOL_INTERNAL_ERROR, &I2C_master_transfert_datas[i2c_id].state);
-		break;
+	IRQ_DISABLE(flags);
+	t = I2C_master_transaction_queues[i2c_id];
+	if (t && I2C_master_transfert_datas[i2c_id].state == I2C_IDLE)
+	{
+		I2C_master_transaction_queues[i2c_id] = t->next;
+		// the pointed data are owned by the caller, so the descriptor can be released right away
+		t->used = false;
+		i2c_master_transfert_start(i2c_id, t->address, t->write_data, t->write_count, t->read_data, t->read_count, t->result_callback);
 	}
+	IRQ_ENABLE(flags);
+}
+
+//-------------------
+// Internal callbacks
+//-------------------
+
+/** callback from low-level I2C layer when the program of a transfert has ended */
+static void i2c_master_transfert_done(int i2c_id, bool result)
+{
+	I2C_master_transfert_datas[i2c_id].result = result;
+	I2C_master_transfert_datas[i2c_id].state = I2C_IDLE;
+
+	if(I2C_master_transfert_datas[i2c_id].result_callback)
+		I2C_master_transfert_datas[i2c_id].result_callback(i2c_id, result);
 
-	return ret;
+	/* Keep the bus busy back-to-back, unless the callback already started a transfert */
+	i2c_master_transfert_start_next(i2c_id);
+}
+
+/** callback of the transfert of i2c_master_transfert_block() */
+static void i2c_master_transfert_block_done(int i2c_id, bool result)
+{
+	I2C_master_block_result[i2c_id] = result;
+	I2C_master_block_done[i2c_id] = true;
 }
 
 
@@ -227,21 +215,121 @@ void i2c_master_transfert_async(int i2c_id, unsigned char addr, unsigned char* w
 	if (I2C_master_transfert_datas[i2c_id].state != I2C_IDLE)
 		ERROR(I2C_ERROR_MASTER_BUSY, &(I2C_master_transfert_datas[i2c_id].state));
  
-	I2C_master_transfert_datas[i2c_id].result = true;
-	I2C_master_transfert_datas[i2c_id].result_callback = result_callback;
-	I2C_master_transfert_datas[i2c_id].state = I2C_START_DONE;
-	I2C_master_transfert_datas[i2c_id].address = addr << 1;
-	I2C_master_transfert_datas[i2c_id].write_data = write_data;
-	I2C_master_transfert_datas[i2c_id].write_data_size = write_count;
-	I2C_master_transfert_datas[i2c_id].read_data = read_data;
-	I2C_master_transfert_datas[i2c_id].read_data_size = read_count;
-	i2c_master_start_operations(i2c_id, i2c_master_transfert_op, NULL);
+	i2c_master_transfert_start(i2c_id, addr, write_data, write_count, read_data, read_count, result_callback);
+}
+
+/**
+	Queue an asynchronous I2C master transfert, consisting of a combined write/read cycle.
+
+	If the bus is idle, the transfert starts immediately, otherwise it is started from
+	the interrupt as soon as the transferts before it are completed.
+	Pending transferts are ordered by decreasing priority, and by submission order for equal priorities.
+	The descriptors are taken from a pool shared by all buses, of size I2C_MASTER_QUEUE_SIZE;
+	\ref I2C_ERROR_QUEUE_FULL is thrown if it is exhausted.
+	The data pointed by write_data and read_data must remain valid until result_callback is called.
+
+	\param	i2c_id
+			identifier of the I2C, \ref I2C_1 or \ref I2C_2
+	\param	addr
+			I2C address (7 bits, unshifted)
+	\param	write_data
+			pointer to data to write to device
+	\param	write_count
+			amount of data to write to device
+	\param	read_data
+			pointer where data read from the device will be written
+	\param	read_count
+			amount of data to read from device
+	\param	result_callback
+			user-defined function to call when transfert is completed or aborted because of an errors
+	\param	priority
+			priority of this transfert relative to the other pending ones on the same bus, higher is first
+*/
+void i2c_master_transfert_queue(int i2c_id, unsigned char addr, unsigned char* write_data, unsigned write_count, unsigned char* read_data, unsigned read_count, i2c_master_transfert_result_callback result_callback, int priority)
+{
+	I2C_Master_Transaction * t = NULL;
+	I2C_Master_Transaction ** prev;
+	int flags;
+	int i;
+
+	i2c_check_range(i2c_id);
+
+	IRQ_DISABLE(flags);
+	
+	// fast path, nothing pending
+	if (I2C_master_transfert_datas[i2c_id].state == I2C_IDLE && I2C_master_transaction_queues[i2c_id] == NULL)
+	{
+		i2c_master_transfert_start(i2c_id, addr, write_data, write_count, read_data, read_count, result_callback);
+		IRQ_ENABLE(flags);
+		return;
+	}
+
+	for (i = 0; i < I2C_MASTER_QUEUE_SIZE; i++)
+	{
+		if (!I2C_master_transaction_pool[i].used)
+		{
+			t = &I2C_master_transaction_pool[i];
+			break;
+		}
+	}
+	if (t == NULL)
+	{
+		IRQ_ENABLE(flags);
+		ERROR(I2C_ERROR_QUEUE_FULL, &i2c_id);
+	}
+
+	t->used = true;
+	t->address = addr;
+	t->write_data = write_data;
+	t->write_count = write_count;
+	t->read_data = read_data;
+	t->read_count = read_count;
+	t->result_callback = result_callback;
+	t->priority = priority;
+
+	// insert after every transaction of higher or equal priority
+	prev = &I2C_master_transaction_queues[i2c_id];
+	while (*prev && (*prev)->priority >= priority)
+		prev = &((*prev)->next);
+	t->next = *prev;
+	*prev = t;
+
+	IRQ_ENABLE(flags);
+}
+
+/**
+	Return the number of transferts waiting in the queue of a specific I2C master.
+
+	The transfert currently in progress, if any, is not counted.
+
+	\param	i2c_id
+			identifier of the I2C, \ref I2C_1 or \ref I2C_2
+
+	\return	number of pending transferts
+*/
+unsigned int i2c_master_queue_length(int i2c_id)
+{
+	I2C_Master_Transaction * t;
+	unsigned int count = 0;
+	int flags;
+
+	i2c_check_range(i2c_id);
+
+	IRQ_DISABLE(flags);
+	for (t = I2C_master_transaction_queues[i2c_id]; t; t = t->next)
+		count++;
+	IRQ_ENABLE(flags);
+
+	return count;
 }
 
 /**
 	Start a blocking I2C master transfert, consisting of a combined write/read cycle.
 
 	Both write_count and read_count may be zero, for write/read only cycle.
+	The transfert is queued with priority 0 behind the pending ones, see i2c_master_transfert_queue(),
+	and this function waits for this transfert only, not for the whole queue to drain.
+	Only one blocking transfert per I2C master may be in progress at a time.
 
 	\param	i2c_id
 			identifier of the I2C, \ref I2C_1 or \ref I2C_2
@@ -256,13 +344,16 @@ void i2c_master_transfert_async(int i2c_id, unsigned char addr, unsigned char* w
 	\param	read_count
 			amount of data to read from device
 
-	\return	true if transfert was successful, false otherwise
+	\return	true if transfert was successful, false otherwise, including on timeout (see i2c_master_set_timeout())
 */
 bool i2c_master_transfert_block(int i2c_id, unsigned char addr, unsigned char* write_data, unsigned write_count, unsigned char* read_data, unsigned read_count)
 {
-	i2c_master_transfert_async(i2c_id, addr, write_data, write_count, read_data, read_count, NULL);
-	while (i2c_master_is_busy(i2c_id))	barrier(); // Cannot use Idle since we may miss the interrupt
-	return I2C_master_transfert_datas[i2c_id].result;
+	i2c_check_range(i2c_id);
+
+	I2C_master_block_done[i2c_id] = false;
+	i2c_master_transfert_queue(i2c_id, addr, write_data, write_count, read_data, read_count, i2c_master_transfert_block_done, 0);
+	while (!I2C_master_block_done[i2c_id])	barrier(); // Cannot use Idle since we may miss the interrupt
+	return I2C_master_block_result[i2c_id];
 }
 
 /**
@@ -55,7 +55,10 @@ enum I2C_Slave_State
 	I2C_IDLE,
 	I2C_TO_MASTER,
 	I2C_FROM_MASTER,
-	I2C_END_TO_MASTER
+	I2C_END_TO_MASTER,
+	I2C_MAP_POINTER,
+	I2C_MAP_FROM_MASTER,
+	I2C_MAP_TO_MASTER
 };	
 
 /** I2C slave wrapper data */
@@ -66,6 +69,13 @@ typedef struct
 	i2c_set_data_callback data_from_master_callback; /**< function to call with data from master */
 	i2c_get_data_callback data_to_master_callback; /**< function to call with data to master */
 	int state; /**< transmission direction */
+	unsigned char* map; /**< memory served in register map mode, NULL in callback mode */
+	const unsigned char* map_mask; /**< bits of each register the master can write, NULL if all are writable */
+	unsigned int map_size; /**< amount of registers in map */
+	unsigned int map_pointer; /**< register for the next byte read or written */
+	unsigned int map_first; /**< first register written in the current message */
+	unsigned int map_count; /**< amount of registers written in the current message, not notified yet */
+	i2c_register_map_callback map_callback; /**< function to call once per message written, may be NULL */
 } I2C_Slave_Data;
 
 /** data for the slave I2C 1 wrapper */
@@ -81,6 +91,110 @@ static I2C_Slave_Data I2C_2_Slave_Data;
 static I2C_Slave_Data I2C_3_Slave_Data;
 #endif
 
+// Bits of I2CxCON and I2CxSTAT, the register map server accesses them through pointers
+#define I2C_CON_SCLREL		(1 << 12)
+#define I2C_STAT_ACKSTAT	(1 << 15)
+#define I2C_STAT_D_A		(1 << 5)
+#define I2C_STAT_P			(1 << 4)
+#define I2C_STAT_R_W		(1 << 2)
+
+//-------------------
+// Internal functions
+//-------------------
+
+/** Return the data of a slave I2C */
+static I2C_Slave_Data* i2c_slave_data(int i2c_id)
+{
+#if defined _SI2C2IF
+	if (i2c_id == I2C_2)
+		return &I2C_2_Slave_Data;
+#endif
+#if defined _SI2C3IF
+	if (i2c_id == I2C_3)
+		return &I2C_3_Slave_Data;
+#endif
+	return &I2C_1_Slave_Data;
+}
+
+/** Call the user-defined function if registers were written since the last notification */
+static void i2c_slave_register_map_notify(int i2c_id, I2C_Slave_Data* d)
+{
+	unsigned int count = d->map_count;
+
+	if (count)
+	{
+		d->map_count = 0;
+		if (d->map_callback)
+			d->map_callback(i2c_id, d->map_first, count);
+	}
+}
+
+/**
+	Serve a byte in register map mode, called from the interrupt.
+
+	The first byte of a message from master sets the register pointer, the following ones
+	are written to the map, through the write mask; messages to master read the map from the pointer.
+	The pointer auto-increments, and reading past the map returns 0xFF.
+	Unlike the callback mode, this relies on the D_A bit to detect address bytes, as the
+	length of messages is not known in advance.
+*/
+static __attribute__((always_inline)) void i2c_slave_register_map_run(int i2c_id, I2C_Slave_Data* d, volatile unsigned int* con, volatile unsigned int* stat, volatile unsigned int* trn, volatile unsigned int* rcv)
+{
+	unsigned char data;
+	unsigned char mask;
+
+	if (!(*stat & I2C_STAT_D_A))
+	{
+		// address byte, start of a new message
+		data = *rcv;
+		i2c_slave_register_map_notify(i2c_id, d);
+		if (*stat & I2C_STAT_R_W)
+			d->state = I2C_MAP_TO_MASTER;
+		else
+		{
+			d->state = I2C_MAP_POINTER;
+			*con |= I2C_CON_SCLREL;
+			return;
+		}
+	}
+
+	switch (d->state)
+	{
+		case I2C_MAP_POINTER:
+			d->map_pointer = *rcv;
+			d->map_first = d->map_pointer;
+			d->state = I2C_MAP_FROM_MASTER;
+		break;
+
+		case I2C_MAP_FROM_MASTER:
+			data = *rcv;
+			if (d->map_pointer < d->map_size)
+			{
+				mask = d->map_mask ? d->map_mask[d->map_pointer] : 0xFF;
+				d->map[d->map_pointer] = (d->map[d->map_pointer] & ~mask) | (data & mask);
+				d->map_pointer++;
+				d->map_count++;
+			}
+		break;
+
+		case I2C_MAP_TO_MASTER:
+			// the master NAcks the last byte it wants
+			if (*stat & I2C_STAT_D_A && *stat & I2C_STAT_ACKSTAT)
+				break;
+			if (d->map_pointer < d->map_size)
+				*trn = d->map[d->map_pointer++];
+			else
+				*trn = 0xFF;
+		break;
+
+		default:
+		break;
+	}
+
+	*con |= I2C_CON_SCLREL;								// Release clock
+}
+
+
 //-------------------
 // Exported functions
 //-------------------
@@ -123,6 +237,7 @@ void i2c_init_slave(
 		I2C_1_Slave_Data.message_to_master_callback = message_to_master_callback;
 		I2C_1_Slave_Data.data_from_master_callback = data_from_master_callback;
 		I2C_1_Slave_Data.data_to_master_callback = data_to_master_callback;
+		I2C_1_Slave_Data.map = NULL;
 		
 		I2C_1_Slave_Data.state = I2C_IDLE;
 			
@@ -143,6 +258,7 @@ void i2c_init_slave(
 		I2C_2_Slave_Data.message_to_master_callback = message_to_master_callback;
 		I2C_2_Slave_Data.data_from_master_callback = data_from_master_callback;
 		I2C_2_Slave_Data.data_to_master_callback = data_to_master_callback;
+		I2C_2_Slave_Data.map = NULL;
 		
 		I2C_2_Slave_Data.state = I2C_IDLE;
 
@@ -163,6 +279,7 @@ void i2c_init_slave(
 		I2C_3_Slave_Data.message_to_master_callback = message_to_master_callback;
 		I2C_3_Slave_Data.data_from_master_callback = data_from_master_callback;
 		I2C_3_Slave_Data.data_to_master_callback = data_to_master_callback;
+		I2C_3_Slave_Data.map = NULL;
 		
 		I2C_3_Slave_Data.state = I2C_IDLE;
 
@@ -177,6 +294,104 @@ void i2c_init_slave(
 #endif
 }
 
+/**
+	Init I2C slave subsystem in register map mode.
+
+	In this mode, the interrupt serves a memory window directly, without calling any
+	user function per byte.
+	A message from master starts with one byte, the register pointer, followed by the
+	bytes to write from this register on.
+	A message to master returns the registers from the pointer on.
+	The pointer auto-increments in both directions and is kept between messages,
+	so a write of the pointer alone followed by a read is the usual way of reading registers.
+
+	The dsPIC does not interrupt on a stop condition, so write_callback is called
+	when the next message starts, or from i2c_slave_register_map_poll() if the
+	application calls it.
+
+	\param	i2c_id
+			identifier of the I2C, \ref I2C_1 or \ref I2C_2
+	\param  address
+			Slave address
+	\param	map
+			registers served to the master
+	\param	write_mask
+			for each register, the bits the master can write; NULL if all registers are read-write.
+			Use 0x00 for read-only registers.
+	\param	size
+			amount of registers in map, from 1 to 256
+	\param	write_callback
+			function to call once per message that wrote registers, may be NULL
+	\param 	priority
+			Interrupt priority, from 1 (lowest priority) to 6 (highest normal priority)
+*/
+void i2c_init_slave_register_map(
+	int i2c_id,
+	unsigned char address,
+	unsigned char* map,
+	const unsigned char* write_mask,
+	unsigned int size,
+	i2c_register_map_callback write_callback,
+	int priority
+)
+{
+	I2C_Slave_Data* d;
+	int flags;
+
+	i2c_check_range(i2c_id);
+	if (map == NULL)
+		ERROR(I2C_ERROR_INVALID_REGISTER_MAP, &map);
+	ERROR_CHECK_RANGE(size, 1, 256, I2C_ERROR_INVALID_REGISTER_MAP);
+
+	d = i2c_slave_data(i2c_id);
+
+	// the slave interrupt must not run before the map is set
+	IRQ_DISABLE(flags);
+	i2c_init_slave(i2c_id, address, NULL, NULL, NULL, NULL, priority);
+	d->map_mask = write_mask;
+	d->map_size = size;
+	d->map_pointer = 0;
+	d->map_first = 0;
+	d->map_count = 0;
+	d->map_callback = write_callback;
+	d->map = map;
+	IRQ_ENABLE(flags);
+}
+
+/**
+	Call the write callback of the register map if a message from master has ended.
+
+	Optional, to be called from the main loop to get the write notification
+	as soon as the stop condition was seen, instead of at the next message.
+
+	\param	i2c_id
+			identifier of the I2C, \ref I2C_1 or \ref I2C_2
+*/
+void i2c_slave_register_map_poll(int i2c_id)
+{
+	I2C_Slave_Data* d;
+	volatile unsigned int* stat;
+	int flags;
+
+	i2c_check_range(i2c_id);
+
+	d = i2c_slave_data(i2c_id);
+	stat = &I2C1STAT;
+#if defined _SI2C2IF
+	if (i2c_id == I2C_2)
+		stat = &I2C2STAT;
+#endif
+#if defined _SI2C3IF
+	if (i2c_id == I2C_3)
+		stat = &I2C3STAT;
+#endif
+
+	IRQ_DISABLE(flags);
+	if (d->map && (*stat & I2C_STAT_P))
+		i2c_slave_register_map_notify(i2c_id, d);
+	IRQ_ENABLE(flags);
+}
+
 /**
 	 Disable the i2c slave interrupt 
 	 
@@ -249,6 +464,12 @@ void _ISR _SI2C1Interrupt(void)
 	
 	_SI2C1IF = 0;				// Clear Slave interrupt flag
 
+	if (I2C_1_Slave_Data.map)
+	{
+		i2c_slave_register_map_run(I2C_1, &I2C_1_Slave_Data, &I2C1CON, &I2C1STAT, &I2C1TRN, &I2C1RCV);
+		return;
+	}
+
 	// no interrupt is generated at the end of cycle,
 	// nor all way to detect beginning of cycle are buggy
 	// and do not behave as the doc predicts
@@ -310,6 +531,12 @@ void _ISR _SI2C2Interrupt(void)
 {
 	unsigned char data;
 	_SI2C2IF = 0;				// Clear Slave interrupt flag
+
+	if (I2C_2_Slave_Data.map)
+	{
+		i2c_slave_register_map_run(I2C_2, &I2C_2_Slave_Data, &I2C2CON, &I2C2STAT, &I2C2TRN, &I2C2RCV);
+		return;
+	}
 	
 	// no interrupt is generated at the end of cycle,
 	// nor all way to detect beginning of cycle are buggy
@@ -371,6 +598,12 @@ void _ISR _SI2C3Interrupt(void)
 {
 	unsigned char data;
 	_SI2C3IF = 0;				// Clear Slave interrupt flag
+
+	if (I2C_3_Slave_Data.map)
+	{
+		i2c_slave_register_map_run(I2C_3, &I2C_3_Slave_Data, &I2C3CON, &I2C3STAT, &I2C3TRN, &I2C3RCV);
+		return;
+	}
 	
 	// no interrupt is generated at the end of cycle,
 	// nor all way to detect beginning of cycle are buggy
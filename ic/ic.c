@@ -46,6 +46,8 @@
 
 #include "ic.h"
 #include "../error/error.h"
+#include "../dma/dma.h"
+#include "../timer/timer.h"
 
 //-----------------------
 // Structures definitions
@@ -58,6 +60,32 @@ static struct
 	void* user_data;		/**< pointer to user-specified data to be passed in interrupt, may be 0 */
 } IC_Data[8];
 
+/** Data for the Input Captures with 32 bits timestamps */
+static struct
+{
+	ic_extended_callback callback;	/**< callback to user-defined function */
+	void* user_data;				/**< pointer to user-specified data to be passed to callback, may be 0 */
+	int source;						/**< timer source, one of \ref ic_timer_source */
+} IC_Extended_Data[8];
+
+/** Overflow count and interrupt priority of the timers of the Input Captures with 32 bits timestamps, indexed by \ref ic_timer_source */
+static struct
+{
+	volatile unsigned int overflows;	/**< high word of the extended timestamps */
+	int priority;						/**< priority of the timer interrupt, 0 if not enabled */
+} IC_Timer_Data[2];
+
+/** Data for the streaming of timestamps by DMA, only IC_1 and IC_2 can request DMA transfers */
+static struct
+{
+	int dma;						/**< DMA channel reading ICxBUF, -1 if not streaming */
+	unsigned int* a;				/**< first buffer */
+	unsigned int* b;				/**< second buffer */
+	unsigned int count;				/**< amount of timestamps per buffer */
+	ic_stream_callback callback;	/**< callback to user-defined function */
+	void* user_data;				/**< pointer to user-specified data to be passed to callback, may be 0 */
+} IC_Stream_Data[2] = { { -1 }, { -1 } };
+
 
 #define IC_EXIST(p) (defined _IC## p ##IF)              // macro to check if an input capture channel exists in this particular dsPIC model
 
@@ -203,6 +231,12 @@ void ic_enable(int ic_id, int source, int mode, ic_callback callback, int priori
 */
 void ic_disable(int ic_id)
 {
+	if ((ic_id == IC_1 || ic_id == IC_2) && IC_Stream_Data[ic_id].dma >= 0)
+	{
+		dma_disable_channel(IC_Stream_Data[ic_id].dma);
+		IC_Stream_Data[ic_id].dma = -1;
+	}
+	
 	switch (ic_id)
 	{
 #if IC_EXIST(1)
@@ -233,6 +267,269 @@ void ic_disable(int ic_id)
 	}
 }
 
+/** Timer callback, count the overflows of a time base of extended Input Captures */
+static void ic_timer_overflow_cb(int timer)
+{
+	IC_Timer_Data[timer == TIMER_2 ? IC_TIMER2 : IC_TIMER3].overflows++;
+}
+
+/** Input Capture callback, extend the captured value and call the user-defined function */
+static void ic_extend_cb(int ic_id, unsigned int value, void* user_data)
+{
+	int source = IC_Extended_Data[ic_id].source;
+	unsigned int overflows;
+	unsigned int tmr;
+	bool pending;
+	
+	// Take a coherent view of the timer, its pending overflow and the overflow count
+	do
+	{
+		overflows = IC_Timer_Data[source].overflows;
+		if (source == IC_TIMER2)
+		{
+			pending = _T2IF;
+			tmr = TMR2;
+		}
+		else
+		{
+			pending = _T3IF;
+			tmr = TMR3;
+		}
+		barrier();
+	} while (overflows != IC_Timer_Data[source].overflows || pending != (source == IC_TIMER2 ? _T2IF : _T3IF));
+	
+	// The overflows until now, minus the one since the capture if the timer wrapped meanwhile
+	overflows += pending;
+	if (value > tmr)
+		overflows--;
+	
+	IC_Extended_Data[ic_id].callback(ic_id, ((unsigned long) overflows) << 16 | value, user_data);
+}
+
+/**
+	Enable an Input Capture whose timestamps are extended to 32 bits.
+	
+	The high word of the timestamps is the overflow count of the timer, which is counted
+	by this library through the timer interrupt. The capture and overflow interrupts may
+	come in any order, the timestamps are still coherent. The timer must have a period of
+	0xFFFF, and its interrupt is not available to the application anymore.
+	
+	This function does not change the state of the choosen timer.
+	
+	\param	ic_id
+			Identifier of the Input Capture, from \ref IC_1 to \ref IC_8.
+	\param	source
+			Timer providing clock to the Input Capture. Must be \ref IC_TIMER2 or \ref IC_TIMER3.
+	\param	mode
+			Mode of this Input Capture. Must be one of \ref ic_modes but not \ref IC_DISABLED.
+	\param	callback
+			User-specified function to call when an input is captured.
+	\param 	priority
+			Interrupt priority, from 1 (lowest priority) to 6 (highest normal priority); the timer interrupt gets the highest priority of its Input Captures
+	\param user_data
+			User data passed as callback argument
+*/
+void ic_enable_extended(int ic_id, int source, int mode, ic_extended_callback callback, int priority, void* user_data)
+{
+	int timer;
+	
+	ERROR_CHECK_RANGE(ic_id, IC_1, IC_8, IC_ERROR_INVALID_IC_ID);
+	ERROR_CHECK_RANGE(source, 0, 1, IC_ERROR_INVALID_TIMER_SOURCE);
+	ERROR_CHECK_RANGE(priority, 1, 7, GENERIC_ERROR_INVALID_INTERRUPT_PRIORITY);
+	
+	IC_Extended_Data[ic_id].callback = callback;
+	IC_Extended_Data[ic_id].user_data = user_data;
+	IC_Extended_Data[ic_id].source = source;
+	
+	// The overflow count must not be preempted by the captures
+	timer = source == IC_TIMER2 ? TIMER_2 : TIMER_3;
+	if (!IC_Timer_Data[source].priority)
+	{
+		IC_Timer_Data[source].priority = priority;
+		timer_enable_interrupt(timer, ic_timer_overflow_cb, priority);
+	}
+	else if (IC_Timer_Data[source].priority < priority)
+	{
+		IC_Timer_Data[source].priority = priority;
+		if (timer == TIMER_2)
+			_T2IP = priority;
+		else
+			_T3IP = priority;
+	}
+	
+	ic_enable(ic_id, source, mode, ic_extend_cb, priority, user_data);
+}
+
+/** DMA callback, a buffer of timestamps is full */
+static void ic_stream_dma_cb(int channel, bool first_buffer)
+{
+	int ic_id = IC_Stream_Data[IC_1].dma == channel ? IC_1 : IC_2;
+	
+	IC_Stream_Data[ic_id].callback(ic_id, first_buffer ? IC_Stream_Data[ic_id].a : IC_Stream_Data[ic_id].b, IC_Stream_Data[ic_id].count, IC_Stream_Data[ic_id].user_data);
+}
+
+/**
+	Enable an Input Capture streaming its timestamps to memory.
+	
+	Instead of an interrupt per capture, a DMA channel fills two buffers alternately with the
+	captured timer values, and the callback is called with each full buffer while the other one
+	is being filled. The callback must be done with a buffer before the other one is full.
+	
+	This function does not change the state of the choosen timer.
+	
+	\param	ic_id
+			Identifier of the Input Capture, \ref IC_1 or \ref IC_2 which can request DMA transfers.
+	\param	source
+			Timer providing clock to the Input Capture. Must be \ref IC_TIMER2 or \ref IC_TIMER3.
+	\param	mode
+			Mode of this Input Capture. Must be one of \ref ic_modes but not \ref IC_DISABLED.
+	\param	dma_channel
+			DMA channel reading the timestamps, from \ref DMA_CHANNEL_0 to \ref DMA_CHANNEL_7.
+	\param	buffer_a
+			First buffer of timestamps, must be in DMA memory.
+	\param	buffer_b
+			Second buffer of timestamps, must be in DMA memory.
+	\param	count
+			Amount of timestamps in each buffer.
+	\param	callback
+			User-specified function to call when a buffer is full.
+	\param 	priority
+			Priority of the DMA interrupt, from 1 (lowest priority) to 7 (highest priority)
+	\param user_data
+			User data passed as callback argument
+*/
+void ic_enable_stream(int ic_id, int source, int mode, int dma_channel, unsigned int* buffer_a, unsigned int* buffer_b, unsigned int count, ic_stream_callback callback, int priority, void* user_data)
+{
+	ERROR_CHECK_RANGE(ic_id, IC_1, IC_2, IC_ERROR_NO_DMA_REQUEST);
+	ERROR_CHECK_RANGE(source, 0, 1, IC_ERROR_INVALID_TIMER_SOURCE);
+	ERROR_CHECK_RANGE(mode, IC_DISABLED + 1, 5, IC_ERROR_INVALID_MODE);
+	
+	ic_disable(ic_id);
+	
+	IC_Stream_Data[ic_id].a = buffer_a;
+	IC_Stream_Data[ic_id].b = buffer_b;
+	IC_Stream_Data[ic_id].count = count;
+	IC_Stream_Data[ic_id].callback = callback;
+	IC_Stream_Data[ic_id].user_data = user_data;
+	IC_Stream_Data[ic_id].dma = dma_channel;
+	
+	if (ic_id == IC_1)
+	{
+#if IC_EXIST(1)
+		dma_init_channel(dma_channel, DMA_INTERRUPT_SOURCE_IC_1, DMA_SIZE_WORD, DMA_DIR_FROM_PERIPHERAL_TO_RAM, DMA_INTERRUPT_AT_FULL, 
+							DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL, DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT,
+							DMA_OPERATING_CONTINUOUS_PING_PONG, buffer_a, buffer_b, (void *) &IC1BUF, count, ic_stream_dma_cb);
+		dma_set_priority(dma_channel, priority);
+		dma_enable_channel(dma_channel);
+		
+		// The captures request DMA transfers, not interrupts
+		_IC1IE = 0;
+		IC1CONbits.ICTMR = source;
+		IC1CONbits.ICI = 0;
+		_IC1IF = 0;
+		IC1CONbits.ICM = mode;
+#endif
+	}
+	else
+	{
+#if IC_EXIST(2)
+		dma_init_channel(dma_channel, DMA_INTERRUPT_SOURCE_IC_2, DMA_SIZE_WORD, DMA_DIR_FROM_PERIPHERAL_TO_RAM, DMA_INTERRUPT_AT_FULL, 
+							DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL, DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT,
+							DMA_OPERATING_CONTINUOUS_PING_PONG, buffer_a, buffer_b, (void *) &IC2BUF, count, ic_stream_dma_cb);
+		dma_set_priority(dma_channel, priority);
+		dma_enable_channel(dma_channel);
+		
+		// The captures request DMA transfers, not interrupts
+		_IC2IE = 0;
+		IC2CONbits.ICTMR = source;
+		IC2CONbits.ICI = 0;
+		_IC2IF = 0;
+		IC2CONbits.ICM = mode;
+#endif
+	}
+}
+
+/**
+	Compute the period and duty cycle statistics of a block of timestamps, in a single pass.
+	
+	The periods are the differences between timestamps of the same edge; the timer must have
+	a period of 0xFFFF and the signal a period shorter than that.
+	
+	\param	stamps
+			Timestamps, for instance a buffer given to an \ref ic_stream_callback.
+	\param	count
+			Amount of timestamps.
+	\param	edges
+			Captures per period of the signal: 1 when capturing a single kind of edge, 2 when
+			capturing both edges with \ref IC_EDGE_CAPTURE ; then the first timestamp must be a
+			rising edge, and count should be even so that all the blocks start with a rising edge.
+	\param	stats
+			Where to store the statistics.
+*/
+void ic_stream_statistics(const unsigned int* stamps, unsigned int count, int edges, ic_stream_stats* stats)
+{
+	unsigned int min = 0xFFFF;
+	unsigned int max = 0;
+	unsigned long sum = 0;
+	unsigned long high = 0;
+	unsigned int periods = 0;
+	unsigned int period;
+	unsigned int i;
+	
+	ERROR_CHECK_RANGE(edges, 1, 2, IC_ERROR_INVALID_EDGES);
+	
+	for (i = edges; i < count; i += edges)
+	{
+		period = stamps[i] - stamps[i - edges];
+		if (period < min)
+			min = period;
+		if (period > max)
+			max = period;
+		sum += period;
+		if (edges == 2)
+			high += stamps[i - 1] - stamps[i - 2];
+		periods++;
+	}
+	
+	stats->min = periods ? min : 0;
+	stats->max = max;
+	stats->sum = sum;
+	stats->high = high;
+	stats->periods = periods;
+}
+
+/**
+	Return the mean frequency of the signal over a block, in Hz, or 0 if there is no period.
+	
+	\param	stats
+			Statistics computed by ic_stream_statistics().
+	\param	timer_frequency
+			Frequency of the timer providing clock to the Input Capture, in Hz.
+*/
+unsigned long ic_stream_frequency(const ic_stream_stats* stats, unsigned long timer_frequency)
+{
+	if (!stats->sum)
+		return 0;
+	
+	return ((unsigned long long) timer_frequency * stats->periods + stats->sum / 2) / stats->sum;
+}
+
+/**
+	Return the mean duty cycle of the signal over a block, from 0 to 0xFFFF for always high.
+	
+	\param	stats
+			Statistics computed by ic_stream_statistics() with both edges.
+*/
+unsigned int ic_stream_duty(const ic_stream_stats* stats)
+{
+	if (!stats->sum)
+		return 0;
+	if (stats->high >= stats->sum)
+		return 0xFFFF;
+	
+	return ((unsigned long long) stats->high << 16) / stats->sum;
+}
+
 //--------------------------
 // Interrupt service routine
 //--------------------------
@@ -41,6 +41,8 @@ enum ic_errors
 	IC_ERROR_INVALID_IC_ID,				/**< The desired Input Capture does not exists, must be one of \ref ic_identifiers. */
 	IC_ERROR_INVALID_TIMER_SOURCE,		/**< The specified timer source is invalid, must be one of \ref ic_timer_source. */
 	IC_ERROR_INVALID_MODE,				/**< The specified mode is invalid, must be one of \ref ic_modes excepted \ref IC_DISABLED. */
+	IC_ERROR_NO_DMA_REQUEST,			/**< The specified Input Capture cannot request DMA transfers, must be \ref IC_1 or \ref IC_2. */
+	IC_ERROR_INVALID_EDGES,				/**< The amount of captures per period is invalid, must be 1 or 2. */
 };
 
 /** Identifiers of available Input Capture. */
@@ -78,12 +80,38 @@ enum ic_modes
 /** Input Capture callback on interrupt, with the value of the timer at that moment */
 typedef void (*ic_callback)(int ic_id, unsigned int value, void* user_data);
 
+/** Input Capture callback on interrupt, with the value of the timer extended to 32 bits by its overflow count */
+typedef void (*ic_extended_callback)(int ic_id, unsigned long value, void* user_data);
+
+/** Input Capture callback when a block of timestamps has been filled by DMA */
+typedef void (*ic_stream_callback)(int ic_id, const unsigned int* stamps, unsigned int count, void* user_data);
+
+/** Statistics over a block of timestamps, computed by ic_stream_statistics() */
+typedef struct
+{
+	unsigned int min;		/**< shortest period, in timer ticks */
+	unsigned int max;		/**< longest period, in timer ticks */
+	unsigned long sum;		/**< sum of the periods, in timer ticks */
+	unsigned long high;		/**< sum of the high times, in timer ticks, when capturing both edges */
+	unsigned int periods;	/**< amount of periods */
+} ic_stream_stats;
+
 // Functions, doc in the .c
 
 void ic_enable(int ic_id, int source, int mode, ic_callback callback, int priority, void* user_data);
 
 void ic_disable(int ic_id);
 
+void ic_enable_extended(int ic_id, int source, int mode, ic_extended_callback callback, int priority, void* user_data);
+
+void ic_enable_stream(int ic_id, int source, int mode, int dma_channel, unsigned int* buffer_a, unsigned int* buffer_b, unsigned int count, ic_stream_callback callback, int priority, void* user_data);
+
+void ic_stream_statistics(const unsigned int* stamps, unsigned int count, int edges, ic_stream_stats* stats);
+
+unsigned long ic_stream_frequency(const ic_stream_stats* stats, unsigned long timer_frequency);
+
+unsigned int ic_stream_duty(const ic_stream_stats* stats);
+
 /*@}*/
 
 #endif
@@ -24,6 +24,7 @@
 
 #include "../error/error.h"
 #include "../i2c/i2c.h"
+#include "../i2c-poll/i2c-poll.h"
 
 
 #include "lm73.h"
@@ -80,4 +81,15 @@ void lm73_temp_read_a(int i2c_bus, int addr, lm73_temp_cb cb) {
 	i2c_master_transfert_async(i2c_bus, addr, swdata, 1, srdata, 2, cb_i2c);
 }
 
+void lm73_poll_init(i2c_poll_sensor* sensor, int i2c_bus, int addr, unsigned int period) {
+	i2c_poll_init_sensor(sensor, i2c_bus, addr, 0x0, 2, period);
+}
 
+// Return false, leaving temperature untouched, if the sensor was never read successfully
+bool lm73_poll_temp(const i2c_poll_sensor* sensor, int* temperature) {
+	unsigned char rdata[2];
+	if (i2c_poll_read(sensor, rdata) == 0)
+		return false;
+	*temperature = (((int) rdata[0]) << 8) | (rdata[1]);
+	return true;
+}
@@ -49,6 +49,7 @@
 #include "oc.h"
 #include "../error/error.h"
 #include "../timer/timer.h"
+#include "../dma/dma.h"
 
 
 // TODO if necessary: interrupt
@@ -57,6 +58,18 @@
 
 static oc_irq_cb irq_cb[8];
 
+/** Data for the step generators, only OC_1 and OC_2 can request DMA transfers */
+static struct
+{
+	int timer;					/**< timer whose period is the interval between steps */
+	int dma;					/**< DMA channel writing the periods, -1 if not initialized */
+	volatile unsigned int * pr;	/**< period register of the timer */
+	gpio dir;					/**< direction output */
+	unsigned int width;			/**< high time of a step pulse, and setup time of the direction before it */
+	oc_step_done callback;		/**< called when the sequence is over */
+	bool busy;					/**< true while a sequence is in progress */
+} Step_Data[2] = { { 0, -1 }, { 0, -1 } };
+
 
 /**
 	Enable an Output Compare.
@@ -424,6 +437,189 @@ void oc_reenable_interrupt(int oc_id) {
 	}
 }
 
+/** Stop a step generator */
+static void oc_step_halt(int oc_id)
+{
+	oc_disable(oc_id);
+	timer_set_enabled(Step_Data[oc_id].timer, false);
+	dma_disable_channel(Step_Data[oc_id].dma);
+	Step_Data[oc_id].busy = false;
+}
+
+/** DMA callback, the period of the last step has been written so the sequence is over */
+static void oc_step_dma_cb(int channel, bool __attribute__((unused)) first_buffer)
+{
+	int oc_id = Step_Data[OC_1].dma == channel ? OC_1 : OC_2;
+	
+	oc_step_halt(oc_id);
+	if (Step_Data[oc_id].callback)
+		Step_Data[oc_id].callback(oc_id);
+}
+
+/**
+	Initialize a step/direction pulse generator.
+	
+	The Output Compare runs in continuous pulse mode and generates one step pulse per timer period.
+	At each falling edge, its DMA request writes the period of the current step into the period
+	register of the timer, so a sequence of steps runs without any interrupt until its end.
+	
+	The timer must have been initialized with timer_init() to select its prescaler; its period and
+	its interrupt are then owned by the step generator.
+	
+	\param	oc_id
+			Identifier of the Output Compare, \ref OC_1 or \ref OC_2 which can request DMA transfers.
+	\param	timer
+			Timer providing clock to the Output Compare. Must be \ref TIMER_2 or \ref TIMER_3.
+	\param	dma_channel
+			DMA channel writing the periods, from \ref DMA_CHANNEL_0 to \ref DMA_CHANNEL_7.
+	\param	dir
+			GPIO of the direction signal, or GPIO_NONE.
+	\param	width
+			High time of the step pulses, in timer ticks; the direction is also set this time before the first pulse.
+	\param 	priority
+			Priority of the DMA interrupt at the end of a sequence, from 1 (lowest priority) to 7 (highest priority).
+*/
+void oc_step_init(int oc_id, int timer, int dma_channel, gpio dir, unsigned int width, int priority)
+{
+	volatile unsigned int * pr;
+	int source;
+	
+	ERROR_CHECK_RANGE(oc_id, OC_1, OC_2, OC_ERROR_NO_DMA_REQUEST);
+	
+	if (timer == TIMER_2)
+		pr = &PR2;
+	else if (timer == TIMER_3)
+		pr = &PR3;
+	else 
+		ERROR(OC_ERROR_INVALID_TIMER_SOURCE, &timer);
+	
+	if (oc_id == OC_1)
+		source = DMA_INTERRUPT_SOURCE_OC_1;
+	else
+		source = DMA_INTERRUPT_SOURCE_OC_2;
+	
+	oc_step_stop(oc_id);
+	
+	Step_Data[oc_id].timer = timer;
+	Step_Data[oc_id].dma = dma_channel;
+	Step_Data[oc_id].pr = pr;
+	Step_Data[oc_id].dir = dir;
+	Step_Data[oc_id].width = width;
+	
+	gpio_set_dir(dir, GPIO_OUTPUT);
+	
+	dma_init_channel(dma_channel, source, DMA_SIZE_WORD, DMA_DIR_FROM_RAM_TO_PERIPHERAL, DMA_INTERRUPT_AT_FULL, 
+						DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL, DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT,
+						DMA_OPERATING_ONE_SHOT, NULL, NULL, (void *) pr, 1, oc_step_dma_cb);
+	dma_set_priority(dma_channel, priority);
+}
+
+/**
+	Start a sequence of steps.
+	
+	\param	oc_id
+			Identifier of the Output Compare, given to oc_step_init() before.
+	\param	periods
+			Period of each step, in timer ticks minus one as written to the period register. Must be in DMA memory
+			and stay valid until the end of the sequence. Each period must be greater than twice the pulse width.
+	\param	count
+			Amount of steps, from 1 to 1024.
+	\param	reverse
+			Level of the direction output.
+	\param	callback
+			User-specified function to call when the last step has been generated, may be NULL.
+*/
+void oc_step_start(int oc_id, unsigned int * periods, unsigned int count, bool reverse, oc_step_done callback)
+{
+	ERROR_CHECK_RANGE(oc_id, OC_1, OC_2, OC_ERROR_NO_DMA_REQUEST);
+	ERROR_CHECK_RANGE(count, 1, 1024, OC_ERROR_INVALID_STEP_COUNT);
+	if (Step_Data[oc_id].busy)
+		ERROR(OC_ERROR_STEP_BUSY, &oc_id);
+	
+	Step_Data[oc_id].busy = true;
+	Step_Data[oc_id].callback = callback;
+	gpio_write(Step_Data[oc_id].dir, reverse);
+	
+	// The DMA rewrites the first period at the end of the first pulse, then each one during its own step
+	dma_set_buffer(Step_Data[oc_id].dma, periods, count);
+	dma_enable_channel(Step_Data[oc_id].dma);
+	
+	oc_enable(oc_id, Step_Data[oc_id].timer, OC_CONTINUOUS_PULSE);
+	oc_set_value(oc_id, Step_Data[oc_id].width, Step_Data[oc_id].width * 2);
+	*Step_Data[oc_id].pr = periods[0];
+	timer_set_value(Step_Data[oc_id].timer, 0);
+	timer_set_enabled(Step_Data[oc_id].timer, true);
+}
+
+/**
+	Abort the sequence of steps in progress, if any; the callback is not called.
+	
+	\param	oc_id
+			Identifier of the Output Compare, given to oc_step_init() before.
+*/
+void oc_step_stop(int oc_id)
+{
+	ERROR_CHECK_RANGE(oc_id, OC_1, OC_2, OC_ERROR_NO_DMA_REQUEST);
+	
+	if (Step_Data[oc_id].busy)
+		oc_step_halt(oc_id);
+}
+
+/**
+	Return whether a sequence of steps is in progress.
+	
+	\param	oc_id
+			Identifier of the Output Compare, given to oc_step_init() before.
+*/
+bool oc_step_is_busy(int oc_id)
+{
+	ERROR_CHECK_RANGE(oc_id, OC_1, OC_2, OC_ERROR_NO_DMA_REQUEST);
+	
+	return Step_Data[oc_id].busy;
+}
+
+/**
+	Compute the periods of a trapezoidal speed profile for oc_step_start().
+	
+	The steps accelerate from the first period down to the minimal one, with the
+	c(n) = c(n-1) - 2 c(n-1) / (4 n + 1) approximation of a constant acceleration, cruise,
+	and decelerate symmetrically. For a short move, the profile becomes triangular.
+	For an acceleration a in steps/s^2 and a timer frequency f, the first period is
+	about 0.676 f sqrt(2 / a).
+	
+	\param	periods
+			Where to store the periods, in timer ticks minus one as written to the period register.
+	\param	count
+			Amount of steps.
+	\param	first
+			Period of the first step, in timer ticks.
+	\param	min
+			Period at cruise speed, in timer ticks.
+*/
+void oc_step_ramp(unsigned int * periods, unsigned int count, unsigned int first, unsigned int min)
+{
+	unsigned long c = ((unsigned long) first) << 8;	// 8 bits of fraction
+	unsigned int ramp;
+	unsigned int i;
+	
+	// Acceleration, up to half of the move
+	for (ramp = 0; ramp < count / 2 && (c >> 8) > min; ramp++)
+	{
+		periods[ramp] = (c >> 8) - 1;
+		c -= 2 * c / (4 * (ramp + 1) + 1);
+	}
+	
+	// Cruise, or the middle step of a triangular profile
+	if ((c >> 8) < min)
+		c = ((unsigned long) min) << 8;
+	for (i = ramp; i < count - ramp; i++)
+		periods[i] = (c >> 8) - 1;
+	
+	// Deceleration
+	for (i = 0; i < ramp; i++)
+		periods[count - 1 - i] = periods[i];
+}
+
 #if OC_EXIST(1)
 void _ISR _OC1Interrupt(void) {
 	_OC1IF = 0;
@@ -25,6 +25,9 @@
 #ifndef _MOLOLE_OC_H
 #define _MOLOLE_OC_H
 
+#include "../types/types.h"
+#include "../gpio/gpio.h"
+
 /** \addtogroup oc */
 /*@{*/
 
@@ -43,6 +46,9 @@ enum oc_errors
 	OC_ERROR_INVALID_OC_ID,				/**< The desired Output Compare does not exists, must be one of \ref oc_identifiers. */
 	OC_ERROR_INVALID_TIMER_SOURCE,		/**< The specified timer source is invalid, must be \ref TIMER_2 or \ref TIMER_3. */
 	OC_ERROR_INVALID_MODE,				/**< The specified mode is invalid, must be one of \ref oc_modes excepted \ref OC_DISABLED. */
+	OC_ERROR_NO_DMA_REQUEST,			/**< The specified Output Compare cannot request DMA transfers, must be \ref OC_1 or \ref OC_2. */
+	OC_ERROR_INVALID_STEP_COUNT,		/**< The specified amount of steps is invalid, must be between 1 and 1024. */
+	OC_ERROR_STEP_BUSY,					/**< A step sequence is already in progress on this Output Compare. */
 };
 
 /** Identifiers of available Output Compares. */
@@ -75,6 +81,9 @@ enum oc_modes
 
 typedef void (*oc_irq_cb)(int oc_id);
 
+/** Callback when the last step of a sequence started by oc_step_start() has been generated */
+typedef void (*oc_step_done)(int oc_id);
+
 
 // Functions, doc in the .c
 
@@ -90,6 +99,16 @@ void oc_enable_interrupt(int oc_id, oc_irq_cb cb, int priority);
 
 void oc_disable_interrupt(int oc_id);
 
+void oc_step_init(int oc_id, int timer, int dma_channel, gpio dir, unsigned int width, int priority);
+
+void oc_step_start(int oc_id, unsigned int * periods, unsigned int count, bool reverse, oc_step_done callback);
+
+void oc_step_stop(int oc_id);
+
+bool oc_step_is_busy(int oc_id);
+
+void oc_step_ramp(unsigned int * periods, unsigned int count, unsigned int first, unsigned int min);
+
 /*@}*/
 
 #endif
@@ -55,8 +55,54 @@ static struct
 	int inverted[4];				 /**< state of the PMOD bbit in PWMxCON1 */
 	unsigned char reverse[4];			 /**< reverse the sens */
 	unsigned int period;
+	unsigned int ovdcon[4][3];		 /**< OVDCON bits of each PWM for a null, positive and negative duty, from mode and reverse */
+	unsigned int pwmcon1[4];		 /**< PWMCON1 bits of each PWM, outputs enabled and PMOD */
+	bool complement[4];				 /**< true if the duty register holds the period minus the duty */
 } PWM_Data;
 
+/** PWMCON1 bits of the first PWM: PEN1L, PEN1H and PMOD1 */
+#define PWM_PWMCON1_MASK 0x0111
+/** OVDCON bits of the first PWM: POUT1L, POUT1H, POVD1L and POVD1H */
+#define PWM_OVDCON_MASK 0x0303
+
+/** OVDCON bits of the first PWM for a null, positive and negative duty, by brake mode */
+static const unsigned int pwm_ovdcon_patterns[4][3] =
+{
+	{ 0x0000, 0x0200, 0x0100 },		// PWM_ONE_DEFAULT_LOW: the other output is overridden low
+	{ 0x0003, 0x0201, 0x0102 },		// PWM_ONE_DEFAULT_HIGH: the other output is overridden high
+	{ 0x0000, 0x0300, 0x0300 },		// PWM_BOTH_DEFAULT_LOW
+	{ 0x0003, 0x0300, 0x0300 },		// PWM_BOTH_DEFAULT_HIGH
+};
+
+/** Compute the precomputed register bits of a PWM after a change of its mode or direction */
+static void pwm_update_table(int pwm_id)
+{
+	int mode = PWM_Data.mode[pwm_id];
+	int shift = pwm_id << 1;
+	
+	PWM_Data.ovdcon[pwm_id][0] = pwm_ovdcon_patterns[mode][0] << shift;
+	PWM_Data.ovdcon[pwm_id][1] = pwm_ovdcon_patterns[mode][PWM_Data.reverse[pwm_id] ? 2 : 1] << shift;
+	PWM_Data.ovdcon[pwm_id][2] = pwm_ovdcon_patterns[mode][PWM_Data.reverse[pwm_id] ? 1 : 2] << shift;
+	PWM_Data.pwmcon1[pwm_id] = (0x0011 | (PWM_Data.inverted[pwm_id] ? 0x0100 : 0)) << pwm_id;
+	PWM_Data.complement[pwm_id] = mode == PWM_ONE_DEFAULT_HIGH || mode == PWM_BOTH_DEFAULT_HIGH;
+}
+
+/** Return the OVDCON bits of a PWM for a duty, and store in pdc the value of its duty register */
+static __attribute__((always_inline)) unsigned int pwm_compute_duty(int pwm_id, int duty, unsigned int* pdc)
+{
+	int sign = duty > 0 ? 1 : (duty < 0 ? 2 : 0);
+	unsigned int value = duty < 0 ? -duty : duty;
+	
+	if(PWM_Data.complement[pwm_id] && sign) {
+		if(value > PWM_Data.period)
+			value = PWM_Data.period;
+		value = PWM_Data.period - value;
+	}
+	*pdc = value;
+	
+	return PWM_Data.ovdcon[pwm_id][sign];
+}
+
 /**
 	Init the PWM subsystem.
 	
@@ -82,8 +128,10 @@ void pwm_init(int prescaler, unsigned period, int mode)
 	DTCON1 = 0;							// Disable any dead time generator
 	DTCON2 = 0;
 	
-	for(i = 0; i < 4; i++) 
+	for(i = 0; i < 4; i++) {
 		PWM_Data.inverted[i] = 1; // Independant mode by default 
+		pwm_update_table(i);
+	}
 	
 	switch(mode) {
 		case PWM_MODE_FREE_RUNNING:
@@ -162,353 +210,54 @@ void pwm_disable(int pwm_id)
 
 void pwm_set_duty(int pwm_id, int duty)
 {
+	unsigned int ovdcon;
+	unsigned int pdc;
+	
+	ERROR_CHECK_RANGE(pwm_id, PWM_1, PWM_4, PWM_ERROR_INVALID_PWM_ID);
+	
+	ovdcon = pwm_compute_duty(pwm_id, duty, &pdc);
 
 	PWMCON2bits.UDIS = 1;
-	switch (pwm_id)
-	{
-		case PWM_1:
-			if(PWM_Data.reverse[pwm_id])
-				duty = -duty;
-				
-			PWMCON1bits.PEN1L = 1; 
-			PWMCON1bits.PEN1H = 1; 
-			PWMCON1bits.PMOD1 = PWM_Data.inverted[pwm_id]; 
-
-			if(duty == 0) {
-				OVDCONbits.POVD1L = 0;
-				OVDCONbits.POVD1H = 0;
-				switch(PWM_Data.mode[pwm_id]) {
-				case PWM_ONE_DEFAULT_LOW:
-				case PWM_BOTH_DEFAULT_LOW:
-					OVDCONbits.POUT1L = 0;
-					OVDCONbits.POUT1H = 0;
-					break;
-				case PWM_ONE_DEFAULT_HIGH:
-				case PWM_BOTH_DEFAULT_HIGH:
-					OVDCONbits.POUT1L = 1;
-					OVDCONbits.POUT1H = 1;
-					break;
-				}
-			} else if(duty > 0) {
-				/* PWM1L is forced low */
-				switch(PWM_Data.mode[pwm_id]) {
-				case PWM_ONE_DEFAULT_LOW:
-					OVDCONbits.POUT1L = 0;
-					OVDCONbits.POVD1L = 0;
-					OVDCONbits.POVD1H = 1;
-					break;
-				case PWM_BOTH_DEFAULT_LOW:
-					OVDCONbits.POVD1H = 1;
-					OVDCONbits.POVD1L = 1;
-					break;
-				case PWM_ONE_DEFAULT_HIGH:
-					OVDCONbits.POUT1L = 1;
-					OVDCONbits.POVD1L = 0;
-					OVDCONbits.POVD1H = 1;
-					if(duty > PWM_Data.period) 
-						duty = PWM_Data.period;
-					duty = PWM_Data.period - duty;
-					break;
-				case PWM_BOTH_DEFAULT_HIGH:
-					OVDCONbits.POVD1L = 1;
-					OVDCONbits.POVD1H = 1;
-					if(duty > PWM_Data.period) 
-						duty = PWM_Data.period;
-					duty = PWM_Data.period - duty;
-					break;
-				}
-		
-				PDC1 = duty; 
-			} else {
-				switch(PWM_Data.mode[pwm_id]) {
-				case PWM_ONE_DEFAULT_LOW:
-					OVDCONbits.POUT1H = 0;
-					OVDCONbits.POVD1H = 0;
-					OVDCONbits.POVD1L = 1;
-					break;
-				case PWM_BOTH_DEFAULT_LOW:
-					OVDCONbits.POVD1H = 1;
-					OVDCONbits.POVD1L = 1;
-					break;
-				case PWM_ONE_DEFAULT_HIGH:
-					OVDCONbits.POUT1H = 1;
-					OVDCONbits.POVD1H = 0;
-					OVDCONbits.POVD1L = 1;
-					if(duty < -PWM_Data.period) 
-						duty = -PWM_Data.period;
-					duty = -PWM_Data.period - duty;
-					break;
-				case PWM_BOTH_DEFAULT_HIGH:
-					OVDCONbits.POVD1L = 1;
-					OVDCONbits.POVD1H = 1;
-					if(duty < -PWM_Data.period) 
-						duty = -PWM_Data.period;
-					duty = -PWM_Data.period - duty;
-					break;
-				}
-		
-				PDC1 = -duty; 
-			}
-				
-			break;
-		case PWM_2:
-		
-			if(PWM_Data.reverse[pwm_id])
-				duty = -duty;
-		
-			PWMCON1bits.PEN2L = 1; 
-			PWMCON1bits.PEN2H = 1; 
-			PWMCON1bits.PMOD2 = PWM_Data.inverted[pwm_id]; 
-
-			if(duty == 0) {
-				OVDCONbits.POVD2L = 0;
-				OVDCONbits.POVD2H = 0;
-				switch(PWM_Data.mode[pwm_id]) {
-				case PWM_ONE_DEFAULT_LOW:
-				case PWM_BOTH_DEFAULT_LOW:
-					OVDCONbits.POUT2L = 0;
-					OVDCONbits.POUT2H = 0;
-					break;
-				case PWM_ONE_DEFAULT_HIGH:
-				case PWM_BOTH_DEFAULT_HIGH:
-					OVDCONbits.POUT2L = 1;
-					OVDCONbits.POUT2H = 1;
-					break;
-				}
-			} else if(duty > 0) {
-				/* PWM1L is forced low */
-				switch(PWM_Data.mode[pwm_id]) {
-				case PWM_ONE_DEFAULT_LOW:
-					OVDCONbits.POUT2L = 0;
-					OVDCONbits.POVD2L = 0;
-					OVDCONbits.POVD2H = 1;
-					break;
-				case PWM_BOTH_DEFAULT_LOW:
-					OVDCONbits.POVD2H = 1;
-					OVDCONbits.POVD2L = 1;
-					break;
-				case PWM_ONE_DEFAULT_HIGH:
-					OVDCONbits.POUT2L = 1;
-					OVDCONbits.POVD2L = 0;
-					OVDCONbits.POVD2H = 1;
-					if(duty > PWM_Data.period) 
-						duty = PWM_Data.period;
-					duty = PWM_Data.period - duty;
-					break;
-				case PWM_BOTH_DEFAULT_HIGH:
-					OVDCONbits.POVD2L = 1;
-					OVDCONbits.POVD2H = 1;
-					if(duty > PWM_Data.period) 
-						duty = PWM_Data.period;
-					duty = PWM_Data.period - duty;
-					break;
-				}
-		
-				PDC2 = duty; 
-			} else {
-				switch(PWM_Data.mode[pwm_id]) {
-				case PWM_ONE_DEFAULT_LOW:
-					OVDCONbits.POUT2H = 0;
-					OVDCONbits.POVD2H = 0;
-					OVDCONbits.POVD2L = 1;
-					break;
-				case PWM_BOTH_DEFAULT_LOW:
-					OVDCONbits.POVD2H = 1;
-					OVDCONbits.POVD2L = 1;
-					break;
-				case PWM_ONE_DEFAULT_HIGH:
-					OVDCONbits.POUT2H = 1;
-					OVDCONbits.POVD2H = 0;
-					OVDCONbits.POVD2L = 1;
-					if(duty < -PWM_Data.period) 
-						duty = -PWM_Data.period;
-					duty = -PWM_Data.period - duty;
-					break;
-				case PWM_BOTH_DEFAULT_HIGH:
-					OVDCONbits.POVD2L = 1;
-					OVDCONbits.POVD2H = 1;
-					if(duty < -PWM_Data.period) 
-						duty = -PWM_Data.period;
-					duty = -PWM_Data.period - duty;
-					break;
-				}
-		
-				PDC2 = -duty; 
-			}
-				
-			break;
-		case PWM_3:
-			if(PWM_Data.reverse[pwm_id])
-				duty = -duty;
-				
-			PWMCON1bits.PEN3L = 1; 
-			PWMCON1bits.PEN3H = 1; 
-			PWMCON1bits.PMOD3 = PWM_Data.inverted[pwm_id]; 
-
-			if(duty == 0) {
-				OVDCONbits.POVD3L = 0;
-				OVDCONbits.POVD3H = 0;
-				switch(PWM_Data.mode[pwm_id]) {
-				case PWM_ONE_DEFAULT_LOW:
-				case PWM_BOTH_DEFAULT_LOW:
-					OVDCONbits.POUT3L = 0;
-					OVDCONbits.POUT3H = 0;
-					break;
-				case PWM_ONE_DEFAULT_HIGH:
-				case PWM_BOTH_DEFAULT_HIGH:
-					OVDCONbits.POUT3L = 1;
-					OVDCONbits.POUT3H = 1;
-					break;
-				}
-			} else if(duty > 0) {
-				/* PWM1L is forced low */
-				switch(PWM_Data.mode[pwm_id]) {
-				case PWM_ONE_DEFAULT_LOW:
-					OVDCONbits.POUT3L = 0;
-					OVDCONbits.POVD3L = 0;
-					OVDCONbits.POVD3H = 1;
-					break;
-				case PWM_BOTH_DEFAULT_LOW:
-					OVDCONbits.POVD3H = 1;
-					OVDCONbits.POVD3L = 1;
-					break;
-				case PWM_ONE_DEFAULT_HIGH:
-					OVDCONbits.POUT3L = 1;
-					OVDCONbits.POVD3L = 0;
-					OVDCONbits.POVD3H = 1;
-					if(duty > PWM_Data.period) 
-						duty = PWM_Data.period;
-					duty = PWM_Data.period - duty;
-					break;
-				case PWM_BOTH_DEFAULT_HIGH:
-					OVDCONbits.POVD3L = 1;
-					OVDCONbits.POVD3H = 1;
-					if(duty > PWM_Data.period) 
-						duty = PWM_Data.period;
-					duty = PWM_Data.period - duty;
-					break;
-				}
-		
-				PDC3 = duty; 
-			} else {
-				switch(PWM_Data.mode[pwm_id]) {
-				case PWM_ONE_DEFAULT_LOW:
-					OVDCONbits.POUT3H = 0;
-					OVDCONbits.POVD3H = 0;
-					OVDCONbits.POVD3L = 1;
-					break;
-				case PWM_BOTH_DEFAULT_LOW:
-					OVDCONbits.POVD3H = 1;
-					OVDCONbits.POVD3L = 1;
-					break;
-				case PWM_ONE_DEFAULT_HIGH:
-					OVDCONbits.POUT3H = 1;
-					OVDCONbits.POVD3H = 0;
-					OVDCONbits.POVD3L = 1;
-					if(duty < -PWM_Data.period) 
-						duty = -PWM_Data.period;
-					duty = -PWM_Data.period - duty;
-					break;
-				case PWM_BOTH_DEFAULT_HIGH:
-					OVDCONbits.POVD3L = 1;
-					OVDCONbits.POVD3H = 1;
-					if(duty < -PWM_Data.period) 
-						duty = -PWM_Data.period;
-					duty = -PWM_Data.period - duty;
-					break;
-				}
-		
-				PDC3 = -duty; 
-			}
-				
-			break;
-		case PWM_4:
-			if(PWM_Data.reverse[pwm_id])
-				duty = -duty;
-				
-			PWMCON1bits.PEN4L = 1; 
-			PWMCON1bits.PEN4H = 1; 
-			PWMCON1bits.PMOD4 = PWM_Data.inverted[pwm_id]; 
-
-			if(duty == 0) {
-				OVDCONbits.POVD4L = 0;
-				OVDCONbits.POVD4H = 0;
-				switch(PWM_Data.mode[pwm_id]) {
-				case PWM_ONE_DEFAULT_LOW:
-				case PWM_BOTH_DEFAULT_LOW:
-					OVDCONbits.POUT4L = 0;
-					OVDCONbits.POUT4H = 0;
-					break;
-				case PWM_ONE_DEFAULT_HIGH:
-				case PWM_BOTH_DEFAULT_HIGH:
-					OVDCONbits.POUT4L = 1;
-					OVDCONbits.POUT4H = 1;
-					break;
-				}
-			} else if(duty > 0) {
-				/* PWM1L is forced low */
-				switch(PWM_Data.mode[pwm_id]) {
-				case PWM_ONE_DEFAULT_LOW:
-					OVDCONbits.POUT4L = 0;
-					OVDCONbits.POVD4L = 0;
-					OVDCONbits.POVD4H = 1;
-					break;
-				case PWM_BOTH_DEFAULT_LOW:
-					OVDCONbits.POVD4H = 1;
-					OVDCONbits.POVD4L = 1;
-					break;
-				case PWM_ONE_DEFAULT_HIGH:
-					OVDCONbits.POUT4L = 1;
-					OVDCONbits.POVD4L = 0;
-					OVDCONbits.POVD4H = 1;
-					if(duty > PWM_Data.period) 
-						duty = PWM_Data.period;
-					duty = PWM_Data.period - duty;
-					break;
-				case PWM_BOTH_DEFAULT_HIGH:
-					OVDCONbits.POVD4L = 1;
-					OVDCONbits.POVD4H = 1;
-					if(duty > PWM_Data.period) 
-						duty = PWM_Data.period;
-					duty = PWM_Data.period - duty;
-					break;
-				}
-		
-				PDC4 = duty; 
-			} else {
-				switch(PWM_Data.mode[pwm_id]) {
-				case PWM_ONE_DEFAULT_LOW:
-					OVDCONbits.POUT4H = 0;
-					OVDCONbits.POVD4H = 0;
-					OVDCONbits.POVD4L = 1;
-					break;
-				case PWM_BOTH_DEFAULT_LOW:
-					OVDCONbits.POVD4H = 1;
-					OVDCONbits.POVD4L = 1;
-					break;
-				case PWM_ONE_DEFAULT_HIGH:
-					OVDCONbits.POUT4H = 1;
-					OVDCONbits.POVD4H = 0;
-					OVDCONbits.POVD4L = 1;
-					if(duty < -PWM_Data.period) 
-						duty = -PWM_Data.period;
-					duty = -PWM_Data.period - duty;
-					break;
-				case PWM_BOTH_DEFAULT_HIGH:
-					OVDCONbits.POVD4L = 1;
-					OVDCONbits.POVD4H = 1;
-					if(duty < -PWM_Data.period) 
-						duty = -PWM_Data.period;
-					duty = -PWM_Data.period - duty;
-					break;
-				}
-		
-				PDC4 = -duty; 
-			}
-				
-			break;
-		default: ERROR(PWM_ERROR_INVALID_PWM_ID, &pwm_id);
+	PWMCON1 = (PWMCON1 & ~(PWM_PWMCON1_MASK << pwm_id)) | PWM_Data.pwmcon1[pwm_id];
+	OVDCON = (OVDCON & ~(PWM_OVDCON_MASK << (pwm_id << 1))) | ovdcon;
+	(&PDC1)[pwm_id] = pdc;		// PDC1 to PDC4 are contiguous
+	PWMCON2bits.UDIS = 0;
+}
+
+/**
+	Set the duties of several PWMs at once. Implicitly enable the PWM outputs.
+	
+	All the registers are written while updates are disabled, so the new duties
+	take effect together at the next PWM period, for instance for the three phases of a motor.
+	
+	\param	duties
+			Duty cycles (0..32767), of \ref PWM_1 first.
+	\param	count
+			Amount of PWMs to set, from \ref PWM_1, 1 to 4.
+*/
+void pwm_set_duties(const int* duties, int count)
+{
+	unsigned int pwmcon1_mask = 0;
+	unsigned int pwmcon1 = 0;
+	unsigned int ovdcon_mask = 0;
+	unsigned int ovdcon = 0;
+	unsigned int pdc[4];
+	int i;
+	
+	ERROR_CHECK_RANGE(count, 1, 4, PWM_ERROR_INVALID_PWM_ID);
+	
+	for(i = 0; i < count; i++) {
+		ovdcon |= pwm_compute_duty(i, duties[i], &pdc[i]);
+		pwmcon1 |= PWM_Data.pwmcon1[i];
+		pwmcon1_mask |= PWM_PWMCON1_MASK << i;
+		ovdcon_mask |= PWM_OVDCON_MASK << (i << 1);
 	}
+	
+	PWMCON2bits.UDIS = 1;
+	PWMCON1 = (PWMCON1 & ~pwmcon1_mask) | pwmcon1;
+	OVDCON = (OVDCON & ~ovdcon_mask) | ovdcon;
+	for(i = 0; i < count; i++)
+		(&PDC1)[i] = pdc[i];
 	PWMCON2bits.UDIS = 0;
 }
 
@@ -543,7 +292,7 @@ void pwm_set_special_event_trigger(int direction, int postscale, unsigned value)
 void pwm_set_brake(int pwm_id, int mode)
 {
 	ERROR_CHECK_RANGE(pwm_id, 0, 3, PWM_ERROR_INVALID_PWM_ID);
-	ERROR_CHECK_RANGE(mode, 0, 6, PWM_ERROR_INVALID_MODE);
+	ERROR_CHECK_RANGE(mode, 0, PWM_BOTH_INVERTED_DEFAULT_HIGH, PWM_ERROR_INVALID_MODE);
 	
 	if(mode == PWM_BOTH_INVERTED_DEFAULT_LOW) {
 		mode = PWM_BOTH_DEFAULT_LOW;
@@ -556,12 +305,22 @@ void pwm_set_brake(int pwm_id, int mode)
 	
 	}
 	PWM_Data.mode[pwm_id] = mode;
+	pwm_update_table(pwm_id);
+}
+
+/**
+	Return the duty corresponding to a PWM output always active.
+*/
+unsigned int pwm_get_period(void)
+{
+	return PWM_Data.period;
 }
 
 void pwm_invert(int pwm_id, int invert) 
 {
 	ERROR_CHECK_RANGE(pwm_id, 0, 3, PWM_ERROR_INVALID_PWM_ID);
 	PWM_Data.reverse[pwm_id] = invert;
+	pwm_update_table(pwm_id);
 }
 	
 //--------------------------
@@ -25,6 +25,8 @@
 #ifndef _MOLOLE_PWM_H
 #define _MOLOLE_PWM_H
 
+#include "../types/types.h"
+
 /** \addtogroup pwm */
 /*@{*/
 
@@ -109,12 +111,16 @@ void pwm_disable(int pwm_id);
 
 void pwm_set_duty(int pwm_id, int duty);
 
+void pwm_set_duties(const int* duties, int count);
+
 void pwm_set_special_event_trigger(int direction, int postscale, unsigned value);
 
 void pwm_set_brake(int pwm_id, int mode);
 
 void pwm_invert(int pwm_id, int invert);
 
+unsigned int pwm_get_period(void);
+
 /*@}*/
 
 #endif
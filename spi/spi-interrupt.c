@@ -0,0 +1,66 @@
+/*
+	Molole - Mobots Low Level library
+	An open source toolkit for robot programming using DsPICs
+
+	Copyright (C) 2007--2011 Stephane Magnenat <stephane at magnenat dot net>,
+	Philippe Retornaz <philippe dot retornaz at epfl dot ch>
+	Mobots group (http://mobots.epfl.ch), Robotics system laboratory (http://lsro.epfl.ch)
+	EPFL Ecole polytechnique federale de Lausanne (http://www.epfl.ch)
+
+	See authors.txt for more details about other contributors.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Lesser General Public License as published
+	by the Free Software Foundation, version 3 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "spi_priv.h"
+#include "../types/types.h"
+#include "../error/error.h"
+
+/** \addtogroup spi */
+/*@{*/
+
+/** \file
+	\brief SPI interrupts, shared by the DMA and the non-DMA SPI modules.
+	
+	Each module registers the handler of the SPI it drives, so one SPI can use
+	the DMA module while the other one uses the non-DMA module.
+*/
+
+/** Handler of the interrupt of each SPI */
+static spi_interrupt_handler spi_interrupt_handlers[2];
+
+/**
+	Set the function handling the interrupt of an SPI.
+	
+	Must be called before enabling the interrupt.
+	
+	\param	spi_id
+			SPI id, 0 for the first SPI and 1 for the second one.
+	\param	handler
+			Function called from the interrupt, after the interrupt flag is cleared.
+*/
+void spi_set_interrupt_handler(int spi_id, spi_interrupt_handler handler) {
+	spi_interrupt_handlers[spi_id] = handler;
+}
+
+void _ISR _SPI1Interrupt(void) {
+	_SPI1IF = 0;
+	spi_interrupt_handlers[0]();
+}
+
+void _ISR _SPI2Interrupt(void) {
+	_SPI2IF = 0;
+	spi_interrupt_handlers[1]();
+}
+
+/*@}*/
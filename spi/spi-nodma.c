@@ -23,6 +23,7 @@
 */
 
 #include "spi-nodma.h"
+#include "spi_priv.h"
 #include "../error/error.h"
 #include "../clock/clock.h"
 #include "../gpio/gpio.h"
@@ -47,13 +48,102 @@
 //-----------------------
 
 
+/** Depth of the SPI buffers, 8 words with the enhanced buffer mode, 1 word otherwise */
+#if defined __PIC24F__ || defined __dsPIC33E__
+#define SPI_NODMA_FIFO_DEPTH 8
+#else
+#define SPI_NODMA_FIFO_DEPTH 1
+#endif
+
 /** Data for the SPI Interface */
 static struct {
 	int data_size;
-	gpio ss;
+	gpio_group ss;						/**< chip select of the transfert in progress */
+	bool async;							/**< true if spi_nodma_init_async() was called */
+	bool busy;							/**< true while an asynchronous transfert is in progress */
+	unsigned char * tx;					/**< next data to send, NULL to send zeros */
+	unsigned char * rx;					/**< where to store the next data received, NULL to discard them */
+	unsigned int left;					/**< amount of words still to send */
+	unsigned int burst;					/**< amount of words sent by the last burst, to receive */
+	spi_nodma_transfert_done callback;	/**< function to call when the asynchronous transfert is done */
 } spi_status[2];
 
 
+//------------------
+// Private functions
+//------------------
+
+/**
+	Move one burst of an asynchronous transfert, called from the interrupt once the previous burst is completed.
+	Received words of the previous burst are read, then up to SPI_NODMA_FIFO_DEPTH words are sent.
+*/
+static __attribute__((always_inline)) void spi_nodma_burst(int spi_id, volatile unsigned int * buf) {
+	unsigned int n;
+	unsigned int data;
+	spi_nodma_transfert_done callback;
+
+	for(n = spi_status[spi_id].burst; n; n--) {
+		data = *buf;
+		if(spi_status[spi_id].rx) {
+			if(spi_status[spi_id].data_size) {
+				*((unsigned int *) spi_status[spi_id].rx) = data;
+				spi_status[spi_id].rx += 2;
+			} else
+				*spi_status[spi_id].rx++ = data;
+		}
+	}
+
+	if(!spi_status[spi_id].left) {
+		gpio_group_set(&spi_status[spi_id].ss);
+		if(spi_id == SPI_NODMA_1) {
+			_SPI1IE = 0;
+#if SPI_NODMA_FIFO_DEPTH > 1
+			SPI1STATbits.SPIEN = 0;
+			SPI1CON2bits.SPIBEN = 0;
+			SPI1STATbits.SISEL = 0;
+			SPI1STATbits.SPIEN = 1;
+#endif
+		} else {
+			_SPI2IE = 0;
+#if SPI_NODMA_FIFO_DEPTH > 1
+			SPI2STATbits.SPIEN = 0;
+			SPI2CON2bits.SPIBEN = 0;
+			SPI2STATbits.SISEL = 0;
+			SPI2STATbits.SPIEN = 1;
+#endif
+		}
+		callback = spi_status[spi_id].callback;
+		spi_status[spi_id].busy = false;
+		if(callback)
+			callback(spi_id);
+		return;
+	}
+
+	n = spi_status[spi_id].left < SPI_NODMA_FIFO_DEPTH ? spi_status[spi_id].left : SPI_NODMA_FIFO_DEPTH;
+	spi_status[spi_id].left -= n;
+	spi_status[spi_id].burst = n;
+	for(; n; n--) {
+		if(spi_status[spi_id].tx) {
+			if(spi_status[spi_id].data_size) {
+				*buf = *((unsigned int *) spi_status[spi_id].tx);
+				spi_status[spi_id].tx += 2;
+			} else
+				*buf = *spi_status[spi_id].tx++;
+		} else
+			*buf = 0;
+	}
+}
+
+/* Interrupt handlers (asynchronous mode), see spi_set_interrupt_handler() */
+static void spi_nodma_interrupt_1(void) {
+	spi_nodma_burst(SPI_NODMA_1, &SPI1BUF);
+}
+
+static void spi_nodma_interrupt_2(void) {
+	spi_nodma_burst(SPI_NODMA_2, &SPI2BUF);
+}
+
+
 //-------------------
 // Exported functions
 //-------------------
@@ -184,6 +274,138 @@ void spi_nodma_init_master(int spi_id, unsigned int speed_khz, int transfert_mod
 
 }
 
+/**
+	Enable asynchronous transferts on an SPI device
+	
+	Must be called after spi_nodma_init_master().
+	Where available (PIC24F, dsPIC33E), asynchronous transferts use the enhanced buffer
+	mode to move 8 words per interrupt, otherwise one word per interrupt: the dsPIC33F
+	has a single word buffer, so there the interrupt rate is the word rate.
+	The SPI interrupt is shared with the DMA SPI module, so spi-interrupt.c must be linked too.
+	
+	\param	spi_id
+			SPI id. One of \ref spi_nodma_id
+	\param 	priority
+			Interrupt priority, from 1 (lowest priority) to 6 (highest normal priority)
+*/
+void spi_nodma_init_async(int spi_id, int priority) {
+	ERROR_CHECK_RANGE(spi_id, SPI_NODMA_1, SPI_NODMA_2, SPI_NODMA_INVALID_ID);
+	ERROR_CHECK_RANGE(priority, 1, 7, GENERIC_ERROR_INVALID_INTERRUPT_PRIORITY);
+
+	if(spi_id == SPI_NODMA_1) {
+		_SPI1IE = 0;
+		_SPI1IP = priority;
+		spi_set_interrupt_handler(SPI_NODMA_1, spi_nodma_interrupt_1);
+	} else {
+		_SPI2IE = 0;
+		_SPI2IP = priority;
+		spi_set_interrupt_handler(SPI_NODMA_2, spi_nodma_interrupt_2);
+	}
+	spi_status[spi_id].busy = false;
+	spi_status[spi_id].async = true;
+}
+
+/**
+	Start an interrupt-driven SPI transfert
+	
+	The words are moved by bursts from the SPI interrupt, so the CPU is free during the transfert.
+	spi_nodma_transfert_sync() must not be called on this SPI until the callback is called.
+	
+	\param	spi_id
+			SPI id. One of \ref spi_nodma_id.
+	\param	tx_buffer
+			The tx buffer pointer. Can be NULL
+	\param	rx_buffer
+			The rx buffer pointer. Can be NULL.
+	\param	xch_count
+			The number of spi transfert to do. A transfert size is choosed at \ref spi_init_master.
+	\param	ss
+			The chips select GPIO signal to use.
+	\param 	callback
+			The callback called from the interrupt when the transfert is done. Can be NULL.
+*/
+void spi_nodma_transfert_async(int spi_id, void * tx_buffer, void * rx_buffer, unsigned int xch_count, gpio ss, spi_nodma_transfert_done callback) {
+	int flags;
+
+	ERROR_CHECK_RANGE(spi_id, SPI_NODMA_1, SPI_NODMA_2, SPI_NODMA_INVALID_ID);
+
+	if(!spi_status[spi_id].async) {
+		ERROR(SPI_NODMA_NOT_ASYNC, &spi_id);
+	}
+	if(spi_status[spi_id].busy) {
+		ERROR(SPI_NODMA_BUSY, &spi_id);
+	}
+	if(!xch_count) {
+		ERROR(SPI_NODMA_INVALID_TRANSFERT, &xch_count);
+	}
+	if(spi_status[spi_id].data_size && (((unsigned int) tx_buffer) & 0x1)) {
+		ERROR(SPI_NODMA_NONALIGNED_BUFFER, tx_buffer);
+	}
+	if(spi_status[spi_id].data_size && (((unsigned int) rx_buffer) & 0x1)) {
+		ERROR(SPI_NODMA_NONALIGNED_BUFFER, rx_buffer);
+	}
+
+	spi_status[spi_id].busy = true;
+	spi_status[spi_id].tx = tx_buffer;
+	spi_status[spi_id].rx = rx_buffer;
+	spi_status[spi_id].left = xch_count;
+	spi_status[spi_id].burst = 0;
+	gpio_group_init(&spi_status[spi_id].ss, &ss, 1);
+	spi_status[spi_id].callback = callback;
+
+	gpio_group_clear(&spi_status[spi_id].ss);
+	gpio_group_set_output(&spi_status[spi_id].ss);
+
+	// the first burst is sent from here, with the interrupt masked
+	IRQ_DISABLE(flags);
+	if(spi_id == SPI_NODMA_1) {
+		SPI1STATbits.SPIROV = 0;
+#if SPI_NODMA_FIFO_DEPTH > 1
+		// interrupt when the last bit of the burst has been shifted out
+		SPI1STATbits.SPIEN = 0;
+		SPI1CON2bits.SPIBEN = 1;
+		SPI1STATbits.SISEL = 5;
+		SPI1STATbits.SPIEN = 1;
+#else
+		// Dummy read, empty the rx buffer
+		(void) SPI1BUF;
+#endif
+		_SPI1IF = 0;
+		_SPI1IE = 1;
+		spi_nodma_burst(SPI_NODMA_1, &SPI1BUF);
+	} else {
+		SPI2STATbits.SPIROV = 0;
+#if SPI_NODMA_FIFO_DEPTH > 1
+		// interrupt when the last bit of the burst has been shifted out
+		SPI2STATbits.SPIEN = 0;
+		SPI2CON2bits.SPIBEN = 1;
+		SPI2STATbits.SISEL = 5;
+		SPI2STATbits.SPIEN = 1;
+#else
+		// Dummy read, empty the rx buffer
+		(void) SPI2BUF;
+#endif
+		_SPI2IF = 0;
+		_SPI2IE = 1;
+		spi_nodma_burst(SPI_NODMA_2, &SPI2BUF);
+	}
+	IRQ_ENABLE(flags);
+}
+
+/**
+	Return whether an asynchronous transfert is in progress on an SPI device
+	
+	\param	spi_id
+			SPI id. One of \ref spi_nodma_id.
+	
+	\return	true if a transfert is in progress, false otherwise
+*/
+bool spi_nodma_is_busy(int spi_id) {
+	ERROR_CHECK_RANGE(spi_id, SPI_NODMA_1, SPI_NODMA_2, SPI_NODMA_INVALID_ID);
+
+	return spi_status[spi_id].busy;
+}
+
 /**
 	Perform a busy-waiting SPI transfert
 	
@@ -208,6 +430,10 @@ void spi_nodma_transfert_sync(int spi_id, void * tx_buffer, void * rx_buffer, un
 
 	ERROR_CHECK_RANGE(spi_id, SPI_NODMA_1, SPI_NODMA_2, SPI_NODMA_INVALID_ID);
 
+	if(spi_status[spi_id].busy) {
+		ERROR(SPI_NODMA_BUSY, &spi_id);
+	}
+
 	if(spi_status[spi_id].data_size && (((unsigned int) tx_buffer) & 0x1)) {
 		ERROR(SPI_NODMA_NONALIGNED_BUFFER, tx_buffer);
 	}
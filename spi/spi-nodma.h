@@ -52,6 +52,8 @@ enum spi_nodma_errors
 	SPI_NODMA_INVALID_SAMPLE_PHASE,		/**< The specified sample phase mode is invalid */
 	SPI_NODMA_INVALID_TRANSFERT,		/**< An invalide transfert has been requested */
 	SPI_NODMA_NONALIGNED_BUFFER,		/**< Misaligned buffer has been transferd */
+	SPI_NODMA_BUSY,						/**< A transfert was started while an asynchronous one was in progress */
+	SPI_NODMA_NOT_ASYNC,				/**< An asynchronous transfert was started without calling spi_nodma_init_async() */
 };
 
 
@@ -91,6 +93,15 @@ void spi_nodma_init_master(int spi_id, unsigned int speed_khz, int transfert_mod
 
 void spi_nodma_transfert_sync(int spi_id, void * tx_buffer, void * rx_buffer, unsigned int xch_count, gpio ss);
 
+/** Callback when an asynchronous transfert is done */
+typedef void (*spi_nodma_transfert_done)(int spi_id);
+
+void spi_nodma_init_async(int spi_id, int priority);
+
+void spi_nodma_transfert_async(int spi_id, void * tx_buffer, void * rx_buffer, unsigned int xch_count, gpio ss, spi_nodma_transfert_done callback);
+
+bool spi_nodma_is_busy(int spi_id);
+
 	
 /*@}*/
 
@@ -23,6 +23,7 @@
 */
 
 #include "spi.h"
+#include "spi_priv.h"
 #include "../error/error.h"
 #include "../clock/clock.h"
 #include "../dma/dma.h"
@@ -44,6 +45,18 @@
 //-----------------------
 
 
+/** Amount of transferts that can wait in the queue of each SPI */
+#define SPI_QUEUE_SIZE 8
+
+/** A transfert waiting in the queue of an SPI */
+typedef struct {
+	spi_segment single;					/**< the segment of a simple transfert */
+	const spi_segment * segments;		/**< the segments of a scatter-gather transfert, NULL for a simple one */
+	unsigned int segment_count;
+	gpio_group ss;
+	spi_transfert_done callback;
+} spi_transaction;
+
 /** Data for the SPI Interface */
 static struct {
 	int dma_rx;
@@ -52,42 +65,260 @@ static struct {
 	spi_slave_data_cb slave_callback;
 	int priority;
 	int data_size;
-	gpio ss;
+	gpio_group ss;						/**< chip select of the transfert in progress */
 	int waiting;
 	int rxtx;
+	bool busy;							/**< true while a transfert is in progress */
+	spi_segment single;					/**< the segment of the current simple transfert */
+	const spi_segment * segment;		/**< the segment in progress */
+	unsigned int segments_left;			/**< amount of segments of the current transfert, including the one in progress */
+	spi_transaction queue[SPI_QUEUE_SIZE];	/**< transferts waiting for the current one to finish */
+	unsigned int queue_head;			/**< index of the oldest transfert in the queue */
+	unsigned int queue_count;			/**< amount of transferts in the queue */
+	void * stream_rx[2];				/**< the ping-pong buffers of a slave stream */
+	unsigned int stream_count;			/**< amount of spi transferts of each buffer of a slave stream */
+	spi_slave_stream_cb stream_callback;	/**< function to call when a buffer of a slave stream is full */
+	spi_slave_frame_cb frame_callback;	/**< function to call on the frame boundaries of a slave stream */
 } spi_status[2];
 
+/** Destination of the data received during segments without rx buffer */
+static unsigned int spi_discard __attribute__((space(dma)));
 
 
 //------------------
 // Private functions
 //------------------
 
-/** Callback of the spi1 DMA interrupt */
-static void spi1_dma_cb(int __attribute__((unused)) channel, bool __attribute__((unused)) first_buffer) {
-	gpio_write(spi_status[0].ss, true);
+/** 
+	Start the current segment on the DMA channels configured by spi_init_master().
+	Only the buffer, count, null write and addressing modes of the channels are changed.
+*/
+static void spi_start_segment(int spi_id) {
+	const spi_segment * seg = spi_status[spi_id].segment;
+	volatile unsigned int * buf;
+
+	if(spi_id == SPI_1) {
+		buf = &SPI1BUF;
+		/* Do a dummy read of the register and clean any overflow */
+		(void) SPI1BUF;
+		SPI1STATbits.SPIROV = 0;
+	} else {
+		buf = &SPI2BUF;
+		/* Do a dummy read of the register and clean any overflow */
+		(void) SPI2BUF;
+		SPI2STATbits.SPIROV = 0;
+	}
+
+	// The RX channel MUST be used as the interrupt handler... otherwise the callback will
+	// be called while the transfert is still running and we will deassert CS !
+	dma_set_null_write(spi_status[spi_id].dma_rx, seg->tx_buffer ? DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL : DMA_WRITE_NULL_TO_PERIPHERAL);
+	if(seg->rx_buffer) {
+		dma_set_addressing_mode(spi_status[spi_id].dma_rx, DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT);
+		dma_set_buffer(spi_status[spi_id].dma_rx, seg->rx_buffer, seg->xch_count);
+	} else {
+		// received data all overwrite the same word
+		dma_set_addressing_mode(spi_status[spi_id].dma_rx, DMA_ADDRESSING_REGISTER);
+		dma_set_buffer(spi_status[spi_id].dma_rx, &spi_discard, seg->xch_count);
+	}
+	dma_enable_channel(spi_status[spi_id].dma_rx);
+	spi_status[spi_id].rxtx = 2;
+
+	if(seg->tx_buffer) {
+		dma_set_buffer(spi_status[spi_id].dma_tx, seg->tx_buffer, seg->xch_count);
+		dma_enable_channel(spi_status[spi_id].dma_tx);
+		spi_status[spi_id].rxtx |= 1;
+		dma_start_transfer(spi_status[spi_id].dma_tx);
+	} else {
+		/** Do a null write on spibuf */
+		*buf = 0;
+	}
+}
+
+/** Assert the chip select and start the first segment of a transfert */
+static void spi_start(int spi_id, const spi_segment * segments, unsigned int segment_count, const gpio_group * ss, spi_transfert_done callback) {
+	spi_status[spi_id].busy = true;
+	spi_status[spi_id].ss = *ss;
+	spi_status[spi_id].callback = callback;
+	spi_status[spi_id].segment = segments;
+	spi_status[spi_id].segments_left = segment_count;
+
+	gpio_group_clear(ss);
+	gpio_group_set_output(ss);
+
+	spi_start_segment(spi_id);
+}
+
+/** Start the next segment, or end the current transfert of an SPI and start the next queued one, called from the DMA interrupt */
+static void spi_dma_done(int spi_id) {
+	spi_transaction * t;
+
+	if(spi_status[spi_id].rxtx & 0x1)
+		dma_disable_channel(spi_status[spi_id].dma_tx);
+	if(spi_status[spi_id].rxtx & 0x2)
+		dma_disable_channel(spi_status[spi_id].dma_rx);
+
+	// chain the segments while keeping the chip selected
+	if(--spi_status[spi_id].segments_left) {
+		spi_status[spi_id].segment++;
+		spi_start_segment(spi_id);
+		return;
+	}
+
+	gpio_group_set(&spi_status[spi_id].ss);
 	
-	if(spi_status[0].rxtx & 0x1)
-		dma_disable_channel(spi_status[0].dma_tx);
-	if(spi_status[0].rxtx & 0x2)
-		dma_disable_channel(spi_status[0].dma_rx);
+	// the callback may start a new transfert
+	spi_status[spi_id].busy = false;
+	if(spi_status[spi_id].callback) 
+		spi_status[spi_id].callback(spi_id);
 	
-	if(spi_status[0].callback) 
-		spi_status[0].callback(SPI_1);
+	if(!spi_status[spi_id].busy && spi_status[spi_id].queue_count) {
+		t = &spi_status[spi_id].queue[spi_status[spi_id].queue_head];
+		spi_status[spi_id].queue_head = (spi_status[spi_id].queue_head + 1) % SPI_QUEUE_SIZE;
+		spi_status[spi_id].queue_count--;
+		if(t->segments) {
+			spi_start(spi_id, t->segments, t->segment_count, &t->ss, t->callback);
+		} else {
+			spi_status[spi_id].single = t->single;
+			spi_start(spi_id, &spi_status[spi_id].single, 1, &t->ss, t->callback);
+		}
+	}
+}
+
+/** Queue a transfert, or start it if the SPI is idle */
+static void spi_queue(int spi_id, void * tx_buffer, void * rx_buffer, unsigned int xch_count, const spi_segment * segments, unsigned int segment_count, gpio ss, spi_transfert_done callback) {
+	spi_transaction * t;
+	gpio_group group;
+	int flags;
+
+	// resolve the chip select once, the interrupts only use the group
+	gpio_group_init(&group, &ss, 1);
+
+	IRQ_DISABLE(flags);
+	if(!spi_status[spi_id].busy) {
+		if(!segments) {
+			spi_status[spi_id].single.tx_buffer = tx_buffer;
+			spi_status[spi_id].single.rx_buffer = rx_buffer;
+			spi_status[spi_id].single.xch_count = xch_count;
+			segments = &spi_status[spi_id].single;
+			segment_count = 1;
+		}
+		spi_start(spi_id, segments, segment_count, &group, callback);
+	} else {
+		if(spi_status[spi_id].queue_count == SPI_QUEUE_SIZE) {
+			IRQ_ENABLE(flags);
+			ERROR(SPI_QUEUE_FULL, &spi_id);
+		}
+		t = &spi_status[spi_id].queue[(spi_status[spi_id].queue_head + spi_status[spi_id].queue_count) % SPI_QUEUE_SIZE];
+		t->single.tx_buffer = tx_buffer;
+		t->single.rx_buffer = rx_buffer;
+		t->single.xch_count = xch_count;
+		t->segments = segments;
+		t->segment_count = segment_count;
+		t->ss = group;
+		t->callback = callback;
+		spi_status[spi_id].queue_count++;
+	}
+	IRQ_ENABLE(flags);
+}
+
+/** Callback of the spi1 DMA interrupt */
+static void spi1_dma_cb(int __attribute__((unused)) channel, bool __attribute__((unused)) first_buffer) {
+	spi_dma_done(SPI_1);
 }
 
 /** Callback of the spi2 DMA interrupt */
 static void spi2_dma_cb(int __attribute__((unused)) channel, bool __attribute__((unused)) first_buffer) {
-	gpio_write(spi_status[1].ss, true);
+	spi_dma_done(SPI_2);
+}
 
-	if(spi_status[1].rxtx & 0x1)
-		dma_disable_channel(spi_status[1].dma_tx);
-	if(spi_status[1].rxtx & 0x2)
-		dma_disable_channel(spi_status[1].dma_rx);
+/** Callback of the spi1 slave stream DMA interrupt */
+static void spi1_stream_cb(int __attribute__((unused)) channel, bool first_buffer) {
+	spi_status[0].stream_callback(SPI_1, spi_status[0].stream_rx[first_buffer ? 0 : 1], first_buffer);
+}
+
+/** Callback of the spi2 slave stream DMA interrupt */
+static void spi2_stream_cb(int __attribute__((unused)) channel, bool first_buffer) {
+	spi_status[1].stream_callback(SPI_2, spi_status[1].stream_rx[first_buffer ? 0 : 1], first_buffer);
+}
+
+/**
+	Get the number of words of a slave stream received in the buffer being filled.
 	
+	The DMA controller does not expose the progress of a channel, only the address of its most recent
+	access, which is the last received word as long as the rx channel ran after the tx one.
+	rx_buffer is set to the buffer being filled, or NULL if the address is not known.
+*/
+static unsigned int spi_slave_stream_received(int spi_id, void ** rx_buffer) {
+	unsigned int word = spi_status[spi_id].data_size == SPI_TRSF_BYTE ? 1 : 2;
+	unsigned int size = spi_status[spi_id].stream_count * word;
+	char * last = dma_get_last_address(spi_status[spi_id].dma_rx);
+	int i;
+
+	for(i = 0; i < 2; i++) {
+		char * start = spi_status[spi_id].stream_rx[i];
+		if(last >= start && last < start + size) {
+			unsigned int count = (last - start) / word + 1;
+			if(count < spi_status[spi_id].stream_count) {
+				*rx_buffer = start;
+				return count;
+			}
+			// this buffer is full and goes to the stream callback, the other one is empty
+			*rx_buffer = spi_status[spi_id].stream_rx[i ^ 1];
+			return 0;
+		}
+	}
+
+	*rx_buffer = NULL;
+	return SPI_STREAM_COUNT_UNKNOWN;
+}
+
+/** (Re)start the DMA channels of a slave stream at the beginning of their buffers */
+static void spi_slave_stream_restart(int spi_id) {
+	dma_disable_channel(spi_status[spi_id].dma_rx);
+	dma_disable_channel(spi_status[spi_id].dma_tx);
+
+	// drop any partially shifted word and clear the overflow
+	if(spi_id == SPI_1) {
+		SPI1STATbits.SPIEN = 0;
+		SPI1STATbits.SPIROV = 0;
+		SPI1STATbits.SPIEN = 1;
+	} else {
+		SPI2STATbits.SPIEN = 0;
+		SPI2STATbits.SPIROV = 0;
+		SPI2STATbits.SPIEN = 1;
+	}
+
+	dma_enable_channel(spi_status[spi_id].dma_rx);
+	dma_enable_channel(spi_status[spi_id].dma_tx);
+	// the master clocks the first word out of SPIxBUF, so it must be loaded before any request
+	dma_start_transfer(spi_status[spi_id].dma_tx);
+}
+
+/** Check the arguments of a transfert */
+static void spi_check_transfert(int spi_id, void * tx_buffer, void * rx_buffer, unsigned int xch_count) {
+	ERROR_CHECK_RANGE(spi_id, SPI_1, SPI_2, SPI_INVALID_ID);
+	if(rx_buffer == NULL) {
+		ERROR(DMA_ERROR_INVALID_ADDRESS, &rx_buffer);
+	}
+
+	if(!xch_count || (!tx_buffer && !rx_buffer))  {
+		ERROR(SPI_INVALID_TRANSFERT, 0);
+	}
+}
+
+/** Check the arguments of a scatter-gather transfert */
+static void spi_check_transfert_sg(int spi_id, const spi_segment * segments, unsigned int segment_count) {
+	unsigned int i;
 
-	if(spi_status[1].callback) 
-		spi_status[1].callback(SPI_2);
+	ERROR_CHECK_RANGE(spi_id, SPI_1, SPI_2, SPI_INVALID_ID);
+	if(!segments || !segment_count) {
+		ERROR(SPI_INVALID_TRANSFERT, 0);
+	}
+	for(i = 0; i < segment_count; i++) {
+		if(!segments[i].xch_count) {
+			ERROR(SPI_INVALID_TRANSFERT, (void *) &segments[i]);
+		}
+	}
 }
 
 /** Used to implement a dummy semaphore-like mechanism */
@@ -95,17 +326,13 @@ static void spi_dummy_wait(int spi) {
 	spi_status[spi].waiting = 0;
 }
 
-/* Interrupt function (slave mode) */
-void _ISR _SPI2Interrupt(void) {
-	_SPI2IF = 0;
-	
+/* Interrupt handlers (slave mode), see spi_set_interrupt_handler() */
+static void spi_slave_interrupt_2(void) {
 	spi_status[1].slave_callback(SPI_2, SPI2BUF);
 	SPI2STATbits.SPIROV = 0; // clear any overflow
 }
 
-void _ISR _SPI1Interrupt(void) {
-	_SPI1IF = 0;
-	
+static void spi_slave_interrupt_1(void) {
 	spi_status[0].slave_callback(SPI_1, SPI1BUF);
 	SPI1STATbits.SPIROV = 0; // clear any overflow
 }
@@ -118,6 +345,8 @@ void _ISR _SPI1Interrupt(void) {
 /**
 	Start an SPI transfert
 	
+	The SPI must be idle, use spi_queue_transfert() otherwise.
+	
 	\param	spi_id
 			SPI id. One of \ref spi_id.
 	\param	tx_buffer
@@ -134,131 +363,91 @@ void _ISR _SPI1Interrupt(void) {
 */
 
 void spi_start_transfert(int spi_id, void * tx_buffer, void * rx_buffer, unsigned int xch_count, gpio ss, spi_transfert_done callback) {
-
-	int start_tx_dma;
-	ERROR_CHECK_RANGE(spi_id, SPI_1, SPI_2, SPI_INVALID_ID);
-	if(rx_buffer == NULL) {
-		ERROR(DMA_ERROR_INVALID_ADDRESS, &rx_buffer);
+	spi_check_transfert(spi_id, tx_buffer, rx_buffer, xch_count);
+	if(spi_status[spi_id].busy) {
+		ERROR(SPI_BUSY, &spi_id);
 	}
 
-	
-	if(!xch_count || (!tx_buffer && !rx_buffer))  {
-		ERROR(SPI_INVALID_TRANSFERT, 0);
-	}
-
-	if(spi_id == SPI_1) {
-		/* Do a dummy read of the register and clean any overflow */
-		(void *) SPI1BUF;
-		SPI1STATbits.SPIROV = 0;
+	spi_queue(spi_id, tx_buffer, rx_buffer, xch_count, NULL, 0, ss, callback);
+}
 
-		if(!tx_buffer) {
-			/* Configure RX with null write */
-			dma_init_channel(spi_status[0].dma_rx, DMA_INTERRUPT_SOURCE_SPI_1, 	
-					spi_status[0].data_size == SPI_TRSF_BYTE ? DMA_SIZE_BYTE : DMA_SIZE_WORD,
-					DMA_DIR_FROM_PERIPHERAL_TO_RAM, DMA_INTERRUPT_AT_FULL, DMA_WRITE_NULL_TO_PERIPHERAL,
-					DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT, DMA_OPERATING_ONE_SHOT,
-					rx_buffer, 0, (void *) &SPI1BUF, xch_count, spi1_dma_cb);
-			spi_status[0].rxtx = 2;
-			dma_set_priority(spi_status[0].dma_rx, _SPI1IP);
-			dma_enable_channel(spi_status[0].dma_rx);
-			start_tx_dma = -1;
-			
+/**
+	Queue an SPI transfert
 	
-		} else {
-			spi_status[0].rxtx = 1;
-			/* configure RX DMA channel */
-			// We MUST use it as the interrupt handler... otherwise the callback will
-			// be called while the transfert is still running and we will deassert CS !
-			dma_init_channel(spi_status[0].dma_rx, DMA_INTERRUPT_SOURCE_SPI_1, 	
-				spi_status[0].data_size == SPI_TRSF_BYTE ? DMA_SIZE_BYTE : DMA_SIZE_WORD,
-				DMA_DIR_FROM_PERIPHERAL_TO_RAM, DMA_INTERRUPT_AT_FULL, DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL,
-				DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT, DMA_OPERATING_ONE_SHOT,
-				rx_buffer, 0, (void *) &SPI1BUF, xch_count, spi1_dma_cb);
-			dma_set_priority(spi_status[0].dma_rx, _SPI1IP);
-			dma_enable_channel(spi_status[0].dma_rx);
-			spi_status[0].rxtx |= 2;
-				
-			/* Configure TX DMA channel */
-			dma_init_channel(spi_status[0].dma_tx, DMA_INTERRUPT_SOURCE_SPI_1, 	
-				spi_status[0].data_size == SPI_TRSF_BYTE ? DMA_SIZE_BYTE : DMA_SIZE_WORD,
-				DMA_DIR_FROM_RAM_TO_PERIPHERAL, DMA_INTERRUPT_AT_FULL, DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL,
-				DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT, DMA_OPERATING_ONE_SHOT,
-				tx_buffer, 0, (void *) &SPI1BUF, xch_count, 0);
-			start_tx_dma = spi_status[0].dma_tx;
-			dma_set_priority(spi_status[0].dma_tx, _SPI1IP);
-
-			dma_enable_channel(spi_status[0].dma_tx);
-		}
-		spi_status[0].ss = ss;
-		spi_status[0].callback = callback;
+	If the SPI is idle, the transfert starts immediately, otherwise it is started from
+	the DMA interrupt as soon as the transferts before it are completed, in order.
+	Up to SPI_QUEUE_SIZE transferts can wait, \ref SPI_QUEUE_FULL is thrown otherwise.
+	The buffers must remain valid until the callback is called.
+	
+	\param	spi_id
+			SPI id. One of \ref spi_id.
+	\param	tx_buffer
+			The tx buffer pointer. Must be in DMA ram. Can be NULL.
+	\param	rx_buffer
+			The rx buffer pointer. Must be in DMA ram. Must be a valid buffer.
+	\param	xch_count
+			The number of spi transfert to do. A transfert size is choosed at \ref spi_init_master.
+	\param	ss
+			The chips select GPIO signal to use.
+	\param 	callback
+			The callback called when the transfert is done.
+*/
+void spi_queue_transfert(int spi_id, void * tx_buffer, void * rx_buffer, unsigned int xch_count, gpio ss, spi_transfert_done callback) {
+	spi_check_transfert(spi_id, tx_buffer, rx_buffer, xch_count);
 
-		gpio_write(ss, false);
-		gpio_set_dir(ss, GPIO_OUTPUT);
+	spi_queue(spi_id, tx_buffer, rx_buffer, xch_count, NULL, 0, ss, callback);
+}
 
+/**
+	Start a scatter-gather SPI transfert
+	
+	The chip select is asserted once for all the segments, which are chained from the DMA
+	interrupt. Each segment can send, receive or both, so a command and its payload
+	can be transfered without copying them in a single buffer.
+	The SPI must be idle, use spi_queue_transfert_sg() otherwise.
+	The segments and their buffers must remain valid until the callback is called.
+	
+	\param	spi_id
+			SPI id. One of \ref spi_id.
+	\param	segments
+			The segments to transfer, in order.
+	\param	segment_count
+			The number of segments.
+	\param	ss
+			The chips select GPIO signal to use.
+	\param 	callback
+			The callback called when the whole transfert is done.
+*/
+void spi_start_transfert_sg(int spi_id, const spi_segment * segments, unsigned int segment_count, gpio ss, spi_transfert_done callback) {
+	spi_check_transfert_sg(spi_id, segments, segment_count);
+	if(spi_status[spi_id].busy) {
+		ERROR(SPI_BUSY, &spi_id);
+	}
 
-		if(start_tx_dma == -1) 
-			/** Do a null write on spibuf */
-			SPI1BUF = 0;
-		else
-			dma_start_transfer(start_tx_dma);
-			
-	} else if (spi_id == SPI_2) {
-		/* Do a dummy read of the register and clean any overflow */
-		(void *) SPI2BUF;
-		SPI2STATbits.SPIROV = 0;
+	spi_queue(spi_id, NULL, NULL, 0, segments, segment_count, ss, callback);
+}
 
-		if(!tx_buffer) {
-			/* Configure RX with null write */
-			dma_init_channel(spi_status[1].dma_rx, DMA_INTERRUPT_SOURCE_SPI_2, 	
-					spi_status[1].data_size == SPI_TRSF_BYTE ? DMA_SIZE_BYTE : DMA_SIZE_WORD,
-					DMA_DIR_FROM_PERIPHERAL_TO_RAM, DMA_INTERRUPT_AT_FULL, DMA_WRITE_NULL_TO_PERIPHERAL,
-					DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT, DMA_OPERATING_ONE_SHOT,
-					rx_buffer, 0, (void *) &SPI2BUF, xch_count, spi2_dma_cb);
-			spi_status[1].rxtx = 2;
-			dma_set_priority(spi_status[1].dma_rx, _SPI2IP);
-			dma_enable_channel(spi_status[1].dma_rx);
-			start_tx_dma = -1;
+/**
+	Queue a scatter-gather SPI transfert
 	
-		} else {
-			spi_status[1].rxtx = 1;
-			/* configure RX DMA channel */
-			dma_init_channel(spi_status[1].dma_rx, DMA_INTERRUPT_SOURCE_SPI_2, 	
-				spi_status[1].data_size == SPI_TRSF_BYTE ? DMA_SIZE_BYTE : DMA_SIZE_WORD,
-				DMA_DIR_FROM_PERIPHERAL_TO_RAM, DMA_INTERRUPT_AT_FULL, DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL,
-				DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT, DMA_OPERATING_ONE_SHOT,
-				rx_buffer, 0, (void *) &SPI2BUF, xch_count, spi2_dma_cb);
-				
-			dma_set_priority(spi_status[1].dma_rx, _SPI2IP);
-			dma_enable_channel(spi_status[1].dma_rx);
-			spi_status[1].rxtx |= 2;
-			
-			/* Configure TX DMA channel */
-			dma_init_channel(spi_status[1].dma_tx, DMA_INTERRUPT_SOURCE_SPI_2, 	
-				spi_status[1].data_size == SPI_TRSF_BYTE ? DMA_SIZE_BYTE : DMA_SIZE_WORD,
-				DMA_DIR_FROM_RAM_TO_PERIPHERAL, DMA_INTERRUPT_AT_FULL, DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL,
-				DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT, DMA_OPERATING_ONE_SHOT,
-				tx_buffer, 0, (void *) &SPI2BUF, xch_count, 0);
-			start_tx_dma = spi_status[1].dma_tx;
-
-			dma_set_priority(spi_status[1].dma_tx, _SPI2IP);
-			dma_enable_channel(spi_status[1].dma_tx);
-		}
-		spi_status[1].ss = ss;
-		spi_status[1].callback = callback;
-
-		gpio_write(ss, false);
-		gpio_set_dir(ss, GPIO_OUTPUT);
-		
+	Same as spi_start_transfert_sg(), but the transfert waits in the queue if the SPI is busy,
+	see spi_queue_transfert().
+	
+	\param	spi_id
+			SPI id. One of \ref spi_id.
+	\param	segments
+			The segments to transfer, in order.
+	\param	segment_count
+			The number of segments.
+	\param	ss
+			The chips select GPIO signal to use.
+	\param 	callback
+			The callback called when the whole transfert is done.
+*/
+void spi_queue_transfert_sg(int spi_id, const spi_segment * segments, unsigned int segment_count, gpio ss, spi_transfert_done callback) {
+	spi_check_transfert_sg(spi_id, segments, segment_count);
 
-		if(start_tx_dma == -1) 
-			/** Do a null write on spibuf */
-			SPI1BUF = 0;
-		else
-			dma_start_transfer(start_tx_dma);
-			
-	} else {
-		ERROR(SPI_INVALID_ID, &spi_id);
-	}
+	spi_queue(spi_id, NULL, NULL, 0, segments, segment_count, ss, callback);
 }
 
 /**
@@ -345,6 +534,22 @@ void spi_init_master(int spi_id, unsigned int speed_khz, int dma_rx, int dma_tx,
 		spi_status[0].dma_tx = dma_tx;
 		spi_status[0].priority = priority;
 		spi_status[0].data_size = transfert_mode;
+		spi_status[0].busy = false;
+		spi_status[0].queue_count = 0;
+
+		/* Configure the DMA channels once, transferts only change their buffer and count */
+		dma_init_channel(dma_rx, DMA_INTERRUPT_SOURCE_SPI_1, 
+			transfert_mode == SPI_TRSF_BYTE ? DMA_SIZE_BYTE : DMA_SIZE_WORD,
+			DMA_DIR_FROM_PERIPHERAL_TO_RAM, DMA_INTERRUPT_AT_FULL, DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL,
+			DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT, DMA_OPERATING_ONE_SHOT,
+			0, 0, (void *) &SPI1BUF, 1, spi1_dma_cb);
+		dma_set_priority(dma_rx, priority);
+		dma_init_channel(dma_tx, DMA_INTERRUPT_SOURCE_SPI_1, 
+			transfert_mode == SPI_TRSF_BYTE ? DMA_SIZE_BYTE : DMA_SIZE_WORD,
+			DMA_DIR_FROM_RAM_TO_PERIPHERAL, DMA_INTERRUPT_AT_FULL, DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL,
+			DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT, DMA_OPERATING_ONE_SHOT,
+			0, 0, (void *) &SPI1BUF, 1, 0);
+		dma_set_priority(dma_tx, priority);
 		SPI1STATbits.SPIEN = 1;				/* Enable SPI module */
 
 	} else if (spi_id == SPI_2) { 
@@ -394,6 +599,22 @@ void spi_init_master(int spi_id, unsigned int speed_khz, int dma_rx, int dma_tx,
 		spi_status[1].dma_tx = dma_tx;
 		spi_status[1].priority = priority;
 		spi_status[1].data_size = transfert_mode;
+		spi_status[1].busy = false;
+		spi_status[1].queue_count = 0;
+
+		/* Configure the DMA channels once, transferts only change their buffer and count */
+		dma_init_channel(dma_rx, DMA_INTERRUPT_SOURCE_SPI_2, 
+			transfert_mode == SPI_TRSF_BYTE ? DMA_SIZE_BYTE : DMA_SIZE_WORD,
+			DMA_DIR_FROM_PERIPHERAL_TO_RAM, DMA_INTERRUPT_AT_FULL, DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL,
+			DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT, DMA_OPERATING_ONE_SHOT,
+			0, 0, (void *) &SPI2BUF, 1, spi2_dma_cb);
+		dma_set_priority(dma_rx, priority);
+		dma_init_channel(dma_tx, DMA_INTERRUPT_SOURCE_SPI_2, 
+			transfert_mode == SPI_TRSF_BYTE ? DMA_SIZE_BYTE : DMA_SIZE_WORD,
+			DMA_DIR_FROM_RAM_TO_PERIPHERAL, DMA_INTERRUPT_AT_FULL, DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL,
+			DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT, DMA_OPERATING_ONE_SHOT,
+			0, 0, (void *) &SPI2BUF, 1, 0);
+		dma_set_priority(dma_tx, priority);
 		SPI2STATbits.SPIEN = 1;				/* Enable SPI module  */
 
 	} else {
@@ -448,10 +669,11 @@ void spi_init_slave(int spi_id, int transfert_mode, int polarity, int data_out_m
 		
 		SPI1STATbits.SPIEN = 1;				/* Enable module */
 	
-		_SPI1IF = 0;
-		_SPI1IE = 1;
-		
 		spi_status[0].slave_callback = data_cb;
+		spi_set_interrupt_handler(SPI_1, spi_slave_interrupt_1);
+		
+		_SPI1IF = 0;
+		_SPI1IE = data_cb != NULL;
 		
 	} else if(spi_id == SPI_2) {
 		SPI2STAT = 0;
@@ -468,10 +690,11 @@ void spi_init_slave(int spi_id, int transfert_mode, int polarity, int data_out_m
 		
 		SPI2STATbits.SPIEN = 1;				/* Enable module */
 	
-		_SPI2IF = 0;
-		_SPI2IE = 1;
-		
 		spi_status[1].slave_callback = data_cb;
+		spi_set_interrupt_handler(SPI_2, spi_slave_interrupt_2);
+		
+		_SPI2IF = 0;
+		_SPI2IE = data_cb != NULL;
 	
 	} else {
 		ERROR(SPI_INVALID_ID, &spi_id);
@@ -488,6 +711,132 @@ void spi_slave_write(int spi_id, unsigned int data) {
 		ERROR(SPI_INVALID_ID, &spi_id);
 	}
 }
+
+/**
+	Init an SPI in slave mode, streaming the data with DMA instead of interrupting on each word.
+	
+	Received words are written alternately in two buffers by a continuous ping-pong DMA channel,
+	and data_cb is called each time one of them is full, while the other one is being filled.
+	The tx buffer is sent in a loop by a continuous DMA channel, its content can be updated at any time.
+	
+	Because of errata 8, the slave select pin is not seen by the SPI module. To detect the frame
+	boundaries, the application must call spi_slave_stream_ss_edge() on the edges of the slave select
+	signal, for instance from an \ref ei or \ref cn callback.
+	
+	\param	spi_id
+			SPI id. One of \ref spi_id.
+	\param	transfert_mode
+			The SPI transfert size. Must be one of \ref spi_tranfert_size.
+	\param 	polarity
+			Used to specify the clock polarity. Must be one of \ref spi_clock_polarity.
+	\param 	data_out_mode
+			Used to specify when the data out must happend on the clock transition. Must be one of \ref spi_data_out_mode.
+	\param	dma_rx
+			The DMA channel used to receive. One of \ref dma_channels_identifiers.
+			Must have a higher number than dma_tx, so that the length of a partial frame can be known.
+	\param	dma_tx
+			The DMA channel used to send. One of \ref dma_channels_identifiers.
+	\param	rx_a
+			First receive buffer. Must be in DMA ram.
+	\param	rx_b
+			Second receive buffer. Must be in DMA ram.
+	\param	rx_count
+			The number of spi transfert of each receive buffer.
+	\param	tx_buffer
+			The data sent to the master. Must be in DMA ram.
+	\param	tx_count
+			The number of spi transfert of the tx buffer.
+	\param	data_cb
+			Function called when one of the receive buffers is full.
+	\param	frame_cb
+			Function called from spi_slave_stream_ss_edge(). Can be NULL.
+	\param 	priority
+			Interrupt priority, from 1 (lowest priority) to 6 (highest normal priority)
+*/
+void spi_init_slave_stream(int spi_id, int transfert_mode, int polarity, int data_out_mode, int dma_rx, int dma_tx, void * rx_a, void * rx_b, unsigned int rx_count, void * tx_buffer, unsigned int tx_count, spi_slave_stream_cb data_cb, spi_slave_frame_cb frame_cb, int priority) {
+	int size = transfert_mode == SPI_TRSF_BYTE ? DMA_SIZE_BYTE : DMA_SIZE_WORD;
+
+	ERROR_CHECK_RANGE(spi_id, SPI_1, SPI_2, SPI_INVALID_ID);
+	if(!rx_a || !rx_b || !tx_buffer) {
+		ERROR(DMA_ERROR_INVALID_ADDRESS, 0);
+	}
+	if(!rx_count || !tx_count || !data_cb) {
+		ERROR(SPI_INVALID_TRANSFERT, 0);
+	}
+	// the rx channel must be served last on each word, so that its last address is the last received word
+	if(dma_rx < dma_tx) {
+		ERROR(DMA_ERROR_INVALID_CHANNEL, &dma_rx);
+	}
+
+	// no per-word interrupt, the SPI interrupt flag only triggers the DMA
+	spi_init_slave(spi_id, transfert_mode, polarity, data_out_mode, NULL, priority);
+
+	spi_status[spi_id].dma_rx = dma_rx;
+	spi_status[spi_id].dma_tx = dma_tx;
+	spi_status[spi_id].priority = priority;
+	spi_status[spi_id].data_size = transfert_mode;
+	spi_status[spi_id].stream_rx[0] = rx_a;
+	spi_status[spi_id].stream_rx[1] = rx_b;
+	spi_status[spi_id].stream_count = rx_count;
+	spi_status[spi_id].stream_callback = data_cb;
+	spi_status[spi_id].frame_callback = frame_cb;
+
+	if(spi_id == SPI_1) {
+		dma_init_channel(dma_rx, DMA_INTERRUPT_SOURCE_SPI_1, size,
+			DMA_DIR_FROM_PERIPHERAL_TO_RAM, DMA_INTERRUPT_AT_FULL, DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL,
+			DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT, DMA_OPERATING_CONTINUOUS_PING_PONG,
+			rx_a, rx_b, (void *) &SPI1BUF, rx_count, spi1_stream_cb);
+		dma_init_channel(dma_tx, DMA_INTERRUPT_SOURCE_SPI_1, size,
+			DMA_DIR_FROM_RAM_TO_PERIPHERAL, DMA_INTERRUPT_AT_FULL, DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL,
+			DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT, DMA_OPERATING_CONTINUOUS,
+			tx_buffer, 0, (void *) &SPI1BUF, tx_count, 0);
+	} else {
+		dma_init_channel(dma_rx, DMA_INTERRUPT_SOURCE_SPI_2, size,
+			DMA_DIR_FROM_PERIPHERAL_TO_RAM, DMA_INTERRUPT_AT_FULL, DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL,
+			DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT, DMA_OPERATING_CONTINUOUS_PING_PONG,
+			rx_a, rx_b, (void *) &SPI2BUF, rx_count, spi2_stream_cb);
+		dma_init_channel(dma_tx, DMA_INTERRUPT_SOURCE_SPI_2, size,
+			DMA_DIR_FROM_RAM_TO_PERIPHERAL, DMA_INTERRUPT_AT_FULL, DMA_DO_NOT_NULL_WRITE_TO_PERIPHERAL,
+			DMA_ADDRESSING_REGISTER_INDIRECT_POST_INCREMENT, DMA_OPERATING_CONTINUOUS,
+			tx_buffer, 0, (void *) &SPI2BUF, tx_count, 0);
+	}
+	dma_set_priority(dma_rx, priority);
+	dma_set_priority(dma_tx, priority);
+
+	spi_slave_stream_restart(spi_id);
+}
+
+/**
+	Notify a slave stream of an edge of the slave select signal.
+	
+	When the master releases the slave select, the DMA channels are restarted at the beginning of their
+	buffers, so that every frame is received from the start of the first buffer and answered with the
+	start of the tx buffer, whatever the length of the previous frame.
+	
+	The words of the frame that did not fill a whole receive buffer are given to the frame callback
+	before the restart, with their count. The DMA controller only records the most recent access of
+	all its channels, so if another channel ran since the last received word, or if the frame was empty,
+	the count is \ref SPI_STREAM_COUNT_UNKNOWN and the tail of the frame is lost.
+	
+	\param	spi_id
+			SPI id. One of \ref spi_id.
+	\param	selected
+			true when the slave select has been asserted, false when it has been released.
+*/
+void spi_slave_stream_ss_edge(int spi_id, bool selected) {
+	void * rx_buffer = NULL;
+	unsigned int rx_count = 0;
+
+	ERROR_CHECK_RANGE(spi_id, SPI_1, SPI_2, SPI_INVALID_ID);
+
+	if(!selected) {
+		rx_count = spi_slave_stream_received(spi_id, &rx_buffer);
+		spi_slave_stream_restart(spi_id);
+	}
+
+	if(spi_status[spi_id].frame_callback)
+		spi_status[spi_id].frame_callback(spi_id, selected, rx_buffer, rx_count);
+}
 	
 
 /*@}*/
@@ -51,6 +51,8 @@ enum spi_errors
 	SPI_INVALID_DATA_OUT_MODE,	/**< The specified data out mode is invalide */
 	SPI_INVALID_SAMPLE_PHASE,	/**< The specified sample phase mode is invalid */
 	SPI_INVALID_TRANSFERT,		/**< An invalide transfert has been requested */
+	SPI_BUSY,					/**< A transfert was started while another one was in progress */
+	SPI_QUEUE_FULL,				/**< No more room in the transfert queue */
 };
 
 
@@ -87,10 +89,24 @@ enum spi_sample_phase
 };
 typedef void (*spi_transfert_done)(int spi_id);
 
+/** One segment of a scatter-gather transfert, see spi_start_transfert_sg() */
+typedef struct
+{
+	void * tx_buffer;			/**< data to send, in DMA ram; NULL to send zeros */
+	void * rx_buffer;			/**< where to store received data, in DMA ram; NULL to discard them */
+	unsigned int xch_count;		/**< number of spi transfert of this segment */
+} spi_segment;
+
 void spi_init_master(int spi_id, unsigned int speed_khz, int dma_rx, int dma_tx, int transfert_mode, int polarity, int data_out_mode, int sample_phase, int priority);
 
 void spi_start_transfert(int spi_id, void * tx_buffer, void * rx_buffer, unsigned int xch_count, gpio ss, spi_transfert_done callback);
 
+void spi_queue_transfert(int spi_id, void * tx_buffer, void * rx_buffer, unsigned int xch_count, gpio ss, spi_transfert_done callback);
+
+void spi_start_transfert_sg(int spi_id, const spi_segment * segments, unsigned int segment_count, gpio ss, spi_transfert_done callback);
+
+void spi_queue_transfert_sg(int spi_id, const spi_segment * segments, unsigned int segment_count, gpio ss, spi_transfert_done callback);
+
 void spi_transfert_sync(int spi_id, void * tx_buffer, void * rx_buffer, unsigned int xch_count, gpio ss);
 
 	
@@ -100,6 +116,22 @@ void spi_init_slave(int spi_id, int transfert_mode, int polarity, int data_out_m
 
 void spi_slave_write(int spi_id, unsigned int data);
 
+/** Callback when one of the two buffers of a slave stream has been filled, first_buffer is true for the first one */
+typedef void (*spi_slave_stream_cb)(int spi_id, void * rx_buffer, bool first_buffer);
+
+/** Number of words of a partial frame of a slave stream, when the DMA could not tell it */
+#define SPI_STREAM_COUNT_UNKNOWN	0xFFFF
+
+/**
+	Callback on a frame boundary of a slave stream, selected is true when the master asserts the slave select.
+	On release, rx_buffer holds the rx_count last words of the frame which did not fill a whole buffer.
+*/
+typedef void (*spi_slave_frame_cb)(int spi_id, bool selected, void * rx_buffer, unsigned int rx_count);
+
+void spi_init_slave_stream(int spi_id, int transfert_mode, int polarity, int data_out_mode, int dma_rx, int dma_tx, void * rx_a, void * rx_b, unsigned int rx_count, void * tx_buffer, unsigned int tx_count, spi_slave_stream_cb data_cb, spi_slave_frame_cb frame_cb, int priority);
+
+void spi_slave_stream_ss_edge(int spi_id, bool selected);
+
 	
 /*@}*/
 
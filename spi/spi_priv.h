@@ -0,0 +1,11 @@
+#ifndef _SPI_PRIV_H
+#define _SPI_PRIV_H
+
+/** Function handling the interrupt of one SPI, the interrupt flag being already cleared */
+typedef void (*spi_interrupt_handler)(void);
+
+// Shared by the DMA and the non-DMA SPI modules, which may each drive one of the two SPI
+
+void spi_set_interrupt_handler(int spi_id, spi_interrupt_handler handler);
+
+#endif // _SPI_PRIV_H
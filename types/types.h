@@ -111,10 +111,14 @@ enum irq_prio
 #define atomic_and(x,y) do { __asm__ volatile ("and.w %[yy], [%[xx]], [%[xx]]": : [xx] "r" (x), [yy] "r"(y): "cc","memory"); } while(0)
 /** Atomic or operation to prevent race conditions inside interrupts: *x = (*x) | y */
 #define atomic_or(x,y) do { __asm__ volatile ("ior.w %[yy], [%[xx]], [%[xx]]" : : [xx] "r" (x), [yy] "r"(y): "cc","memory"); } while(0)
+/** Atomic xor operation to prevent race conditions inside interrupts: *x = (*x) ^ y */
+#define atomic_xor(x,y) do { __asm__ volatile ("xor.w %[yy], [%[xx]], [%[xx]]" : : [xx] "r" (x), [yy] "r"(y): "cc","memory"); } while(0)
 
 /** Atomic addition *x = (*x) + y */
 #define atomic_add(x,y) do { __asm__ volatile ("add.w %[yy], [%[xx]], [%[xx]]": : [xx] "r" (x), [yy] "r"(y): "cc","memory"); } while(0)
 #define atomic_add_and_test(x,y) ({unsigned int _r = 0;  __asm__ volatile ("add.w %[yy], [%[xx]], [%[xx]]\n bra Z,1f\n setm %[oo]\n1:": [oo] "+r" (_r) : [xx] "r" (x), [yy] "r"(y): "cc","memory"); _r;})
+/** Atomic subtraction *x = (*x) - y */
+#define atomic_sub(x,y) do { __asm__ volatile ("subr.w %[yy], [%[xx]], [%[xx]]": : [xx] "r" (x), [yy] "r"(y): "cc","memory"); } while(0)
 
 /*@}*/
 